@@ -0,0 +1,1155 @@
+// jpge.cpp - C++ class for JPEG compression.
+// Public domain, Rich Geldreich <richgel99@gmail.com>
+// v1.01, Dec. 18, 2010 - Initial release
+// v1.02, Apr. 6, 2011 - Removed 2x2 ordered dither in H2V1 chroma subsampling method load_block_16_8_8(). (The rounding factor was 2, when it should have been 1. Either way, it wasn't helping.)
+// v1.03, Apr. 16, 2011 - Added support for optimized Huffman code tables, optimized dynamic memory allocation down to only 1 alloc.
+//                        Also from Alex Evans: Added RGBA support, linear memory allocator (no longer needed in v1.03).
+// v1.04, May. 19, 2012: Forgot to set m_pFile ptr to NULL in cfile_stream::close(). Thanks to Owen Kaluza for reporting this bug.
+//                       Code tweaks to fix VS2008 static code analysis warnings (all looked harmless).
+//                       Code review revealed method load_block_16_8_8() (used for the non-default H2V1 sampling mode to downsample chroma) somehow didn't get the rounding factor fix from v1.02.
+
+#include "jpge.h"
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#endif
+
+#define JPGE_MAX(a,b) (((a)>(b))?(a):(b))
+#define JPGE_MIN(a,b) (((a)<(b))?(a):(b))
+
+namespace jpge {
+
+    static inline void *jpge_malloc(size_t nSize) {
+        void * b = malloc(nSize);
+        if(b){
+            return b;
+        }
+    // check if SPIRAM is enabled and allocate on SPIRAM if allocatable
+#if (CONFIG_SPIRAM_SUPPORT && (CONFIG_SPIRAM_USE_CAPS_ALLOC || CONFIG_SPIRAM_USE_MALLOC))
+        return heap_caps_malloc(nSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+        return NULL;
+#endif
+    }
+    static inline void jpge_free(void *p) { free(p); }
+
+    // Various JPEG enums and tables.
+    enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_RST0 = 0xD0, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_APP0 = 0xE0 };
+    enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
+
+    static const uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
+    static const int16 s_std_lum_quant[64] = { 16,11,12,14,12,10,16,14,13,14,18,17,16,19,24,40,26,24,22,22,24,49,35,37,29,40,58,51,61,60,57,51,56,55,64,72,92,78,64,68,87,69,55,56,80,109,81,87,95,98,103,104,103,62,77,113,121,112,100,120,92,101,103,99 };
+    static const int16 s_std_croma_quant[64] = { 17,18,18,24,21,24,47,26,26,47,99,66,56,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99 };
+    static const uint8 s_dc_lum_bits[17] = { 0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 };
+    static const uint8 s_dc_lum_val[DC_LUM_CODES] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+    static const uint8 s_ac_lum_bits[17] = { 0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d };
+    static const uint8 s_ac_lum_val[AC_LUM_CODES]  = {
+        0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,
+        0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
+        0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+        0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,
+        0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+        0xf9,0xfa
+    };
+    static const uint8 s_dc_chroma_bits[17] = { 0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 };
+    static const uint8 s_dc_chroma_val[DC_CHROMA_CODES]  = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+    static const uint8 s_ac_chroma_bits[17] = { 0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 };
+    static const uint8 s_ac_chroma_val[AC_CHROMA_CODES] = {
+        0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,
+        0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,
+        0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+        0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,
+        0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+        0xf9,0xfa
+    };
+
+    const int YR = 19595, YG = 38470, YB = 7471, CB_R = -11059, CB_G = -21709, CB_B = 32768, CR_R = 32768, CR_G = -27439, CR_B = -5329;
+
+    // Quantization tables of each quality and the standard Huffman tables.
+    // They are computed the first time they are needed and never change after,
+    // so any number of encoders can read them at the same time.
+    // m_recip and m_shift divide the scaled output of DCT2D by the quantizer, see compute_quant_table().
+    struct quant_tables {
+        int32 m_tables[2][64];
+        uint16 m_recip[2][64];
+        uint8 m_shift[2][64];
+    };
+
+    struct huffman_tables {
+        uint m_codes[4][256];
+        uint8 m_code_sizes[4][256];
+        uint8 m_bits[4][17];
+        uint8 m_val[4][256];
+    };
+
+    // Symbols of the first pass of a two pass encode, in the order they are written.
+    // Each entry is (table << 24) | (symbol << 16) | extra bits, or SYMBOL_RESTART | marker.
+    enum { SYMBOL_CHUNK_SIZE = 1024, SYMBOL_RESTART = 0xFF000000 };
+    struct symbol_chunk {
+        symbol_chunk *m_next;
+        uint m_count;
+        uint32 m_entries[SYMBOL_CHUNK_SIZE];
+    };
+
+    static quant_tables *s_quant_tables[101];
+    static huffman_tables *s_std_huffman_tables;
+
+    // Publish a table set unless another encoder was faster, then use that one
+    template <typename T> static const T *publish_tables(T **slot, T *tables) {
+        T *expected = NULL;
+        if (!__atomic_compare_exchange_n(slot, &expected, tables, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            jpge_free(tables);
+            return expected;
+        }
+        return tables;
+    }
+
+    static inline uint8 clamp(int i) {
+        if (i < 0) {
+            i = 0;
+        } else if (i > 255){
+            i = 255;
+        }
+        return static_cast<uint8>(i);
+    }
+
+    static void RGB_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        for ( ; num_pixels; pDst += 3, pSrc += 3, num_pixels--) {
+            const int r = pSrc[0], g = pSrc[1], b = pSrc[2];
+            pDst[0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
+            pDst[1] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
+            pDst[2] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
+        }
+    }
+
+    static void RGB_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        for ( ; num_pixels; pDst++, pSrc += 3, num_pixels--) {
+            pDst[0] = static_cast<uint8>((pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) >> 16);
+        }
+    }
+
+    static void Y_to_YCC(uint8* pDst, const uint8* pSrc, int num_pixels) {
+        for( ; num_pixels; pDst += 3, pSrc++, num_pixels--) {
+            pDst[0] = pSrc[0];
+            pDst[1] = 128;
+            pDst[2] = 128;
+        }
+    }
+
+    // Forward DCT - AAN (Arai, Agui and Nakajima) scaled DCT derived from jfdctfst.
+    // It takes 5 multiplications per row or column instead of 12, because the outputs are left
+    // scaled by 8 * s_aan_scale[u] * s_aan_scale[v] << PASS_BITS. That scale is folded into the
+    // reciprocals of the quantization tables, so quantizing costs no more than it did before.
+    enum { CONST_BITS = 14, PASS_BITS = 3 };
+#define DCT_DESCALE(x, n) (((x) + (((int32)1) << ((n) - 1))) >> (n))
+#define DCT_MUL(var, c) DCT_DESCALE((var) * static_cast<int32>(c), CONST_BITS)
+#define DCT1D(s0, s1, s2, s3, s4, s5, s6, s7) \
+    int32 t0 = s0 + s7, t7 = s0 - s7, t1 = s1 + s6, t6 = s1 - s6, t2 = s2 + s5, t5 = s2 - s5, t3 = s3 + s4, t4 = s3 - s4; \
+    int32 t10 = t0 + t3, t13 = t0 - t3, t11 = t1 + t2, t12 = t1 - t2; \
+    int32 z1 = DCT_MUL(t12 + t13, 11585); \
+    s0 = t10 + t11; s4 = t10 - t11; s2 = t13 + z1; s6 = t13 - z1; \
+    t10 = t4 + t5; t11 = t5 + t6; t12 = t6 + t7; \
+    int32 z5 = DCT_MUL(t10 - t12, 6270); \
+    int32 z2 = DCT_MUL(t10, 8867) + z5; \
+    int32 z4 = DCT_MUL(t12, 21407) + z5; \
+    int32 z3 = DCT_MUL(t11, 11585); \
+    int32 z11 = t7 + z3, z13 = t7 - z3; \
+    s5 = z13 + z2; s3 = z13 - z2; s1 = z11 + z4; s7 = z11 - z4;
+
+    static void DCT2D(int32 *p) {
+        int32 c, *q = p;
+        for (c = 7; c >= 0; c--, q += 8) {
+            int32 s0 = q[0] << PASS_BITS, s1 = q[1] << PASS_BITS, s2 = q[2] << PASS_BITS, s3 = q[3] << PASS_BITS;
+            int32 s4 = q[4] << PASS_BITS, s5 = q[5] << PASS_BITS, s6 = q[6] << PASS_BITS, s7 = q[7] << PASS_BITS;
+            DCT1D(s0, s1, s2, s3, s4, s5, s6, s7);
+            q[0] = s0; q[1] = s1; q[2] = s2; q[3] = s3; q[4] = s4; q[5] = s5; q[6] = s6; q[7] = s7;
+        }
+        for (q = p, c = 7; c >= 0; c--, q++) {
+            int32 s0 = q[0*8], s1 = q[1*8], s2 = q[2*8], s3 = q[3*8], s4 = q[4*8], s5 = q[5*8], s6 = q[6*8], s7 = q[7*8];
+            DCT1D(s0, s1, s2, s3, s4, s5, s6, s7);
+            q[0*8] = s0; q[1*8] = s1; q[2*8] = s2; q[3*8] = s3; q[4*8] = s4; q[5*8] = s5; q[6*8] = s6; q[7*8] = s7;
+        }
+    }
+
+    // Scale of the row and column outputs of DCT2D: 1 for DC, sqrt(2) * cos(k * pi / 16) otherwise.
+    static const double s_aan_scale[8] = { 1.0, 1.387039845, 1.306562965, 1.175875602, 1.0, 0.785694958, 0.541196100, 0.275899379 };
+
+    // Compute the actual canonical Huffman codes/code sizes given the JPEG huff bits and val arrays.
+    static void compute_huffman_table(uint *codes, uint8 *code_sizes, const uint8 *bits, const uint8 *val)
+    {
+        uint code = 0;
+        int p = 0;
+
+        memset(codes, 0, sizeof(codes[0])*256);
+        memset(code_sizes, 0, sizeof(code_sizes[0])*256);
+        for (int l = 1; l <= 16; l++) {
+            for (int i = 1; i <= bits[l]; i++, p++) {
+                codes[val[p]]      = code++;
+                code_sizes[val[p]] = static_cast<uint8>(l);
+            }
+            code <<= 1;
+        }
+    }
+
+    struct sym_freq {
+        uint m_key, m_sym_index;
+    };
+
+    // Ascending frequency, the dummy symbol first among the least frequent ones
+    static int sym_freq_compare(const void *a, const void *b)
+    {
+        const sym_freq *x = static_cast<const sym_freq*>(a), *y = static_cast<const sym_freq*>(b);
+        if (x->m_key != y->m_key) {
+            return (x->m_key < y->m_key) ? -1 : 1;
+        }
+        return (int)x->m_sym_index - (int)y->m_sym_index;
+    }
+
+    // calculate_minimum_redundancy() originally written by: Alistair Moffat, alistair@cs.mu.oz.au, Jyrki Katajainen, jyrki@diku.dk, November 1996.
+    // Replaces the frequencies of A, sorted in ascending order, by the code sizes.
+    static void calculate_minimum_redundancy(sym_freq *A, int n)
+    {
+        int root, leaf, next, avbl, used, dpth;
+        if (n == 0) {
+            return;
+        } else if (n == 1) {
+            A[0].m_key = 1;
+            return;
+        }
+        A[0].m_key += A[1].m_key; root = 0; leaf = 2;
+        for (next = 1; next < n - 1; next++)
+        {
+            if (leaf >= n || A[root].m_key < A[leaf].m_key) {
+                A[next].m_key = A[root].m_key; A[root++].m_key = next;
+            } else {
+                A[next].m_key = A[leaf++].m_key;
+            }
+            if (leaf >= n || (root < next && A[root].m_key < A[leaf].m_key)) {
+                A[next].m_key += A[root].m_key; A[root++].m_key = next;
+            } else {
+                A[next].m_key += A[leaf++].m_key;
+            }
+        }
+        A[n - 2].m_key = 0;
+        for (next = n - 3; next >= 0; next--) {
+            A[next].m_key = A[A[next].m_key].m_key + 1;
+        }
+        avbl = 1; used = dpth = 0; root = n - 2; next = n - 1;
+        while (avbl > 0)
+        {
+            while (root >= 0 && (int)A[root].m_key == dpth) {
+                used++; root--;
+            }
+            while (avbl > used) {
+                A[next--].m_key = dpth; avbl--;
+            }
+            avbl = 2 * used; dpth++; used = 0;
+        }
+    }
+
+    // Limits the canonical Huffman code sizes to max_code_size, keeping the code complete.
+    static void huffman_enforce_max_code_size(int *pNum_codes, int code_list_len, int max_code_size)
+    {
+        if (code_list_len <= 1) {
+            return;
+        }
+        for (int i = max_code_size + 1; i <= MAX_HUFF_CODESIZE; i++) {
+            pNum_codes[max_code_size] += pNum_codes[i];
+        }
+        uint32 total = 0;
+        for (int i = max_code_size; i > 0; i--) {
+            total += (((uint32)pNum_codes[i]) << (max_code_size - i));
+        }
+        while (total != (1UL << max_code_size))
+        {
+            pNum_codes[max_code_size]--;
+            for (int i = max_code_size - 1; i > 0; i--)
+            {
+                if (pNum_codes[i]) {
+                    pNum_codes[i]--; pNum_codes[i + 1] += 2;
+                    break;
+                }
+            }
+            total--;
+        }
+    }
+
+    // Build the JPEG bits and val arrays of an optimal Huffman code, limited to 16 bits, for the symbol counts.
+    // syms is scratch space for MAX_HUFF_SYMBOLS entries.
+    static void optimize_huffman_table(uint8 *bits, uint8 *val, const uint32 *pSym_count, int table_len, sym_freq *syms)
+    {
+        const int JPGE_CODE_SIZE_LIMIT = 16;
+
+        // dummy symbol, assures that no valid code contains all 1's
+        syms[0].m_key = 1; syms[0].m_sym_index = 0;
+        int num_used_syms = 1;
+        for (int i = 0; i < table_len; i++) {
+            if (pSym_count[i]) {
+                syms[num_used_syms].m_key = pSym_count[i]; syms[num_used_syms++].m_sym_index = i + 1;
+            }
+        }
+        qsort(syms, num_used_syms, sizeof(sym_freq), sym_freq_compare);
+        calculate_minimum_redundancy(syms, num_used_syms);
+
+        // Count the # of symbols of each code size.
+        int num_codes[1 + MAX_HUFF_CODESIZE];
+        memset(num_codes, 0, sizeof(num_codes));
+        for (int i = 0; i < num_used_syms; i++) {
+            num_codes[JPGE_MIN(syms[i].m_key, (uint)MAX_HUFF_CODESIZE)]++;
+        }
+
+        huffman_enforce_max_code_size(num_codes, num_used_syms, JPGE_CODE_SIZE_LIMIT);
+
+        // The # of symbols per code size.
+        memset(bits, 0, 17);
+        for (int i = 1; i <= JPGE_CODE_SIZE_LIMIT; i++) {
+            bits[i] = static_cast<uint8>(num_codes[i]);
+        }
+
+        // Remove the dummy symbol added above, which must be in largest bucket.
+        for (int i = JPGE_CODE_SIZE_LIMIT; i >= 1; i--)
+        {
+            if (bits[i]) {
+                bits[i]--;
+                break;
+            }
+        }
+
+        // The symbols sorted by code size, smallest to largest.
+        for (int i = num_used_syms - 1; i >= 1; i--) {
+            val[num_used_syms - 1 - i] = static_cast<uint8>(syms[i].m_sym_index - 1);
+        }
+    }
+
+    // Quantization table generation.
+    // Every coefficient is quantized as (|x| * recip + (1 << (shift - 1))) >> shift, where recip is
+    // 2^shift divided by the quantizer and the scale of DCT2D. recip stays below 2^15 and the DCT
+    // outputs below 2^17, so the product fits in 32 bits unsigned.
+    static void compute_quant_table(int32 *pDst, uint16 *pRecip, uint8 *pShift, const int16 *pSrc, int quality)
+    {
+        int32 q;
+        if (quality < 50)
+            q = 5000 / quality;
+        else
+            q = 200 - quality * 2;
+        for (int i = 0; i < 64; i++)
+        {
+            int32 j = *pSrc++; j = (j * q + 50L) / 100L;
+            *pDst = JPGE_MIN(JPGE_MAX(j, 1), 255);
+            double divisor = *pDst++ * s_aan_scale[s_zag[i] >> 3] * s_aan_scale[s_zag[i] & 7] * (8 << PASS_BITS);
+            int shift = 0;
+            while ((2.0 * (1 << shift)) / divisor < 32767.0)
+                shift++;
+            *pRecip++ = static_cast<uint16>((1 << shift) / divisor + 0.5);
+            *pShift++ = static_cast<uint8>(shift);
+        }
+    }
+
+    static const quant_tables *get_quant_tables(int quality)
+    {
+        quant_tables *tables = __atomic_load_n(&s_quant_tables[quality], __ATOMIC_ACQUIRE);
+        if (tables) {
+            return tables;
+        }
+        if ((tables = static_cast<quant_tables*>(jpge_malloc(sizeof(quant_tables)))) == NULL) {
+            return NULL;
+        }
+        compute_quant_table(tables->m_tables[0], tables->m_recip[0], tables->m_shift[0], s_std_lum_quant, quality);
+        compute_quant_table(tables->m_tables[1], tables->m_recip[1], tables->m_shift[1], s_std_croma_quant, quality);
+        return publish_tables(&s_quant_tables[quality], tables);
+    }
+
+    static const huffman_tables *get_std_huffman_tables()
+    {
+        huffman_tables *tables = __atomic_load_n(&s_std_huffman_tables, __ATOMIC_ACQUIRE);
+        if (tables) {
+            return tables;
+        }
+        if ((tables = static_cast<huffman_tables*>(jpge_malloc(sizeof(huffman_tables)))) == NULL) {
+            return NULL;
+        }
+        memcpy(tables->m_bits[0+0], s_dc_lum_bits, 17);    memcpy(tables->m_val[0+0], s_dc_lum_val, DC_LUM_CODES);
+        memcpy(tables->m_bits[2+0], s_ac_lum_bits, 17);    memcpy(tables->m_val[2+0], s_ac_lum_val, AC_LUM_CODES);
+        memcpy(tables->m_bits[0+1], s_dc_chroma_bits, 17); memcpy(tables->m_val[0+1], s_dc_chroma_val, DC_CHROMA_CODES);
+        memcpy(tables->m_bits[2+1], s_ac_chroma_bits, 17); memcpy(tables->m_val[2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+        for (int i = 0; i < 4; i++) {
+            compute_huffman_table(tables->m_codes[i], tables->m_code_sizes[i], tables->m_bits[i], tables->m_val[i]);
+        }
+        return publish_tables(&s_std_huffman_tables, tables);
+    }
+
+    void jpeg_encoder::flush_output_buffer()
+    {
+        if (m_out_buf_left != (uint)m_params.m_out_buf_size) {
+            m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, m_params.m_out_buf_size - m_out_buf_left);
+        }
+        m_pOut_buf = m_out_buf;
+        m_out_buf_left = m_params.m_out_buf_size;
+    }
+
+    void jpeg_encoder::emit_byte(uint8 i)
+    {
+        *m_pOut_buf++ = i;
+        if (--m_out_buf_left == 0) {
+            flush_output_buffer();
+        }
+    }
+
+    // Write 8 bytes of the bit stream. A 0xFF byte must be followed by a 0, but most words have none,
+    // so they are checked all at once: only the bytes that were 0xFF keep their top bit when 1 is added.
+    void jpeg_encoder::put_bit_word(uint64 bits)
+    {
+        if ((bits & 0x8080808080808080ULL & ~(bits + 0x0101010101010101ULL)) || (m_out_buf_left < 8)) {
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                uint8 c = static_cast<uint8>(bits >> shift);
+                emit_byte(c);
+                if (c == 0xFF) {
+                    emit_byte(0);
+                }
+            }
+            return;
+        }
+        m_pOut_buf[0] = static_cast<uint8>(bits >> 56); m_pOut_buf[1] = static_cast<uint8>(bits >> 48);
+        m_pOut_buf[2] = static_cast<uint8>(bits >> 40); m_pOut_buf[3] = static_cast<uint8>(bits >> 32);
+        m_pOut_buf[4] = static_cast<uint8>(bits >> 24); m_pOut_buf[5] = static_cast<uint8>(bits >> 16);
+        m_pOut_buf[6] = static_cast<uint8>(bits >> 8);  m_pOut_buf[7] = static_cast<uint8>(bits);
+        m_pOut_buf += 8;
+        if ((m_out_buf_left -= 8) == 0) {
+            flush_output_buffer();
+        }
+    }
+
+    // m_bit_buffer keeps the last m_bits_in bits, the bytes are written 8 at a time.
+    // len is at most 32 and bits must not have any bit set above len.
+    void jpeg_encoder::put_bits(uint bits, uint len)
+    {
+        if (m_bits_in + len <= 64) {
+            m_bit_buffer = (m_bit_buffer << len) | bits;
+            m_bits_in += len;
+            return;
+        }
+        uint over = m_bits_in + len - 64;
+        put_bit_word((m_bit_buffer << (len - over)) | (static_cast<uint64>(bits) >> over));
+        m_bit_buffer = bits;
+        m_bits_in = over;
+    }
+
+    // Pad the last byte with 1 bits, as needed before a marker
+    void jpeg_encoder::flush_bits()
+    {
+        put_bits(0x7F, 7);
+        while (m_bits_in >= 8) {
+            m_bits_in -= 8;
+            uint8 c = static_cast<uint8>(m_bit_buffer >> m_bits_in);
+            emit_byte(c);
+            if (c == 0xFF) {
+                emit_byte(0);
+            }
+        }
+        m_bit_buffer = 0;
+        m_bits_in = 0;
+    }
+
+    void jpeg_encoder::emit_word(uint i)
+    {
+        emit_byte(uint8(i >> 8)); emit_byte(uint8(i & 0xFF));
+    }
+
+    // JPEG marker generation.
+    void jpeg_encoder::emit_marker(int marker)
+    {
+        emit_byte(uint8(0xFF)); emit_byte(uint8(marker));
+    }
+
+    // Emit JFIF marker
+    void jpeg_encoder::emit_jfif_app0()
+    {
+        emit_marker(M_APP0);
+        emit_word(2 + 4 + 1 + 2 + 1 + 2 + 2 + 1 + 1);
+        emit_byte(0x4A); emit_byte(0x46); emit_byte(0x49); emit_byte(0x46); /* Identifier: ASCII "JFIF" */
+        emit_byte(0);
+        emit_byte(1);      /* Major version */
+        emit_byte(1);      /* Minor version */
+        emit_byte(0);      /* Density unit */
+        emit_word(1);
+        emit_word(1);
+        emit_byte(0);      /* No thumbnail image */
+        emit_byte(0);
+    }
+
+    // Emit quantization tables
+    void jpeg_encoder::emit_dqt()
+    {
+        for (int i = 0; i < ((m_num_components == 3) ? 2 : 1); i++)
+        {
+            emit_marker(M_DQT);
+            emit_word(64 + 1 + 2);
+            emit_byte(static_cast<uint8>(i));
+            for (int j = 0; j < 64; j++)
+                emit_byte(static_cast<uint8>(m_quant->m_tables[i][j]));
+        }
+    }
+
+    // Emit start of frame marker
+    void jpeg_encoder::emit_sof()
+    {
+        emit_marker(M_SOF0);                           /* baseline */
+        emit_word(3 * m_num_components + 2 + 5 + 1);
+        emit_byte(8);                                  /* precision */
+        emit_word(m_image_y);
+        emit_word(m_image_x);
+        emit_byte(m_num_components);
+        for (int i = 0; i < m_num_components; i++)
+        {
+            emit_byte(static_cast<uint8>(i + 1));                                   /* component ID     */
+            emit_byte((m_comp_h_samp[i] << 4) + m_comp_v_samp[i]);  /* h and v sampling */
+            emit_byte(i > 0);                                   /* quant. table num */
+        }
+    }
+
+    // Emit Huffman table.
+    void jpeg_encoder::emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag)
+    {
+        emit_marker(M_DHT);
+
+        int length = 0;
+        for (int i = 1; i <= 16; i++)
+            length += bits[i];
+
+        emit_word(length + 2 + 1 + 16);
+        emit_byte(static_cast<uint8>(index + (ac_flag << 4)));
+
+        for (int i = 1; i <= 16; i++)
+            emit_byte(bits[i]);
+
+        for (int i = 0; i < length; i++)
+            emit_byte(val[i]);
+    }
+
+    // Emit all Huffman tables.
+    void jpeg_encoder::emit_dhts()
+    {
+        emit_dht(m_huff->m_bits[0+0], m_huff->m_val[0+0], 0, false);
+        emit_dht(m_huff->m_bits[2+0], m_huff->m_val[2+0], 0, true);
+        if (m_num_components == 3) {
+            emit_dht(m_huff->m_bits[0+1], m_huff->m_val[0+1], 1, false);
+            emit_dht(m_huff->m_bits[2+1], m_huff->m_val[2+1], 1, true);
+        }
+    }
+
+    // Emit define restart interval, in MCUs
+    void jpeg_encoder::emit_dri()
+    {
+        emit_marker(M_DRI);
+        emit_word(4);
+        emit_word(m_params.m_restart_rows * m_mcus_per_row);
+    }
+
+    // emit start of scan
+    void jpeg_encoder::emit_sos()
+    {
+        emit_marker(M_SOS);
+        emit_word(2 * m_num_components + 2 + 1 + 3);
+        emit_byte(m_num_components);
+        for (int i = 0; i < m_num_components; i++)
+        {
+            emit_byte(static_cast<uint8>(i + 1));
+            if (i == 0)
+                emit_byte((0 << 4) + 0);
+            else
+                emit_byte((1 << 4) + 1);
+        }
+        emit_byte(0);     /* spectral selection */
+        emit_byte(63);
+        emit_byte(0);
+    }
+
+    void jpeg_encoder::load_block_8_8_grey(int x)
+    {
+        uint8 *pSrc;
+        sample_array_t *pDst = m_sample_array;
+        x <<= 3;
+        for (int i = 0; i < 8; i++, pDst += 8)
+        {
+            pSrc = m_mcu_lines[i] + x;
+            pDst[0] = pSrc[0] - 128; pDst[1] = pSrc[1] - 128; pDst[2] = pSrc[2] - 128; pDst[3] = pSrc[3] - 128;
+            pDst[4] = pSrc[4] - 128; pDst[5] = pSrc[5] - 128; pDst[6] = pSrc[6] - 128; pDst[7] = pSrc[7] - 128;
+        }
+    }
+
+    void jpeg_encoder::load_block_8_8(int x, int y, int c)
+    {
+        uint8 *pSrc;
+        sample_array_t *pDst = m_sample_array;
+        x = (x * (8 * 3)) + c;
+        y <<= 3;
+        for (int i = 0; i < 8; i++, pDst += 8)
+        {
+            pSrc = m_mcu_lines[y + i] + x;
+            pDst[0] = pSrc[0 * 3] - 128; pDst[1] = pSrc[1 * 3] - 128; pDst[2] = pSrc[2 * 3] - 128; pDst[3] = pSrc[3 * 3] - 128;
+            pDst[4] = pSrc[4 * 3] - 128; pDst[5] = pSrc[5 * 3] - 128; pDst[6] = pSrc[6 * 3] - 128; pDst[7] = pSrc[7 * 3] - 128;
+        }
+    }
+
+    void jpeg_encoder::load_block_16_8(int x, int c)
+    {
+        uint8 *pSrc1, *pSrc2;
+        sample_array_t *pDst = m_sample_array;
+        x = (x * (16 * 3)) + c;
+        int a = 0, b = 2;
+        for (int i = 0; i < 16; i += 2, pDst += 8)
+        {
+            pSrc1 = m_mcu_lines[i + 0] + x;
+            pSrc2 = m_mcu_lines[i + 1] + x;
+            pDst[0] = ((pSrc1[ 0 * 3] + pSrc1[ 1 * 3] + pSrc2[ 0 * 3] + pSrc2[ 1 * 3] + a) >> 2) - 128; pDst[1] = ((pSrc1[ 2 * 3] + pSrc1[ 3 * 3] + pSrc2[ 2 * 3] + pSrc2[ 3 * 3] + b) >> 2) - 128;
+            pDst[2] = ((pSrc1[ 4 * 3] + pSrc1[ 5 * 3] + pSrc2[ 4 * 3] + pSrc2[ 5 * 3] + a) >> 2) - 128; pDst[3] = ((pSrc1[ 6 * 3] + pSrc1[ 7 * 3] + pSrc2[ 6 * 3] + pSrc2[ 7 * 3] + b) >> 2) - 128;
+            pDst[4] = ((pSrc1[ 8 * 3] + pSrc1[ 9 * 3] + pSrc2[ 8 * 3] + pSrc2[ 9 * 3] + a) >> 2) - 128; pDst[5] = ((pSrc1[10 * 3] + pSrc1[11 * 3] + pSrc2[10 * 3] + pSrc2[11 * 3] + b) >> 2) - 128;
+            pDst[6] = ((pSrc1[12 * 3] + pSrc1[13 * 3] + pSrc2[12 * 3] + pSrc2[13 * 3] + a) >> 2) - 128; pDst[7] = ((pSrc1[14 * 3] + pSrc1[15 * 3] + pSrc2[14 * 3] + pSrc2[15 * 3] + b) >> 2) - 128;
+            int temp = a; a = b; b = temp;
+        }
+    }
+
+    void jpeg_encoder::load_block_16_8_8(int x, int c)
+    {
+        uint8 *pSrc1;
+        sample_array_t *pDst = m_sample_array;
+        x = (x * (16 * 3)) + c;
+        for (int i = 0; i < 8; i++, pDst += 8)
+        {
+            pSrc1 = m_mcu_lines[i + 0] + x;
+            pDst[0] = ((pSrc1[ 0 * 3] + pSrc1[ 1 * 3]) >> 1) - 128; pDst[1] = ((pSrc1[ 2 * 3] + pSrc1[ 3 * 3]) >> 1) - 128;
+            pDst[2] = ((pSrc1[ 4 * 3] + pSrc1[ 5 * 3]) >> 1) - 128; pDst[3] = ((pSrc1[ 6 * 3] + pSrc1[ 7 * 3]) >> 1) - 128;
+            pDst[4] = ((pSrc1[ 8 * 3] + pSrc1[ 9 * 3]) >> 1) - 128; pDst[5] = ((pSrc1[10 * 3] + pSrc1[11 * 3]) >> 1) - 128;
+            pDst[6] = ((pSrc1[12 * 3] + pSrc1[13 * 3]) >> 1) - 128; pDst[7] = ((pSrc1[14 * 3] + pSrc1[15 * 3]) >> 1) - 128;
+        }
+    }
+
+    void jpeg_encoder::load_quantized_coefficients(int component_num)
+    {
+        const uint16 *recip = m_quant->m_recip[component_num > 0];
+        const uint8 *shift = m_quant->m_shift[component_num > 0];
+        int16 *pDst = m_coefficient_array;
+        for (int i = 0; i < 64; i++)
+        {
+            sample_array_t j = m_sample_array[s_zag[i]];
+            if (j < 0)
+                *pDst++ = static_cast<int16>(-static_cast<int32>((static_cast<uint32>(-j) * recip[i] + (1U << (shift[i] - 1))) >> shift[i]));
+            else
+                *pDst++ = static_cast<int16>((static_cast<uint32>(j) * recip[i] + (1U << (shift[i] - 1))) >> shift[i]);
+        }
+    }
+
+    // Number of bits of a coefficient magnitude, a single NSAU instruction on Xtensa
+    static inline int bit_count(uint32 x)
+    {
+        return x ? 32 - __builtin_clz(x) : 0;
+    }
+
+    void jpeg_encoder::code_coefficients_pass_two(int component_num)
+    {
+        int i, j, run_len, nbits, temp1, temp2;
+        int16 *pSrc = m_coefficient_array;
+        const uint *codes[2];
+        const uint8 *code_sizes[2];
+
+        if (component_num == 0)
+        {
+            codes[0] = m_huff->m_codes[0 + 0]; codes[1] = m_huff->m_codes[2 + 0];
+            code_sizes[0] = m_huff->m_code_sizes[0 + 0]; code_sizes[1] = m_huff->m_code_sizes[2 + 0];
+        }
+        else
+        {
+            codes[0] = m_huff->m_codes[0 + 1]; codes[1] = m_huff->m_codes[2 + 1];
+            code_sizes[0] = m_huff->m_code_sizes[0 + 1]; code_sizes[1] = m_huff->m_code_sizes[2 + 1];
+        }
+
+        temp1 = temp2 = pSrc[0] - m_last_dc_val[component_num];
+        m_last_dc_val[component_num] = pSrc[0];
+
+        if (temp1 < 0)
+        {
+            temp1 = -temp1; temp2--;
+        }
+
+        nbits = bit_count(temp1);
+        put_bits((codes[0][nbits] << nbits) | (temp2 & ((1 << nbits) - 1)), code_sizes[0][nbits] + nbits);
+
+        for (run_len = 0, i = 1; i < 64; i++)
+        {
+            if ((temp1 = m_coefficient_array[i]) == 0)
+                run_len++;
+            else
+            {
+                while (run_len >= 16)
+                {
+                    put_bits(codes[1][0xF0], code_sizes[1][0xF0]);
+                    run_len -= 16;
+                }
+                if ((temp2 = temp1) < 0)
+                {
+                    temp1 = -temp1;
+                    temp2--;
+                }
+                nbits = bit_count(temp1);
+                j = (run_len << 4) + nbits;
+                put_bits((codes[1][j] << nbits) | (temp2 & ((1 << nbits) - 1)), code_sizes[1][j] + nbits);
+                run_len = 0;
+            }
+        }
+        if (run_len)
+            put_bits(codes[1][0], code_sizes[1][0]);
+    }
+
+    // Count a symbol and keep it with its extra bits for the second pass
+    void jpeg_encoder::record_symbol(uint32 entry)
+    {
+        if (entry < SYMBOL_RESTART) {
+            m_huff_count[entry >> 16]++;
+        }
+        if (!m_last_chunk || m_last_chunk->m_count == SYMBOL_CHUNK_SIZE) {
+            symbol_chunk *chunk = static_cast<symbol_chunk*>(jpge_malloc(sizeof(symbol_chunk)));
+            if (!chunk) {
+                m_all_stream_writes_succeeded = false;
+                return;
+            }
+            chunk->m_next = NULL;
+            chunk->m_count = 0;
+            if (m_last_chunk) {
+                m_last_chunk->m_next = chunk;
+            } else {
+                m_first_chunk = chunk;
+            }
+            m_last_chunk = chunk;
+        }
+        m_last_chunk->m_entries[m_last_chunk->m_count++] = entry;
+    }
+
+    // Same symbols as code_coefficients_pass_two(), recorded instead of written
+    void jpeg_encoder::code_coefficients_pass_one(int component_num)
+    {
+        int i, run_len, nbits, temp1, temp2;
+        uint32 dc_table = (0 + (component_num > 0)) << 24, ac_table = (2 + (component_num > 0)) << 24;
+
+        temp1 = temp2 = m_coefficient_array[0] - m_last_dc_val[component_num];
+        m_last_dc_val[component_num] = m_coefficient_array[0];
+
+        if (temp1 < 0)
+        {
+            temp1 = -temp1; temp2--;
+        }
+
+        nbits = bit_count(temp1);
+        record_symbol(dc_table | (nbits << 16) | (temp2 & ((1 << nbits) - 1)));
+
+        for (run_len = 0, i = 1; i < 64; i++)
+        {
+            if ((temp1 = m_coefficient_array[i]) == 0)
+                run_len++;
+            else
+            {
+                while (run_len >= 16)
+                {
+                    record_symbol(ac_table | (0xF0 << 16));
+                    run_len -= 16;
+                }
+                if ((temp2 = temp1) < 0)
+                {
+                    temp1 = -temp1;
+                    temp2--;
+                }
+                nbits = bit_count(temp1);
+                record_symbol(ac_table | (((run_len << 4) + nbits) << 16) | (temp2 & ((1 << nbits) - 1)));
+                run_len = 0;
+            }
+        }
+        if (run_len)
+            record_symbol(ac_table);
+    }
+
+    void jpeg_encoder::code_block(int component_num)
+    {
+        DCT2D(m_sample_array);
+        load_quantized_coefficients(component_num);
+        if (m_pass_num == 1) {
+            code_coefficients_pass_one(component_num);
+        } else {
+            code_coefficients_pass_two(component_num);
+        }
+    }
+
+    // Build the Huffman tables of the symbols of the first pass, write the headers and then the symbols
+    bool jpeg_encoder::emit_recorded_symbols()
+    {
+        huffman_tables *tables = static_cast<huffman_tables*>(jpge_malloc(sizeof(huffman_tables)));
+        sym_freq *syms = static_cast<sym_freq*>(jpge_malloc(MAX_HUFF_SYMBOLS * sizeof(sym_freq)));
+        if (!tables || !syms) {
+            jpge_free(tables);
+            jpge_free(syms);
+            return false;
+        }
+        memset(tables, 0, sizeof(huffman_tables));
+        for (int i = 0; i < 4; i++) {
+            if ((i & 1) && (m_num_components == 1)) {
+                continue; // no chroma tables
+            }
+            optimize_huffman_table(tables->m_bits[i], tables->m_val[i], &m_huff_count[i * 256], (i < 2) ? DC_LUM_CODES : AC_LUM_CODES, syms);
+            compute_huffman_table(tables->m_codes[i], tables->m_code_sizes[i], tables->m_bits[i], tables->m_val[i]);
+        }
+        jpge_free(syms);
+        m_own_huff = tables;
+        m_huff = tables;
+
+        m_pass_num = 2;
+        emit_start_markers();
+        for (symbol_chunk *chunk = m_first_chunk; chunk; chunk = chunk->m_next) {
+            for (uint i = 0; i < chunk->m_count; i++) {
+                uint32 entry = chunk->m_entries[i];
+                if (entry >= SYMBOL_RESTART) {
+                    flush_bits();
+                    emit_marker(entry & 0xFF);
+                    continue;
+                }
+                uint table = entry >> 24, symbol = (entry >> 16) & 0xFF;
+                uint nbits = (table < 2) ? symbol : (symbol & 0xF);
+                put_bits((tables->m_codes[table][symbol] << nbits) | (entry & ((1 << nbits) - 1)), tables->m_code_sizes[table][symbol] + nbits);
+            }
+        }
+        free_symbols();
+        return true;
+    }
+
+    void jpeg_encoder::free_symbols()
+    {
+        while (m_first_chunk) {
+            symbol_chunk *next = m_first_chunk->m_next;
+            jpge_free(m_first_chunk);
+            m_first_chunk = next;
+        }
+        m_last_chunk = NULL;
+    }
+
+    void jpeg_encoder::process_mcu_row()
+    {
+        if (m_num_components == 1)
+        {
+            for (int i = 0; i < m_mcus_per_row; i++)
+            {
+                load_block_8_8_grey(i); code_block(0);
+            }
+        }
+        else if ((m_comp_h_samp[0] == 1) && (m_comp_v_samp[0] == 1))
+        {
+            for (int i = 0; i < m_mcus_per_row; i++)
+            {
+                load_block_8_8(i, 0, 0); code_block(0); load_block_8_8(i, 0, 1); code_block(1); load_block_8_8(i, 0, 2); code_block(2);
+            }
+        }
+        else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 1))
+        {
+            for (int i = 0; i < m_mcus_per_row; i++)
+            {
+                load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
+                load_block_16_8_8(i, 1); code_block(1); load_block_16_8_8(i, 2); code_block(2);
+            }
+        }
+        else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 2))
+        {
+            for (int i = 0; i < m_mcus_per_row; i++)
+            {
+                load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
+                load_block_8_8(i * 2 + 0, 1, 0); code_block(0); load_block_8_8(i * 2 + 1, 1, 0); code_block(0);
+                load_block_16_8(i, 1); code_block(1); load_block_16_8(i, 2); code_block(2);
+            }
+        }
+    }
+
+    void jpeg_encoder::load_mcu(const void *pSrc)
+    {
+        const uint8* Psrc = reinterpret_cast<const uint8*>(pSrc);
+
+        uint8* pDst = m_mcu_lines[m_mcu_y_ofs]; // OK to write up to m_image_bpl_xlt bytes to pDst
+
+        if (m_num_components == 1) {
+            if (m_image_bpp == 3)
+                RGB_to_Y(pDst, Psrc, m_image_x);
+            else
+                memcpy(pDst, Psrc, m_image_x);
+        } else {
+            if (m_image_bpp == 3)
+                RGB_to_YCC(pDst, Psrc, m_image_x);
+            else
+                Y_to_YCC(pDst, Psrc, m_image_x);
+        }
+
+        // Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
+        if (m_num_components == 1)
+            memset(m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt, pDst[m_image_bpl_xlt - 1], m_image_x_mcu - m_image_x);
+        else
+        {
+            const uint8 y = pDst[m_image_bpl_xlt - 3 + 0], cb = pDst[m_image_bpl_xlt - 3 + 1], cr = pDst[m_image_bpl_xlt - 3 + 2];
+            uint8 *q = m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt;
+            for (int i = m_image_x; i < m_image_x_mcu; i++)
+            {
+                *q++ = y; *q++ = cb; *q++ = cr;
+            }
+        }
+
+        if (++m_mcu_y_ofs == m_mcu_y)
+        {
+            process_mcu_row();
+            m_mcu_y_ofs = 0;
+            next_mcu_row();
+        }
+    }
+
+    // After every m_restart_rows MCU rows, except at the end of the image, the entropy coding
+    // starts over behind a RSTn marker, so the following rows can be coded on their own
+    void jpeg_encoder::next_mcu_row()
+    {
+        m_mcu_row++;
+        if ((m_params.m_restart_rows == 0) || (m_mcu_row % m_params.m_restart_rows) || (m_mcu_row == m_image_y_mcu / m_mcu_y)) {
+            return;
+        }
+        if (m_pass_num == 1) {
+            record_symbol(SYMBOL_RESTART | (M_RST0 + ((m_mcu_row / m_params.m_restart_rows - 1) & 7)));
+        } else {
+            flush_bits();
+            emit_marker(M_RST0 + ((m_mcu_row / m_params.m_restart_rows - 1) & 7));
+        }
+        memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+    }
+
+    // Higher-level methods.
+    bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
+    {
+        if ((m_quant = get_quant_tables(m_params.m_quality)) == NULL) {
+            return false;
+        }
+        if ((m_huff = get_std_huffman_tables()) == NULL) {
+            return false;
+        }
+
+        m_num_components = 3;
+        switch (m_params.m_subsampling)
+        {
+            case Y_ONLY:
+            {
+                m_num_components = 1;
+                m_comp_h_samp[0] = 1; m_comp_v_samp[0] = 1;
+                m_mcu_x          = 8; m_mcu_y          = 8;
+                break;
+            }
+            case H1V1:
+            {
+                m_comp_h_samp[0] = 1; m_comp_v_samp[0] = 1;
+                m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
+                m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
+                m_mcu_x          = 8; m_mcu_y          = 8;
+                break;
+            }
+            case H2V1:
+            {
+                m_comp_h_samp[0] = 2; m_comp_v_samp[0] = 1;
+                m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
+                m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
+                m_mcu_x          = 16; m_mcu_y         = 8;
+                break;
+            }
+            case H2V2:
+            {
+                m_comp_h_samp[0] = 2; m_comp_v_samp[0] = 2;
+                m_comp_h_samp[1] = 1; m_comp_v_samp[1] = 1;
+                m_comp_h_samp[2] = 1; m_comp_v_samp[2] = 1;
+                m_mcu_x          = 16; m_mcu_y         = 16;
+            }
+        }
+
+        m_image_x        = p_x_res; m_image_y = p_y_res;
+        m_image_bpp      = src_channels;
+        m_image_bpl      = m_image_x * src_channels;
+        m_image_x_mcu    = (m_image_x + m_mcu_x - 1) & (~(m_mcu_x - 1));
+        m_image_y_mcu    = (m_image_y + m_mcu_y - 1) & (~(m_mcu_y - 1));
+        m_image_bpl_xlt  = m_image_x * m_num_components;
+        m_image_bpl_mcu  = m_image_x_mcu * m_num_components;
+        m_mcus_per_row   = m_image_x_mcu / m_mcu_x;
+
+        if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(m_image_bpl_mcu * m_mcu_y))) == NULL) {
+            return false;
+        }
+        for (int i = 1; i < m_mcu_y; i++)
+            m_mcu_lines[i] = m_mcu_lines[i-1] + m_image_bpl_mcu;
+
+        // A strip starts at a restart marker, and the rest of the image needs a valid restart interval
+        if ((m_first_line % m_mcu_y) || (m_first_line >= m_image_y)) {
+            return false;
+        }
+        m_mcu_row = m_first_line / m_mcu_y;
+        if (m_params.m_restart_rows) {
+            if ((m_mcu_row % m_params.m_restart_rows) || (m_params.m_restart_rows * m_mcus_per_row > 0xFFFF)) {
+                return false;
+            }
+        } else if (m_mcu_row) {
+            return false;
+        }
+        // The tables of a two pass encode only fit the whole image
+        if (m_params.m_two_pass_flag && m_mcu_row) {
+            return false;
+        }
+
+        if ((m_out_buf = static_cast<uint8*>(jpge_malloc(m_params.m_out_buf_size))) == NULL) {
+            return false;
+        }
+        m_out_buf_left = m_params.m_out_buf_size;
+        m_pOut_buf = m_out_buf;
+        m_bit_buffer = 0;
+        m_bits_in = 0;
+        m_mcu_y_ofs = 0;
+        memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+
+        // The first pass only counts symbols, the markers are written with the optimized tables
+        if (m_params.m_two_pass_flag) {
+            if ((m_huff_count = static_cast<uint32*>(jpge_malloc(4 * 256 * sizeof(uint32)))) == NULL) {
+                return false;
+            }
+            memset(m_huff_count, 0, 4 * 256 * sizeof(uint32));
+            m_pass_num = 1;
+            return true;
+        }
+
+        // Strips after the first continue the scan.
+        m_pass_num = 2;
+        if (m_mcu_row == 0) {
+            emit_start_markers();
+        }
+
+        return m_all_stream_writes_succeeded;
+    }
+
+    // Emit all markers at beginning of image file.
+    void jpeg_encoder::emit_start_markers()
+    {
+        emit_marker(M_SOI);
+        emit_jfif_app0();
+        emit_dqt();
+        emit_sof();
+        emit_dhts();
+        if (m_params.m_restart_rows) {
+            emit_dri();
+        }
+        emit_sos();
+    }
+
+    bool jpeg_encoder::process_end_of_image()
+    {
+        // A strip before the last one ends on a restart marker, which was emitted with its last row
+        if (m_mcu_row + (m_mcu_y_ofs ? 1 : 0) < m_image_y_mcu / m_mcu_y) {
+            if (m_mcu_y_ofs || (m_params.m_restart_rows == 0) || (m_mcu_row % m_params.m_restart_rows) || (m_pass_num == 1)) {
+                return false;
+            }
+            flush_output_buffer();
+            m_pass_num++;
+            return true;
+        }
+
+        if (m_mcu_y_ofs) {
+            if (m_mcu_y_ofs < 16) { // check here just to shut up static analysis
+                for (int i = m_mcu_y_ofs; i < m_mcu_y; i++) {
+                    memcpy(m_mcu_lines[i], m_mcu_lines[m_mcu_y_ofs - 1], m_image_bpl_mcu);
+                }
+            }
+            process_mcu_row();
+        }
+
+        if (m_pass_num == 1) {
+            if (!m_all_stream_writes_succeeded || !emit_recorded_symbols()) {
+                return false;
+            }
+        }
+
+        flush_bits();
+        emit_marker(M_EOI);
+        flush_output_buffer();
+        m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(NULL, 0);
+        m_pass_num++; // purposely bump up m_pass_num, for debugging
+        return true;
+    }
+
+    void jpeg_encoder::clear()
+    {
+        m_mcu_lines[0] = NULL;
+        m_out_buf = NULL;
+        m_quant = NULL;
+        m_huff = NULL;
+        m_own_huff = NULL;
+        m_huff_count = NULL;
+        m_first_chunk = NULL;
+        m_last_chunk = NULL;
+        m_pass_num = 0;
+        m_all_stream_writes_succeeded = true;
+    }
+
+    jpeg_encoder::jpeg_encoder()
+    {
+        clear();
+    }
+
+    jpeg_encoder::~jpeg_encoder()
+    {
+        deinit();
+    }
+
+    bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params)
+    {
+        deinit();
+        if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
+        m_pStream = pStream;
+        m_params = comp_params;
+        m_first_line = 0;
+        return jpg_open(width, height, src_channels);
+    }
+
+    bool jpeg_encoder::init_strip(output_stream *pStream, int width, int height, int src_channels, int first_line, const params &comp_params)
+    {
+        deinit();
+        if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
+        m_pStream = pStream;
+        m_params = comp_params;
+        m_first_line = first_line;
+        return jpg_open(width, height, src_channels);
+    }
+
+    void jpeg_encoder::deinit()
+    {
+        jpge_free(m_mcu_lines[0]);
+        jpge_free(m_out_buf);
+        jpge_free(m_own_huff);
+        jpge_free(m_huff_count);
+        free_symbols();
+        clear();
+    }
+
+    bool jpeg_encoder::process_scanline(const void* pScanline)
+    {
+        if ((m_pass_num < 1) || (m_pass_num > 2)) {
+            return false;
+        }
+        if (m_all_stream_writes_succeeded) {
+            if (!pScanline) {
+                if (!process_end_of_image()) {
+                    return false;
+                }
+            } else {
+                load_mcu(pScanline);
+            }
+        }
+        return m_all_stream_writes_succeeded;
+    }
+
+} // namespace jpge
@@ -12,13 +12,14 @@ namespace jpge
     typedef unsigned short uint16;
     typedef unsigned int   uint32;
     typedef unsigned int   uint;
+    typedef unsigned long long uint64;
 
     // JPEG chroma subsampling factors. Y_ONLY (grayscale images) and H2V2 (color images) are the most common.
     enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
 
     // JPEG compression parameters structure.
     struct params {
-            inline params() : m_quality(85), m_subsampling(H2V2) { }
+            inline params() : m_quality(85), m_subsampling(H2V2), m_restart_rows(0), m_two_pass_flag(false), m_out_buf_size(2048) { }
 
             inline bool check() const {
                 if ((m_quality < 1) || (m_quality > 100)) {
@@ -27,6 +28,12 @@ namespace jpge
                 if ((uint)m_subsampling > (uint)H2V2) {
                     return false;
                 }
+                if (m_restart_rows < 0) {
+                    return false;
+                }
+                if (m_out_buf_size < 64) {
+                    return false;
+                }
                 return true;
             }
 
@@ -39,10 +46,28 @@ namespace jpge
             // 2 = H2V1 subsampling (YCbCr 2x1x1, 4 blocks per MCU)
             // 3 = H2V2 subsampling (YCbCr 4x1x1, 6 blocks per MCU-- very common)
             subsampling_t m_subsampling;
+
+            // Number of MCU rows between restart markers, 0 for none.
+            // Restart markers let strips of the image be encoded separately, see jpeg_encoder::init_strip().
+            int m_restart_rows;
+
+            // Disables the standard Huffman tables and uses tables optimized for the image instead, usually 5-10% smaller.
+            // The first pass keeps the symbols of the image in memory, they are written after the last scanline.
+            // Not available with init_strip() for strips after the first.
+            bool m_two_pass_flag;
+
+            // Bytes collected before each output_stream::put_buf() call, allocated by the encoder.
+            // Larger batches mean fewer calls, which matters for streams that send every call out.
+            int m_out_buf_size;
     };
     
+    // Tables shared read-only by all encoders, defined in jpge.cpp.
+    struct quant_tables;
+    struct huffman_tables;
+    struct symbol_chunk;
+
     // Output stream abstract class - used by the jpeg_encoder class to write to the output stream.
-    // put_buf() is generally called with len==JPGE_OUT_BUF_SIZE bytes, but for headers it'll be called with smaller amounts.
+    // put_buf() is generally called with len==params::m_out_buf_size bytes, but for headers it'll be called with smaller amounts.
     class output_stream {
         public:
             virtual ~output_stream() { };
@@ -51,6 +76,7 @@ namespace jpge
     };
     
     // Lower level jpeg_encoder class - useful if more control is needed than the above helper functions.
+    // Every instance has its own state, so several images can be encoded at the same time on different tasks.
     class jpeg_encoder {
         public:
             jpeg_encoder();
@@ -64,6 +90,13 @@ namespace jpge
             // Returns false on out of memory or if a stream write fails.
             bool init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params = params());
 
+            // Initializes the compressor for a strip of the image, starting at line first_line.
+            // first_line must be at a restart marker, a multiple of comp_params.m_restart_rows MCU rows.
+            // The strip at line 0 writes the headers, the strip that reaches the last line writes EOI,
+            // and every other strip ends with the RSTn marker in front of the next one.
+            // Writing the outputs of all strips one after the other gives the JPEG file.
+            bool init_strip(output_stream *pStream, int width, int height, int src_channels, int first_line, const params &comp_params);
+
             // Call this method with each source scanline.
             // width * src_channels bytes per scanline is expected (RGB or Y format).
             // You must call with NULL after all scanlines are processed to finish compression.
@@ -78,7 +111,6 @@ namespace jpge
             jpeg_encoder &operator =(const jpeg_encoder &);
 
             typedef int32 sample_array_t;
-            enum { JPGE_OUT_BUF_SIZE = 512 };
 
             output_stream *m_pStream;
             params m_params;
@@ -89,16 +121,22 @@ namespace jpge
             int m_image_bpl_xlt, m_image_bpl_mcu;
             int m_mcus_per_row;
             int m_mcu_x, m_mcu_y;
+            int m_first_line, m_mcu_row;
             uint8 *m_mcu_lines[16];
             uint8 m_mcu_y_ofs;
             sample_array_t m_sample_array[64];
             int16 m_coefficient_array[64];
 
+            const quant_tables *m_quant;
+            const huffman_tables *m_huff;
+            huffman_tables *m_own_huff;
+            uint32 *m_huff_count;
+            symbol_chunk *m_first_chunk, *m_last_chunk;
             int m_last_dc_val[3];
-            uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
+            uint8 *m_out_buf;
             uint8 *m_pOut_buf;
             uint m_out_buf_left;
-            uint32 m_bit_buffer;
+            uint64 m_bit_buffer;
             uint m_bits_in;
             uint8 m_pass_num;
             bool m_all_stream_writes_succeeded;
@@ -106,7 +144,9 @@ namespace jpge
             bool jpg_open(int p_x_res, int p_y_res, int src_channels);
 
             void flush_output_buffer();
+            void put_bit_word(uint64 bits);
             void put_bits(uint bits, uint len);
+            void flush_bits();
 
             void emit_byte(uint8 i);
             void emit_word(uint i);
@@ -115,11 +155,12 @@ namespace jpge
             void emit_jfif_app0();
             void emit_dqt();
             void emit_sof();
-            void emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag);
+            void emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag);
             void emit_dhts();
+            void emit_dri();
+            void emit_start_markers();
             void emit_sos();
 
-            void compute_quant_table(int32 *dst, const int16 *src);
             void load_quantized_coefficients(int component_num);
 
             void load_block_8_8_grey(int x);
@@ -127,10 +168,15 @@ namespace jpge
             void load_block_16_8(int x, int c);
             void load_block_16_8_8(int x, int c);
 
+            void record_symbol(uint32 entry);
+            void code_coefficients_pass_one(int component_num);
             void code_coefficients_pass_two(int component_num);
+            bool emit_recorded_symbols();
+            void free_symbols();
             void code_block(int component_num);
 
             void process_mcu_row();
+            void next_mcu_row();
             bool process_end_of_image();
             void load_mcu(const void* src);
             void clear();
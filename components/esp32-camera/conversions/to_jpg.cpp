@@ -13,6 +13,9 @@
 // limitations under the License.
 #include <stddef.h>
 #include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_attr.h"
 #include "soc/efuse_reg.h"
 #include "esp_heap_caps.h"
@@ -88,41 +91,108 @@ static IRAM_ATTR void convert_line_format(uint8_t * src, pixformat_t format, uin
     }
 }
 
-bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream)
-{
-    int num_channels = 3;
-    jpge::subsampling_t subsampling = jpge::H2V2;
+// Collects the output of a strip until the strips before it have been written
+class strip_stream : public jpge::output_stream {
+protected:
+    struct chunk {
+        chunk *next;
+        size_t len;
+        uint8_t data[4096];
+    };
+    chunk *first, *last;
+    size_t size;
 
-    if(format == PIXFORMAT_GRAYSCALE) {
-        num_channels = 1;
-        subsampling = jpge::Y_ONLY;
+public:
+    strip_stream() : first(NULL), last(NULL), size(0) { }
+    virtual ~strip_stream()
+    {
+        while (first) {
+            chunk *next = first->next;
+            free(first);
+            first = next;
+        }
     }
-
-    if(!quality) {
-        quality = 1;
-    } else if(quality > 100) {
-        quality = 100;
+    virtual bool put_buf(const void* pBuf, int len)
+    {
+        const uint8_t *data = static_cast<const uint8_t*>(pBuf);
+        if (!data) {
+            // the end of image is signalled after the last strip was written
+            return true;
+        }
+        while (len > 0) {
+            if (!last || last->len == sizeof(last->data)) {
+                chunk *c = (chunk *)_malloc(sizeof(chunk));
+                if (!c) {
+                    return false;
+                }
+                c->next = NULL;
+                c->len = 0;
+                if (last) {
+                    last->next = c;
+                } else {
+                    first = c;
+                }
+                last = c;
+            }
+            size_t n = sizeof(last->data) - last->len;
+            if (n > (size_t)len) {
+                n = len;
+            }
+            memcpy(last->data + last->len, data, n);
+            last->len += n;
+            size += n;
+            data += n;
+            len -= n;
+        }
+        return true;
     }
+    virtual size_t get_size() const
+    {
+        return size;
+    }
+    bool write_to(jpge::output_stream *dst_stream) const
+    {
+        for (chunk *c = first; c; c = c->next) {
+            if (!dst_stream->put_buf(c->data, c->len)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
 
-    jpge::params comp_params = jpge::params();
-    comp_params.m_subsampling = subsampling;
-    comp_params.m_quality = quality;
-
+typedef struct {
+    uint8_t *src;
+    uint16_t width;
+    uint16_t height;
+    pixformat_t format;
+    int num_channels;
+    jpge::params comp_params;
+    int first_line;
+    int last_line;
+    jpge::output_stream *stream;
+    bool ok;
+    SemaphoreHandle_t done;
+} strip_job_t;
+
+// Encode lines first_line to last_line, the whole image when first_line is 0 and last_line is height
+static bool encode_strip(strip_job_t *job)
+{
     jpge::jpeg_encoder dst_image;
 
-    if (!dst_image.init(dst_stream, width, height, num_channels, comp_params)) {
+    if (!dst_image.init_strip(job->stream, job->width, job->height, job->num_channels, job->first_line, job->comp_params)) {
         ESP_LOGE(TAG, "JPG encoder init failed");
         return false;
     }
 
-    uint8_t* line = (uint8_t*)_malloc(width * num_channels);
+    uint8_t* line = (uint8_t*)_malloc(job->width * job->num_channels);
     if(!line) {
         ESP_LOGE(TAG, "Scan line malloc failed");
         return false;
     }
 
-    for (int i = 0; i < height; i++) {
-        convert_line_format(src, format, line, width, num_channels, i);
+    for (int i = job->first_line; i < job->last_line; i++) {
+        convert_line_format(job->src, job->format, line, job->width, job->num_channels, i);
         if (!dst_image.process_scanline(line)) {
             ESP_LOGE(TAG, "JPG process line %u failed", i);
             free(line);
@@ -139,6 +209,121 @@ bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t fo
     return true;
 }
 
+static void encode_strip_task(void *arg)
+{
+    strip_job_t *job = (strip_job_t *)arg;
+    job->ok = encode_strip(job);
+    xSemaphoreGive(job->done);
+    vTaskDelete(NULL);
+}
+
+#if CONFIG_CAMERA_JPEG_ENCODE_TASKS > 1
+#define JPEG_ENCODE_TASKS CONFIG_CAMERA_JPEG_ENCODE_TASKS
+#else
+#define JPEG_ENCODE_TASKS 1
+#endif
+
+#ifdef CONFIG_CAMERA_JPEG_OUT_BUF_SIZE
+#define JPEG_OUT_BUF_SIZE CONFIG_CAMERA_JPEG_OUT_BUF_SIZE
+#else
+#define JPEG_OUT_BUF_SIZE 2048
+#endif
+
+// Split the image into strips of whole MCU rows, encoded at the same time with the DC prediction
+// restarting at every strip. The first strip is written directly by the calling task,
+// the others are kept in memory by worker tasks until the strips before them are out.
+static bool convert_image_strips(strip_job_t *job, int mcu_height, int strips)
+{
+    int mcu_rows = (job->height + mcu_height - 1) / mcu_height;
+    int rows_per_strip = (mcu_rows + strips - 1) / strips;
+    strips = (mcu_rows + rows_per_strip - 1) / rows_per_strip;
+
+    strip_job_t jobs[JPEG_ENCODE_TASKS];
+    strip_stream streams[JPEG_ENCODE_TASKS];
+    bool started[JPEG_ENCODE_TASKS] = { false };
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(strips, 0);
+    if (!done) {
+        return encode_strip(job);
+    }
+
+    int core = xPortGetCoreID();
+    for (int i = 0; i < strips; i++) {
+        jobs[i] = *job;
+        jobs[i].comp_params.m_restart_rows = rows_per_strip;
+        jobs[i].first_line = i * rows_per_strip * mcu_height;
+        jobs[i].last_line = (i + 1) * rows_per_strip * mcu_height;
+        if (jobs[i].last_line > job->height) {
+            jobs[i].last_line = job->height;
+        }
+        jobs[i].stream = (i == 0) ? job->stream : &streams[i];
+        jobs[i].ok = false;
+        jobs[i].done = done;
+        if (i > 0) {
+            started[i] = xTaskCreatePinnedToCore(encode_strip_task, "jpg_strip", 4096, &jobs[i],
+                uxTaskPriorityGet(NULL), NULL, (core + i) % portNUM_PROCESSORS) == pdPASS;
+        }
+    }
+
+    // Strips without a worker are encoded here, after the first one
+    bool ok = encode_strip(&jobs[0]);
+    for (int i = 1; i < strips; i++) {
+        if (started[i]) {
+            xSemaphoreTake(done, portMAX_DELAY);
+        }
+    }
+    for (int i = 1; i < strips; i++) {
+        if (!started[i]) {
+            jobs[i].ok = encode_strip(&jobs[i]);
+        }
+        ok = ok && jobs[i].ok && streams[i].write_to(job->stream);
+    }
+    vSemaphoreDelete(done);
+
+    return ok && job->stream->put_buf(NULL, 0);
+}
+
+bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream)
+{
+    int num_channels = 3;
+    int mcu_height = 16;
+    jpge::subsampling_t subsampling = jpge::H2V2;
+
+    if(format == PIXFORMAT_GRAYSCALE) {
+        num_channels = 1;
+        mcu_height = 8;
+        subsampling = jpge::Y_ONLY;
+    }
+
+    if(!quality) {
+        quality = 1;
+    } else if(quality > 100) {
+        quality = 100;
+    }
+
+    strip_job_t job;
+    job.src = src;
+    job.width = width;
+    job.height = height;
+    job.format = format;
+    job.num_channels = num_channels;
+    job.comp_params = jpge::params();
+    job.comp_params.m_subsampling = subsampling;
+    job.comp_params.m_quality = quality;
+    job.comp_params.m_out_buf_size = JPEG_OUT_BUF_SIZE;
+#if CONFIG_CAMERA_JPEG_OPTIMIZE_HUFFMAN
+    job.comp_params.m_two_pass_flag = true;
+#endif
+    job.first_line = 0;
+    job.last_line = height;
+    job.stream = dst_stream;
+
+    // The optimized tables are made for the whole frame, so it cannot be split
+    if (JPEG_ENCODE_TASKS > 1 && height > mcu_height && !job.comp_params.m_two_pass_flag) {
+        return convert_image_strips(&job, mcu_height, JPEG_ENCODE_TASKS);
+    }
+    return encode_strip(&job);
+}
+
 class callback_stream : public jpge::output_stream {
 protected:
     jpg_out_cb ocb;
@@ -18,6 +18,7 @@
 #include "esp_heap_caps.h"
 #include "ll_cam.h"
 #include "cam_hal.h"
+#include "cam_jpeg_scan.h"
 
 #if (ESP_IDF_VERSION_MAJOR == 3) && (ESP_IDF_VERSION_MINOR == 3)
 #include "rom/ets_sys.h"
@@ -41,35 +42,18 @@
 
 static const char *TAG = "cam_hal";
 static cam_obj_t *cam_obj = NULL;
+static camera_stats_t cam_stats;
 
-static const uint32_t JPEG_SOI_MARKER = 0xFFD8FF;  // written in little-endian for esp32
-static const uint16_t JPEG_EOI_MARKER = 0xD9FF;  // written in little-endian for esp32
+#define JPEG_EOI_MARKER_LEN 2
 
 static int cam_verify_jpeg_soi(const uint8_t *inbuf, uint32_t length)
 {
-    for (uint32_t i = 0; i < length; i++) {
-        if (memcmp(&inbuf[i], &JPEG_SOI_MARKER, 3) == 0) {
-            //ESP_LOGW(TAG, "SOI: %d", (int) i);
-            return i;
-        }
-    }
-    ESP_LOGW(TAG, "NO-SOI");
-    return -1;
-}
-
-static int cam_verify_jpeg_eoi(const uint8_t *inbuf, uint32_t length)
-{
-    int offset = -1;
-    uint8_t *dptr = (uint8_t *)inbuf + length - 2;
-    while (dptr > inbuf) {
-        if (memcmp(dptr, &JPEG_EOI_MARKER, 2) == 0) {
-            offset = dptr - inbuf;
-            //ESP_LOGW(TAG, "EOI: %d", length - (offset + 2));
-            return offset;
-        }
-        dptr--;
+    int offset = cam_jpeg_find_soi(inbuf, length);
+    if (offset < 0) {
+        ESP_LOGW(TAG, "NO-SOI");
+        cam_stats.no_soi++;
     }
-    return -1;
+    return offset;
 }
 
 static bool cam_get_next_frame(int * frame_pos)
@@ -111,6 +95,18 @@ void IRAM_ATTR ll_cam_send_event(cam_obj_t *cam, cam_event_t cam_event, BaseType
     }
 }
 
+// Part of the frame buffer written by the DMA for buffer cnt in PSRAM mode
+static size_t cam_psram_received(camera_fb_t *fb, int cnt, uint8_t **received)
+{
+    size_t offset = cnt * cam_obj->dma_half_buffer_size;
+    if (offset + cam_obj->dma_half_buffer_size > cam_obj->recv_size) {
+        // The descriptors wrap around after recv_size
+        return 0;
+    }
+    *received = &fb->buf[offset];
+    return cam_obj->dma_half_buffer_size;
+}
+
 //Copy fram from DMA dma_buffer to fram dma_buffer
 static void cam_task(void *arg)
 {
@@ -118,6 +114,9 @@ static void cam_task(void *arg)
     int frame_pos = 0;
     cam_obj->state = CAM_STATE_IDLE;
     cam_event_t cam_event = 0;
+    // The EOI marker is searched in every buffer as it arrives, so cam_take doesn't have to
+    cam_jpeg_scan_t scan;
+    cam_jpeg_scan_reset(&scan);
 
     xQueueReset(cam_obj->event_queue);
 
@@ -134,6 +133,7 @@ static void cam_task(void *arg)
                         cam_obj->state = CAM_STATE_READ_BUF;
                     }
                     cnt = 0;
+                    cam_jpeg_scan_reset(&scan);
                 }
             }
             break;
@@ -143,22 +143,33 @@ static void cam_task(void *arg)
                 size_t pixels_per_dma = (cam_obj->dma_half_buffer_size * cam_obj->fb_bytes_per_pixel) / (cam_obj->dma_bytes_per_item * cam_obj->in_bytes_per_pixel);
 
                 if (cam_event == CAM_IN_SUC_EOF_EVENT) {
-                    if(!cam_obj->psram_mode){
+                    // Bytes of the frame received with this buffer
+                    uint8_t *received = NULL;
+                    size_t received_len = 0;
+                    if(cam_obj->psram_mode){
+                        received_len = cam_psram_received(frame_buffer_event, cnt, &received);
+                    } else {
                         if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
                             ESP_LOGW(TAG, "FB-OVF");
+                            cam_stats.fb_overflow++;
                             ll_cam_stop(cam_obj);
                             DBG_PIN_SET(0);
                             continue;
                         }
-                        frame_buffer_event->len += ll_cam_memcpy(cam_obj,
-                            &frame_buffer_event->buf[frame_buffer_event->len],
+                        received = &frame_buffer_event->buf[frame_buffer_event->len];
+                        received_len = ll_cam_memcpy(cam_obj, received,
                             &cam_obj->dma_buffer[(cnt % cam_obj->dma_half_buffer_cnt) * cam_obj->dma_half_buffer_size],
                             cam_obj->dma_half_buffer_size);
+                        frame_buffer_event->len += received_len;
                     }
-                    //Check for JPEG SOI in the first buffer. stop if not found
-                    if (cam_obj->jpeg_mode && cnt == 0 && cam_verify_jpeg_soi(frame_buffer_event->buf, frame_buffer_event->len) != 0) {
-                        ll_cam_stop(cam_obj);
-                        cam_obj->state = CAM_STATE_IDLE;
+                    if (cam_obj->jpeg_mode) {
+                        //Check for JPEG SOI in the first buffer. stop if not found
+                        if (cnt == 0 && cam_verify_jpeg_soi(received, received_len) != 0) {
+                            ll_cam_stop(cam_obj);
+                            cam_obj->state = CAM_STATE_IDLE;
+                        } else {
+                            cam_jpeg_scan_eoi(&scan, received, received_len);
+                        }
                     }
                     cnt++;
 
@@ -171,26 +182,39 @@ static void cam_task(void *arg)
                             if (!cam_obj->psram_mode) {
                                 if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
                                     ESP_LOGW(TAG, "FB-OVF");
+                                    cam_stats.fb_overflow++;
                                     cnt--;
                                 } else {
-                                    frame_buffer_event->len += ll_cam_memcpy(cam_obj,
-                                        &frame_buffer_event->buf[frame_buffer_event->len],
+                                    uint8_t *received = &frame_buffer_event->buf[frame_buffer_event->len];
+                                    size_t received_len = ll_cam_memcpy(cam_obj, received,
                                         &cam_obj->dma_buffer[(cnt % cam_obj->dma_half_buffer_cnt) * cam_obj->dma_half_buffer_size],
                                         cam_obj->dma_half_buffer_size);
+                                    frame_buffer_event->len += received_len;
+                                    cam_jpeg_scan_eoi(&scan, received, received_len);
                                 }
+                            } else {
+                                // The last buffer of the frame, written by the DMA without an EOF event
+                                uint8_t *received = NULL;
+                                size_t received_len = cam_psram_received(frame_buffer_event, cnt, &received);
+                                cam_jpeg_scan_eoi(&scan, received, received_len);
                             }
                             cnt++;
                         }
 
                         cam_obj->frames[frame_pos].en = 0;
 
-                        if (cam_obj->psram_mode) {
-                            if (cam_obj->jpeg_mode) {
-                                frame_buffer_event->len = cnt * cam_obj->dma_half_buffer_size;
+                        if (cam_obj->jpeg_mode) {
+                            // The exact length is known now, the data after EOI is discarded
+                            if (scan.eoi >= 0) {
+                                frame_buffer_event->len = scan.eoi + JPEG_EOI_MARKER_LEN;
                             } else {
-                                frame_buffer_event->len = cam_obj->recv_size;
+                                ESP_LOGW(TAG, "NO-EOI");
+                                cam_stats.no_eoi++;
+                                cam_obj->frames[frame_pos].en = 1;
                             }
-                        } else if (!cam_obj->jpeg_mode) {
+                        } else if (cam_obj->psram_mode) {
+                            frame_buffer_event->len = cam_obj->recv_size;
+                        } else {
                             if (frame_buffer_event->len != cam_obj->fb_size) {
                                 cam_obj->frames[frame_pos].en = 1;
                                 ESP_LOGE(TAG, "FB-SIZE: %u != %u", frame_buffer_event->len, (unsigned) cam_obj->fb_size);
@@ -222,6 +246,7 @@ static void cam_task(void *arg)
                         cam_obj->frames[frame_pos].fb.len = 0;
                     }
                     cnt = 0;
+                    cam_jpeg_scan_reset(&scan);
                 }
             }
             break;
@@ -333,6 +358,7 @@ esp_err_t cam_init(const camera_config_t *config)
     cam_obj = (cam_obj_t *)heap_caps_calloc(1, sizeof(cam_obj_t), MALLOC_CAP_DMA);
     CAM_CHECK(NULL != cam_obj, "lcd_cam object malloc error", ESP_ERR_NO_MEM);
 
+    memset(&cam_stats, 0, sizeof(cam_stats));
     cam_obj->swap_data = 0;
     cam_obj->vsync_pin = config->pin_vsync;
     cam_obj->vsync_invert = true;
@@ -472,7 +498,6 @@ void cam_start(void)
 camera_fb_t *cam_take(TickType_t timeout)
 {
     camera_fb_t *dma_buffer = NULL;
-    TickType_t start = xTaskGetTickCount();
     xQueueReceive(cam_obj->frame_buffer_queue, (void *)&dma_buffer, timeout);
 #if CONFIG_IDF_TARGET_ESP32S3
     // Currently (22.01.2024) there is a bug in ESP-IDF v5.2, that causes
@@ -485,29 +510,15 @@ camera_fb_t *cam_take(TickType_t timeout)
     }
 #endif
     if (dma_buffer) {
-        if(cam_obj->jpeg_mode){
-            // find the end marker for JPEG. Data after that can be discarded
-            int offset_e = cam_verify_jpeg_eoi(dma_buffer->buf, dma_buffer->len);
-            if (offset_e >= 0) {
-                // adjust buffer length
-                dma_buffer->len = offset_e + sizeof(JPEG_EOI_MARKER);
-                return dma_buffer;
-            } else {
-                ESP_LOGW(TAG, "NO-EOI");
-                cam_give(dma_buffer);
-                TickType_t ticks_spent = xTaskGetTickCount() - start;
-                if (ticks_spent >= timeout) {
-                    return NULL; /* We are out of time */
-                }
-                return cam_take(timeout - ticks_spent);//recurse!!!!
-            }
-        } else if(cam_obj->psram_mode && cam_obj->in_bytes_per_pixel != cam_obj->fb_bytes_per_pixel){
+        // JPEG frames were trimmed to the EOI marker by cam_task, frames without one never get here
+        if(!cam_obj->jpeg_mode && cam_obj->psram_mode && cam_obj->in_bytes_per_pixel != cam_obj->fb_bytes_per_pixel){
             //currently this is used only for YUV to GRAYSCALE
             dma_buffer->len = ll_cam_memcpy(cam_obj, dma_buffer->buf, dma_buffer->buf, dma_buffer->len);
         }
         return dma_buffer;
     } else {
         ESP_LOGW(TAG, "Failed to get the frame on time!");
+        cam_stats.timeout++;
 // #if CONFIG_IDF_TARGET_ESP32S3
 //         ll_cam_dma_print_state(cam_obj);
 // #endif
@@ -530,3 +541,8 @@ void cam_give_all(void) {
         cam_obj->frames[x].en = 1;
     }
 }
+
+void cam_get_stats(camera_stats_t *stats)
+{
+    *stats = cam_stats;
+}
@@ -0,0 +1,80 @@
+// JPEG marker search for cam_hal.
+//
+// JPEG entropy data stuffs every 0xFF with a zero byte, so 0xFF is rare in a
+// frame. The search reads a word at a time and only looks at the bytes of
+// the words that contain 0xFF.
+
+#include <string.h>
+#include "cam_jpeg_scan.h"
+
+#define ONES  0x01010101UL
+#define HIGHS 0x80808080UL
+
+// Return the first 0xFF in [p, end), or end
+static const uint8_t *cam_find_ff(const uint8_t *p, const uint8_t *end)
+{
+    while (p < end && ((uintptr_t)p & 3)) {
+        if (*p == 0xFF) {
+            return p;
+        }
+        p++;
+    }
+    while (p + 4 <= end) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        // A byte of ~word is zero where the byte of word is 0xFF
+        word = ~word;
+        if ((word - ONES) & ~word & HIGHS) {
+            break;
+        }
+        p += 4;
+    }
+    while (p < end) {
+        if (*p == 0xFF) {
+            return p;
+        }
+        p++;
+    }
+    return end;
+}
+
+void cam_jpeg_scan_reset(cam_jpeg_scan_t *scan)
+{
+    scan->len = 0;
+    scan->eoi = -1;
+    scan->ff = false;
+}
+
+void cam_jpeg_scan_eoi(cam_jpeg_scan_t *scan, const uint8_t *buf, size_t len)
+{
+    if (scan->eoi < 0 && len > 0) {
+        if (scan->ff && buf[0] == 0xD9) {
+            scan->eoi = scan->len - 1;
+        } else {
+            const uint8_t *end = buf + len;
+            const uint8_t *p = cam_find_ff(buf, end);
+            while (p + 1 < end) {
+                if (p[1] == 0xD9) {
+                    scan->eoi = scan->len + (p - buf);
+                    break;
+                }
+                p = cam_find_ff(p + 1, end);
+            }
+            scan->ff = (buf[len - 1] == 0xFF);
+        }
+    }
+    scan->len += len;
+}
+
+int cam_jpeg_find_soi(const uint8_t *buf, size_t len)
+{
+    const uint8_t *end = buf + len;
+    const uint8_t *p = cam_find_ff(buf, end);
+    while (p + 2 < end) {
+        if (p[1] == 0xD8 && p[2] == 0xFF) {
+            return p - buf;
+        }
+        p = cam_find_ff(p + 1, end);
+    }
+    return -1;
+}
@@ -484,3 +484,11 @@ void esp_camera_return_all(void) {
     cam_give_all();
 }
 
+void esp_camera_get_stats(camera_stats_t *stats) {
+    if (s_state == NULL) {
+        memset(stats, 0, sizeof(camera_stats_t));
+        return;
+    }
+    cam_get_stats(stats);
+}
+
@@ -242,6 +242,23 @@ esp_err_t esp_camera_load_from_nvs(const char *key);
  */
 void esp_camera_return_all(void);
 
+/**
+ * @brief Counters of frames the driver could not deliver
+ */
+typedef struct {
+    uint32_t fb_overflow;       /*!< Frames larger than the frame buffer (FB-OVF) */
+    uint32_t no_soi;            /*!< JPEG frames without a start of image marker (NO-SOI) */
+    uint32_t no_eoi;            /*!< JPEG frames without an end of image marker (NO-EOI) */
+    uint32_t timeout;           /*!< Calls to esp_camera_fb_get() that got no frame in time */
+} camera_stats_t;
+
+/**
+ * @brief Read the frame counters since the driver was initialized
+ *
+ * @param stats Filled with the counters
+ */
+void esp_camera_get_stats(camera_stats_t *stats);
+
 
 #ifdef __cplusplus
 }
@@ -57,6 +57,8 @@ void cam_give(camera_fb_t *dma_buffer);
 
 void cam_give_all(void);
 
+void cam_get_stats(camera_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief State of the EOI search over the buffers of one frame
+ */
+typedef struct {
+    size_t len;     /*!< Bytes scanned so far */
+    int eoi;        /*!< Offset of the first EOI marker in the frame, -1 until found */
+    bool ff;        /*!< The last buffer ended with 0xFF, the first half of a marker */
+} cam_jpeg_scan_t;
+
+/**
+ * @brief Start the EOI search of a new frame
+ *
+ * @param scan Scan state
+ */
+void cam_jpeg_scan_reset(cam_jpeg_scan_t *scan);
+
+/**
+ * @brief Search the next buffer of the frame for the EOI marker
+ *
+ * Buffers must be passed in order. A marker split between two buffers is found.
+ * Once the marker is found, the buffers are only counted.
+ *
+ * @param scan Scan state
+ * @param buf  Next bytes of the frame
+ * @param len  Number of bytes
+ */
+void cam_jpeg_scan_eoi(cam_jpeg_scan_t *scan, const uint8_t *buf, size_t len);
+
+/**
+ * @brief Find the SOI marker (FF D8 FF) in a buffer
+ *
+ * @param buf Buffer to search
+ * @param len Number of bytes
+ *
+ * @return Offset of the marker, or -1 if there is none
+ */
+int cam_jpeg_find_soi(const uint8_t *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
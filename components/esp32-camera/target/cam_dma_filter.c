@@ -0,0 +1,144 @@
+// Word-wide filters for the I2S DMA of the ESP32.
+//
+// The filters run in cam_task for every byte of every frame. Each element
+// is read with one 32-bit load, and the samples of four elements are
+// packed with shifts and masks into one 32-bit store, instead of one
+// bitfield read and one byte store per sample.
+// The frame buffer is usually in PSRAM, where every store goes through the
+// cache, so a quarter of the stores is where the time is saved.
+// The functions have no hardware dependency, so they also build on a host.
+
+#include <stdbool.h>
+#include "cam_dma_filter.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+#define FILTER_INLINE static inline __attribute__((always_inline))
+
+// sample1 (bits 16-23) of four elements, in order
+#define SAMPLE1_X4(a, b, c, d) \
+    ((((a) >> 16) & 0x000000FF) | (((b) >> 8) & 0x0000FF00) | ((c) & 0x00FF0000) | (((d) << 8) & 0xFF000000))
+
+// sample1 and sample2 of two elements, in order
+#define SAMPLE12_X2(a, b) \
+    ((((a) >> 16) & 0x000000FF) | (((a) << 8) & 0x0000FF00) | ((b) & 0x00FF0000) | (((b) << 24) & 0xFF000000))
+
+// The frame buffer position moves by odd amounts after some lines, so stores may be unaligned
+FILTER_INLINE void cam_dma_filter_store(uint8_t *dst, uint32_t value, bool aligned)
+{
+    if (aligned) {
+        *(uint32_t *)dst = value;
+    } else {
+        dst[0] = value;
+        dst[1] = value >> 8;
+        dst[2] = value >> 16;
+        dst[3] = value >> 24;
+    }
+}
+
+// sample1 of every element, four elements per store
+FILTER_INLINE void cam_dma_filter_sample1(uint8_t *dst, const uint32_t *src, size_t groups, bool aligned)
+{
+    for (size_t i = 0; i < groups; ++i) {
+        cam_dma_filter_store(dst, SAMPLE1_X4(src[0], src[1], src[2], src[3]), aligned);
+        src += 4;
+        dst += 4;
+    }
+}
+
+// sample1 of every other element, eight elements per store
+FILTER_INLINE void cam_dma_filter_sample1_even(uint8_t *dst, const uint32_t *src, size_t groups, bool aligned)
+{
+    for (size_t i = 0; i < groups; ++i) {
+        cam_dma_filter_store(dst, SAMPLE1_X4(src[0], src[2], src[4], src[6]), aligned);
+        src += 8;
+        dst += 4;
+    }
+}
+
+// sample1 and sample2 of every element, two elements per store
+FILTER_INLINE void cam_dma_filter_sample12(uint8_t *dst, const uint32_t *src, size_t groups, bool aligned)
+{
+    for (size_t i = 0; i < groups; ++i) {
+        cam_dma_filter_store(dst, SAMPLE12_X2(src[0], src[1]), aligned);
+        cam_dma_filter_store(dst + 4, SAMPLE12_X2(src[2], src[3]), aligned);
+        src += 4;
+        dst += 8;
+    }
+}
+
+#define IS_ALIGNED(p) ((((uintptr_t)(p)) & 3) == 0)
+
+size_t IRAM_ATTR cam_dma_filter_jpeg(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t elements = len / sizeof(uint32_t);
+    if (IS_ALIGNED(dst)) {
+        cam_dma_filter_sample1(dst, (const uint32_t *)src, elements / 4, true);
+    } else {
+        cam_dma_filter_sample1(dst, (const uint32_t *)src, elements / 4, false);
+    }
+    return elements;
+}
+
+size_t IRAM_ATTR cam_dma_filter_grayscale(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    return cam_dma_filter_jpeg(dst, src, len);
+}
+
+size_t IRAM_ATTR cam_dma_filter_grayscale_highspeed(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    const uint32_t *in = (const uint32_t *)src;
+    size_t elements = len / sizeof(uint32_t);
+    size_t end = elements / 8;
+    if (IS_ALIGNED(dst)) {
+        cam_dma_filter_sample1_even(dst, in, end, true);
+    } else {
+        cam_dma_filter_sample1_even(dst, in, end, false);
+    }
+    // the final sample of a line in SM_0A0B_0B0C sampling mode needs special handling
+    if ((elements & 0x7) != 0) {
+        in += end * 8;
+        dst += end * 4;
+        dst[0] = in[0] >> 16;
+        dst[1] = in[2] >> 16;
+        elements += 1;
+    }
+    return elements / 2;
+}
+
+size_t IRAM_ATTR cam_dma_filter_yuyv(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t elements = len / sizeof(uint32_t);
+    if (IS_ALIGNED(dst)) {
+        cam_dma_filter_sample12(dst, (const uint32_t *)src, elements / 4, true);
+    } else {
+        cam_dma_filter_sample12(dst, (const uint32_t *)src, elements / 4, false);
+    }
+    return elements * 2;
+}
+
+size_t IRAM_ATTR cam_dma_filter_yuyv_highspeed(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    const uint32_t *in = (const uint32_t *)src;
+    size_t elements = len / sizeof(uint32_t);
+    size_t end = elements / 8;
+    if (IS_ALIGNED(dst)) {
+        cam_dma_filter_sample1(dst, in, end * 2, true);
+    } else {
+        cam_dma_filter_sample1(dst, in, end * 2, false);
+    }
+    if ((elements & 0x7) != 0) {
+        in += end * 8;
+        dst += end * 8;
+        dst[0] = in[0] >> 16;//y0
+        dst[1] = in[1] >> 16;//u
+        dst[2] = in[2] >> 16;//y1
+        dst[3] = in[2];//v
+        elements += 4;
+    }
+    return elements;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Filters for the I2S DMA of the ESP32.
+ * Every 32-bit element of the DMA buffer holds one or two camera samples:
+ * sample1 in bits 16-23 and sample2 in bits 0-7.
+ * Each filter packs the samples of len bytes of src into dst and returns the number of bytes written.
+ * src must be 32-bit aligned, dst may have any alignment.
+ */
+
+/**
+ * @brief Keep sample1 of every element. Used for JPEG.
+ */
+size_t cam_dma_filter_jpeg(uint8_t *dst, const uint8_t *src, size_t len);
+
+/**
+ * @brief Keep sample1 of every element. Used for grayscale in SM_0A0B_0C0D mode.
+ */
+size_t cam_dma_filter_grayscale(uint8_t *dst, const uint8_t *src, size_t len);
+
+/**
+ * @brief Keep sample1 of every other element. Used for grayscale in SM_0A00_0B00 mode.
+ */
+size_t cam_dma_filter_grayscale_highspeed(uint8_t *dst, const uint8_t *src, size_t len);
+
+/**
+ * @brief Keep sample1 and sample2 of every element. Used for YUV422 and RGB565 in SM_0A0B_0C0D mode.
+ */
+size_t cam_dma_filter_yuyv(uint8_t *dst, const uint8_t *src, size_t len);
+
+/**
+ * @brief Keep sample1 of every element. Used for YUV422 and RGB565 in SM_0A00_0B00 mode.
+ */
+size_t cam_dma_filter_yuyv_highspeed(uint8_t *dst, const uint8_t *src, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1134 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "unity.h"
+#include <mbedtls/base64.h>
+#include "esp_log.h"
+#include "driver/i2c.h"
+
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "cam_jpeg_scan.h"
+#if CONFIG_IDF_TARGET_ESP32
+#include "cam_dma_filter.h"
+#endif
+
+#ifdef CONFIG_IDF_TARGET_ESP32
+#define BOARD_WROVER_KIT 1
+#elif defined CONFIG_IDF_TARGET_ESP32S2
+#define BOARD_CAMERA_MODEL_ESP32S2 1
+#elif defined CONFIG_IDF_TARGET_ESP32S3
+#define BOARD_CAMERA_MODEL_ESP32_S3_EYE 1
+#endif
+
+// WROVER-KIT PIN Map
+#if BOARD_WROVER_KIT
+
+#define PWDN_GPIO_NUM -1  //power down is not used
+#define RESET_GPIO_NUM -1 //software reset will be performed
+#define XCLK_GPIO_NUM 21
+#define SIOD_GPIO_NUM 26
+#define SIOC_GPIO_NUM 27
+
+#define Y9_GPIO_NUM 35
+#define Y8_GPIO_NUM 34
+#define Y7_GPIO_NUM 39
+#define Y6_GPIO_NUM 36
+#define Y5_GPIO_NUM 19
+#define Y4_GPIO_NUM 18
+#define Y3_GPIO_NUM 5
+#define Y2_GPIO_NUM 4
+#define VSYNC_GPIO_NUM 25
+#define HREF_GPIO_NUM 23
+#define PCLK_GPIO_NUM 22
+
+// ESP32Cam (AiThinker) PIN Map
+#elif BOARD_ESP32CAM_AITHINKER
+
+#define PWDN_GPIO_NUM 32
+#define RESET_GPIO_NUM -1 //software reset will be performed
+#define XCLK_GPIO_NUM 0
+#define SIOD_GPIO_NUM 26
+#define SIOC_GPIO_NUM 27
+
+#define Y9_GPIO_NUM 35
+#define Y8_GPIO_NUM 34
+#define Y7_GPIO_NUM 39
+#define Y6_GPIO_NUM 36
+#define Y5_GPIO_NUM 21
+#define Y4_GPIO_NUM 19
+#define Y3_GPIO_NUM 18
+#define Y2_GPIO_NUM 5
+#define VSYNC_GPIO_NUM 25
+#define HREF_GPIO_NUM 23
+#define PCLK_GPIO_NUM 22
+
+#elif BOARD_CAMERA_MODEL_ESP32S2
+
+#define PWDN_GPIO_NUM     -1
+#define RESET_GPIO_NUM    -1
+
+#define VSYNC_GPIO_NUM    21
+#define HREF_GPIO_NUM     38
+#define PCLK_GPIO_NUM     11
+#define XCLK_GPIO_NUM     40
+
+#define SIOD_GPIO_NUM     17
+#define SIOC_GPIO_NUM     18
+
+#define Y9_GPIO_NUM       39
+#define Y8_GPIO_NUM       41
+#define Y7_GPIO_NUM       42
+#define Y6_GPIO_NUM       12
+#define Y5_GPIO_NUM       3
+#define Y4_GPIO_NUM       14
+#define Y3_GPIO_NUM       37
+#define Y2_GPIO_NUM       13
+
+#elif BOARD_CAMERA_MODEL_ESP32_S3_EYE
+
+#define PWDN_GPIO_NUM     43
+#define RESET_GPIO_NUM    44
+
+#define VSYNC_GPIO_NUM    6
+#define HREF_GPIO_NUM     7
+#define PCLK_GPIO_NUM     13
+#define XCLK_GPIO_NUM     15
+
+#define SIOD_GPIO_NUM     4
+#define SIOC_GPIO_NUM     5
+
+#define Y9_GPIO_NUM       16
+#define Y8_GPIO_NUM       17
+#define Y7_GPIO_NUM       18
+#define Y6_GPIO_NUM       12
+#define Y5_GPIO_NUM       11
+#define Y4_GPIO_NUM       10
+#define Y3_GPIO_NUM       9
+#define Y2_GPIO_NUM       8
+
+#endif
+
+#define I2C_MASTER_SCL_IO           4      /*!< GPIO number used for I2C master clock */
+#define I2C_MASTER_SDA_IO           5      /*!< GPIO number used for I2C master data  */
+#define I2C_MASTER_NUM              0      /*!< I2C master i2c port number, the number of i2c peripheral interfaces available will depend on the chip */
+#define I2C_MASTER_FREQ_HZ          100000 /*!< I2C master clock frequency */
+
+static const char *TAG = "test camera";
+
+typedef void (*decode_func_t)(uint8_t *jpegbuffer, uint32_t size, uint8_t *outbuffer);
+
+static esp_err_t init_camera(uint32_t xclk_freq_hz, pixformat_t pixel_format, framesize_t frame_size, uint8_t fb_count, int sccb_sda_gpio_num, int sccb_port)
+{
+    framesize_t size_bak = frame_size;
+    if (PIXFORMAT_JPEG == pixel_format && FRAMESIZE_SVGA > frame_size) {
+        frame_size = FRAMESIZE_HD;
+    }
+    camera_config_t camera_config = {
+        .pin_pwdn = PWDN_GPIO_NUM,
+        .pin_reset = RESET_GPIO_NUM,
+        .pin_xclk = XCLK_GPIO_NUM,
+        .pin_sccb_sda = sccb_sda_gpio_num, // If pin_sccb_sda is -1, sccb will use the already initialized i2c port specified by `sccb_i2c_port`.
+        .pin_sccb_scl = SIOC_GPIO_NUM,
+        .sccb_i2c_port = sccb_port,
+
+        .pin_d7 = Y9_GPIO_NUM,
+        .pin_d6 = Y8_GPIO_NUM,
+        .pin_d5 = Y7_GPIO_NUM,
+        .pin_d4 = Y6_GPIO_NUM,
+        .pin_d3 = Y5_GPIO_NUM,
+        .pin_d2 = Y4_GPIO_NUM,
+        .pin_d1 = Y3_GPIO_NUM,
+        .pin_d0 = Y2_GPIO_NUM,
+        .pin_vsync = VSYNC_GPIO_NUM,
+        .pin_href = HREF_GPIO_NUM,
+        .pin_pclk = PCLK_GPIO_NUM,
+
+        //EXPERIMENTAL: Set to 16MHz on ESP32-S2 or ESP32-S3 to enable EDMA mode
+        .xclk_freq_hz = xclk_freq_hz,
+        .ledc_timer = LEDC_TIMER_0,
+        .ledc_channel = LEDC_CHANNEL_0,
+
+        .pixel_format = pixel_format, //YUV422,GRAYSCALE,RGB565,JPEG
+        .frame_size = frame_size,    //QQVGA-UXGAQQVGA-UXGA, For ESP32, do not use sizes above QVGA when not JPEG. The performance of the ESP32-S series has improved a lot, but JPEG mode always gives better frame rates.
+
+        .jpeg_quality = 12, //0-63, for OV series camera sensors, lower number means higher quality
+        .fb_count = fb_count,       //When jpeg mode is used, if fb_count more than one, the driver will work in continuous mode.
+        .grab_mode = CAMERA_GRAB_WHEN_EMPTY
+    };
+
+    //initialize the camera
+    esp_err_t ret = esp_camera_init(&camera_config);
+
+    if (ESP_OK == ret && PIXFORMAT_JPEG == pixel_format && FRAMESIZE_SVGA > size_bak) {
+        sensor_t *s = esp_camera_sensor_get();
+        s->set_framesize(s, size_bak);
+    }
+
+    return ret;
+}
+
+static bool camera_test_fps(uint16_t times, float *fps, uint32_t *size)
+{
+    *fps = 0.0f;
+    *size = 0;
+    uint32_t s = 0;
+    uint32_t num = 0;
+    uint64_t total_time = esp_timer_get_time();
+    for (size_t i = 0; i < times; i++) {
+        camera_fb_t *pic = esp_camera_fb_get();
+        if (NULL == pic) {
+            ESP_LOGW(TAG, "fb get failed");
+            return 0;
+        } else {
+            s += pic->len;
+            num++;
+        }
+        esp_camera_fb_return(pic);
+    }
+    total_time = esp_timer_get_time() - total_time;
+    if (num) {
+        *fps = num * 1000000.0f / total_time ;
+        *size = s / num;
+    }
+    return 1;
+}
+
+static const char *get_cam_format_name(pixformat_t pixel_format)
+{
+    switch (pixel_format) {
+    case PIXFORMAT_JPEG: return "JPEG";
+    case PIXFORMAT_RGB565: return "RGB565";
+    case PIXFORMAT_RGB888: return "RGB888";
+    case PIXFORMAT_YUV422: return "YUV422";
+    default:
+        break;
+    }
+    return "UNKNOW";
+}
+
+static void printf_img_base64(const camera_fb_t *pic)
+{
+    uint8_t *outbuffer = NULL;
+    size_t outsize = 0;
+    if (PIXFORMAT_JPEG != pic->format) {
+        fmt2jpg(pic->buf, pic->width * pic->height * 2, pic->width, pic->height, pic->format, 50, &outbuffer, &outsize);
+    } else {
+        outbuffer = pic->buf;
+        outsize = pic->len;
+    }
+
+    uint8_t *base64_buf = calloc(1, outsize * 4);
+    if (NULL != base64_buf) {
+        size_t out_len = 0;
+        mbedtls_base64_encode(base64_buf, outsize * 4, &out_len, outbuffer, outsize);
+        printf("%s\n", base64_buf);
+        free(base64_buf);
+        if (PIXFORMAT_JPEG != pic->format) {
+            free(outbuffer);
+        }
+    } else {
+        ESP_LOGE(TAG, "malloc for base64 buffer failed");
+    }
+}
+
+static void camera_performance_test(uint32_t xclk_freq, uint32_t pic_num)
+{
+    esp_err_t ret = ESP_OK;
+    //detect sensor information
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_RGB565, FRAMESIZE_QVGA, 2, SIOD_GPIO_NUM, -1));
+    sensor_t *s = esp_camera_sensor_get();
+    camera_sensor_info_t *info = esp_camera_sensor_get_info(&s->id);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ESP_OK(esp_camera_deinit());
+    vTaskDelay(500 / portTICK_RATE_MS);
+    framesize_t max_size = info->max_size;
+    pixformat_t all_format[] = {PIXFORMAT_JPEG, PIXFORMAT_RGB565, PIXFORMAT_YUV422, };
+    pixformat_t *format_s = &all_format[0];
+    pixformat_t *format_e = &all_format[2];
+    if (false == info->support_jpeg) {
+        format_s++; // skip jpeg
+    }
+
+    struct fps_result {
+        float fps[FRAMESIZE_INVALID];
+        uint32_t size[FRAMESIZE_INVALID];
+    };
+    struct fps_result results[3] = {0};
+
+    for (; format_s <= format_e; format_s++) {
+        for (size_t i = 0; i <= max_size; i++) {
+            ESP_LOGI(TAG, "\n\n===> Testing format:%s resolution: %d x %d <===", get_cam_format_name(*format_s), resolution[i].width, resolution[i].height);
+            ret = init_camera(xclk_freq, *format_s, i, 2, SIOD_GPIO_NUM, -1);
+            vTaskDelay(100 / portTICK_RATE_MS);
+            if (ESP_OK != ret) {
+                ESP_LOGW(TAG, "Testing init failed :-(, skip this item");
+                vTaskDelay(500 / portTICK_RATE_MS);
+                continue;
+            }
+            camera_test_fps(pic_num, &results[format_s - all_format].fps[i], &results[format_s - all_format].size[i]);
+            TEST_ESP_OK(esp_camera_deinit());
+        }
+    }
+
+    printf("FPS Result\n");
+    printf("resolution  ,  JPEG fps,  JPEG size, RGB565 fps, RGB565 size, YUV422 fps, YUV422 size \n");
+    for (size_t i = 0; i <= max_size; i++) {
+        printf("%4d x %4d ,     %5.2f,     %6d,      %5.2f,     %7d,      %5.2f,     %7d \n",
+               resolution[i].width, resolution[i].height,
+               results[0].fps[i], results[0].size[i],
+               results[1].fps[i], results[1].size[i],
+               results[2].fps[i], results[2].size[i]);
+    }
+    printf("----------------------------------------------------------------------------------------\n");
+}
+
+TEST_CASE("Camera driver init, deinit test", "[camera]")
+{
+    uint64_t t1 = esp_timer_get_time();
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_RGB565, FRAMESIZE_QVGA, 2, SIOD_GPIO_NUM, -1));
+    uint64_t t2 = esp_timer_get_time();
+    ESP_LOGI(TAG, "Camera init time %llu ms", (t2 - t1) / 1000);
+
+    TEST_ESP_OK(esp_camera_deinit());
+}
+
+TEST_CASE("Camera driver take RGB565 picture test", "[camera]")
+{
+    TEST_ESP_OK(init_camera(10000000, PIXFORMAT_RGB565, FRAMESIZE_QVGA, 2, SIOD_GPIO_NUM, -1));
+    vTaskDelay(500 / portTICK_RATE_MS);
+    ESP_LOGI(TAG, "Taking picture...");
+    camera_fb_t *pic = esp_camera_fb_get();
+    if (pic) {
+        ESP_LOGI(TAG, "picture: %d x %d, size: %u", pic->width, pic->height, pic->len);
+        printf_img_base64(pic);
+        esp_camera_fb_return(pic);
+    }
+
+    TEST_ESP_OK(esp_camera_deinit());
+    TEST_ASSERT_NOT_NULL(pic);
+}
+
+TEST_CASE("Camera driver take YUV422 picture test", "[camera]")
+{
+    TEST_ESP_OK(init_camera(10000000, PIXFORMAT_YUV422, FRAMESIZE_QVGA, 2, SIOD_GPIO_NUM, -1));
+    vTaskDelay(500 / portTICK_RATE_MS);
+    ESP_LOGI(TAG, "Taking picture...");
+    camera_fb_t *pic = esp_camera_fb_get();
+    if (pic) {
+        ESP_LOGI(TAG, "picture: %d x %d, size: %u", pic->width, pic->height, pic->len);
+        printf_img_base64(pic);
+        esp_camera_fb_return(pic);
+    }
+
+    TEST_ESP_OK(esp_camera_deinit());
+    TEST_ASSERT_NOT_NULL(pic);
+}
+
+TEST_CASE("Camera driver take JPEG picture test", "[camera]")
+{
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_QVGA, 2, SIOD_GPIO_NUM, -1));
+    vTaskDelay(500 / portTICK_RATE_MS);
+    ESP_LOGI(TAG, "Taking picture...");
+    camera_fb_t *pic = esp_camera_fb_get();
+    if (pic) {
+        ESP_LOGI(TAG, "picture: %d x %d, size: %u", pic->width, pic->height, pic->len);
+        printf_img_base64(pic);
+        esp_camera_fb_return(pic);
+    }
+
+    TEST_ESP_OK(esp_camera_deinit());
+    TEST_ASSERT_NOT_NULL(pic);
+}
+
+TEST_CASE("Camera driver performance test", "[camera]")
+{
+    camera_performance_test(20 * 1000000, 16);
+}
+
+
+static void print_rgb565_img(uint8_t *img, int width, int height)
+{
+    uint16_t *p = (uint16_t *)img;
+    const char temp2char[17] = "@MNHQ&#UJ*x7^i;.";
+    for (size_t j = 0; j < height; j++) {
+        for (size_t i = 0; i < width; i++) {
+            uint32_t c = p[j * width + i];
+            uint8_t r = c >> 11;
+            uint8_t g = (c >> 6) & 0x1f;
+            uint8_t b = c & 0x1f;
+            c = (r + g + b) / 3;
+            c >>= 1;
+            printf("%c", temp2char[15 - c]);
+        }
+        printf("\n");
+    }
+}
+
+static void print_rgb888_img(uint8_t *img, int width, int height)
+{
+    uint8_t *p = (uint8_t *)img;
+    const char temp2char[17] = "@MNHQ&#UJ*x7^i;.";
+    for (size_t j = 0; j < height; j++) {
+        for (size_t i = 0; i < width; i++) {
+            uint8_t *c = p + 3 * (j * width + i);
+            uint8_t r = *c++;
+            uint8_t g = *c++;
+            uint8_t b = *c;
+            uint32_t v = (r + g + b) / 3;
+            v >>= 4;
+            printf("%c", temp2char[15 - v]);
+        }
+        printf("\n");
+    }
+}
+
+static void tjpgd_decode_rgb565(uint8_t *mjpegbuffer, uint32_t size, uint8_t *outbuffer)
+{
+    jpg2rgb565(mjpegbuffer, size, outbuffer, JPG_SCALE_NONE);
+}
+
+static void tjpgd_decode_rgb888(uint8_t *mjpegbuffer, uint32_t size, uint8_t *outbuffer)
+{
+    fmt2rgb888(mjpegbuffer, size, PIXFORMAT_JPEG, outbuffer);
+}
+
+typedef enum {
+    DECODE_RGB565,
+    DECODE_RGB888,
+} decode_type_t;
+
+static const decode_func_t g_decode_func[2][2] = {
+    {tjpgd_decode_rgb565,},
+    {tjpgd_decode_rgb888,},
+};
+
+
+static float jpg_decode_test(uint8_t decoder_index, decode_type_t type, const uint8_t *jpg, uint32_t length, uint32_t img_w, uint32_t img_h, uint32_t times)
+{
+    uint8_t *jpg_buf = malloc(length);
+    if (NULL == jpg_buf) {
+        ESP_LOGE(TAG, "malloc for jpg buffer failed");
+        return 0;
+    }
+    memcpy(jpg_buf, jpg, length);
+
+    uint8_t *rgb_buf = heap_caps_malloc(img_w * img_h * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (NULL == rgb_buf) {
+        free(jpg_buf);
+        ESP_LOGE(TAG, "malloc for rgb buffer failed");
+        return 0;
+    }
+    decode_func_t decode = g_decode_func[type][decoder_index];
+    decode(jpg_buf, length, rgb_buf);
+    if (DECODE_RGB565 == type) {
+        ESP_LOGI(TAG, "jpeg decode to rgb565");
+        print_rgb565_img(rgb_buf, img_w, img_h);
+    } else {
+        ESP_LOGI(TAG, "jpeg decode to rgb888");
+        print_rgb888_img(rgb_buf, img_w, img_h);
+    }
+
+    uint64_t t_decode[times];
+    for (size_t i = 0; i < times; i++) {
+        uint64_t t1 = esp_timer_get_time();
+        decode(jpg_buf, length, rgb_buf);
+        t_decode[i] = esp_timer_get_time() - t1;
+    }
+
+    printf("resolution  ,  t \n");
+    uint64_t t_total = 0;
+    for (size_t i = 0; i < times; i++) {
+        t_total += t_decode[i];
+        float t = t_decode[i] / 1000.0f;
+        printf("%4d x %4d ,  %5.2f ms \n", img_w, img_h, t);
+    }
+
+    float fps = times / (t_total / 1000000.0f);
+    printf("Decode FPS Result\n");
+    printf("resolution  , fps \n");
+    printf("%4d x %4d , %5.2f  \n", img_w, img_h, fps);
+
+    free(jpg_buf);
+    heap_caps_free(rgb_buf);
+    return fps;
+}
+
+static void img_jpeg_decode_test(uint16_t pic_index, uint16_t lib_index)
+{
+    extern const uint8_t img1_start[] asm("_binary_testimg_jpeg_start");
+    extern const uint8_t img1_end[]   asm("_binary_testimg_jpeg_end");
+    extern const uint8_t img2_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img2_end[]   asm("_binary_test_inside_jpeg_end");
+    extern const uint8_t img3_start[] asm("_binary_test_outside_jpeg_start");
+    extern const uint8_t img3_end[]   asm("_binary_test_outside_jpeg_end");
+
+    struct img_t {
+        const uint8_t *buf;
+        uint32_t length;
+        uint16_t w, h;
+    };
+    struct img_t imgs[3] = {
+        {
+            .buf = img1_start,
+            .length = img1_end - img1_start,
+            .w = 227,
+            .h = 149,
+        },
+        {
+            .buf = img2_start,
+            .length = img2_end - img2_start,
+            .w = 320,
+            .h = 240,
+        },
+        {
+            .buf = img3_start,
+            .length = img3_end - img3_start,
+            .w = 480,
+            .h = 320,
+        },
+    };
+
+    ESP_LOGI(TAG, "pic_index:%d", pic_index);
+    ESP_LOGI(TAG, "lib_index:%d", lib_index);
+    jpg_decode_test(lib_index, DECODE_RGB565, imgs[pic_index].buf, imgs[pic_index].length, imgs[pic_index].w, imgs[pic_index].h, 16);
+}
+
+// The frame buffer as cam_task fills it: the picture, then stale bytes up to the end of the last DMA buffer.
+// The stale bytes end with the EOI of an older and larger frame.
+static uint8_t *jpeg_scan_frame(const uint8_t *jpg, size_t jpg_len, size_t buf_len)
+{
+    uint8_t *buf = heap_caps_malloc(buf_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (NULL == buf) {
+        buf = malloc(buf_len);
+    }
+    if (NULL == buf) {
+        return NULL;
+    }
+    memcpy(buf, jpg, jpg_len);
+    memset(buf + jpg_len, 0xA5, buf_len - jpg_len);
+    buf[buf_len - 2] = 0xFF;
+    buf[buf_len - 1] = 0xD9;
+    return buf;
+}
+
+// The first EOI of the picture, one byte at a time
+static int jpeg_scan_reference_eoi(const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (buf[i] == 0xFF && buf[i + 1] == 0xD9) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The EOI search cam_take used to do, backwards from the end of the buffer
+static int jpeg_scan_backward_eoi(const uint8_t *buf, size_t len)
+{
+    static const uint16_t eoi_marker = 0xD9FF;
+    const uint8_t *dptr = buf + len - 2;
+    while (dptr > buf) {
+        if (memcmp(dptr, &eoi_marker, 2) == 0) {
+            return dptr - buf;
+        }
+        dptr--;
+    }
+    return -1;
+}
+
+static int jpeg_scan_in_buffers(const uint8_t *buf, size_t len, size_t dma_len)
+{
+    cam_jpeg_scan_t scan;
+    cam_jpeg_scan_reset(&scan);
+    for (size_t offset = 0; offset < len; offset += dma_len) {
+        size_t n = (len - offset < dma_len) ? len - offset : dma_len;
+        cam_jpeg_scan_eoi(&scan, buf + offset, n);
+    }
+    TEST_ASSERT_EQUAL(len, scan.len);
+    return scan.eoi;
+}
+
+TEST_CASE("JPEG marker scan finds SOI and EOI across DMA buffers", "[camera]")
+{
+    extern const uint8_t img1_start[] asm("_binary_testimg_jpeg_start");
+    extern const uint8_t img1_end[]   asm("_binary_testimg_jpeg_end");
+    extern const uint8_t img2_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img2_end[]   asm("_binary_test_inside_jpeg_end");
+    extern const uint8_t img3_start[] asm("_binary_test_outside_jpeg_start");
+    extern const uint8_t img3_end[]   asm("_binary_test_outside_jpeg_end");
+    const uint8_t *starts[3] = { img1_start, img2_start, img3_start };
+    const uint8_t *ends[3] = { img1_end, img2_end, img3_end };
+    const size_t dma_lens[] = { 1, 2, 3, 5, 1023, 1024, 4096 };
+
+    for (int i = 0; i < 3; i++) {
+        size_t jpg_len = ends[i] - starts[i];
+        size_t buf_len = (jpg_len / 1024 + 2) * 1024;
+        uint8_t *buf = jpeg_scan_frame(starts[i], jpg_len, buf_len);
+        TEST_ASSERT_NOT_NULL(buf);
+        int expected = jpeg_scan_reference_eoi(buf, buf_len);
+        TEST_ASSERT_GREATER_THAN(0, expected);
+        TEST_ASSERT_LESS_THAN(jpg_len, expected);
+        TEST_ASSERT_EQUAL(0, cam_jpeg_find_soi(buf, 1024));
+        for (int j = 0; j < sizeof(dma_lens) / sizeof(dma_lens[0]); j++) {
+            TEST_ASSERT_EQUAL(expected, jpeg_scan_in_buffers(buf, buf_len, dma_lens[j]));
+        }
+        // At every alignment of the buffer
+        for (int shift = 1; shift < 4; shift++) {
+            memmove(buf + 1, buf, buf_len - 1);
+            TEST_ASSERT_EQUAL(shift, cam_jpeg_find_soi(buf, 1024));
+            TEST_ASSERT_EQUAL(expected + shift, jpeg_scan_in_buffers(buf, buf_len, 1024));
+        }
+        free(buf);
+    }
+}
+
+TEST_CASE("JPEG marker scan handles split and missing markers", "[camera]")
+{
+    uint8_t buf[16];
+    cam_jpeg_scan_t scan;
+
+    // EOI split between two buffers
+    memset(buf, 0, sizeof(buf));
+    buf[7] = 0xFF;
+    buf[8] = 0xD9;
+    cam_jpeg_scan_reset(&scan);
+    cam_jpeg_scan_eoi(&scan, buf, 8);
+    TEST_ASSERT_EQUAL(-1, scan.eoi);
+    cam_jpeg_scan_eoi(&scan, buf + 8, 8);
+    TEST_ASSERT_EQUAL(7, scan.eoi);
+
+    // Fill bytes before the marker, a stuffed 0xFF and a restart marker are not EOI
+    const uint8_t stuffed[] = { 0x12, 0xFF, 0x00, 0xFF, 0xD0, 0xFF, 0xFF, 0xFF, 0xD9, 0xFF, 0xD9 };
+    cam_jpeg_scan_reset(&scan);
+    cam_jpeg_scan_eoi(&scan, stuffed, sizeof(stuffed));
+    TEST_ASSERT_EQUAL(7, scan.eoi);
+
+    // 0xFF at the end of a buffer followed by something else
+    cam_jpeg_scan_reset(&scan);
+    cam_jpeg_scan_eoi(&scan, stuffed, 2);
+    cam_jpeg_scan_eoi(&scan, stuffed + 2, 2);
+    TEST_ASSERT_EQUAL(-1, scan.eoi);
+
+    // No markers at all
+    memset(buf, 0xA5, sizeof(buf));
+    buf[sizeof(buf) - 1] = 0xFF;
+    cam_jpeg_scan_reset(&scan);
+    cam_jpeg_scan_eoi(&scan, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL(-1, scan.eoi);
+    TEST_ASSERT_EQUAL(-1, cam_jpeg_find_soi(buf, sizeof(buf)));
+    buf[sizeof(buf) - 2] = 0xFF;
+    buf[sizeof(buf) - 1] = 0xD8;
+    TEST_ASSERT_EQUAL(-1, cam_jpeg_find_soi(buf, sizeof(buf)));
+}
+
+TEST_CASE("JPEG marker scan performance test", "[camera]")
+{
+    extern const uint8_t img2_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img2_end[]   asm("_binary_test_inside_jpeg_end");
+    const size_t img_len = img2_end - img2_start;
+
+    // A UXGA frame buffer with a frame of half its size, made of the entropy data of a recorded picture
+    const size_t buf_len = 1600 * 1200 / 5;
+    const size_t jpg_len = buf_len / 2;
+    uint8_t *jpg = malloc(jpg_len);
+    TEST_ASSERT_NOT_NULL(jpg);
+    size_t body = img_len - 2 - 1024;
+    for (size_t offset = 0; offset < jpg_len; offset += body) {
+        memcpy(jpg + offset, img2_start + 1024, (jpg_len - offset < body) ? jpg_len - offset : body);
+    }
+    // Keep only the last EOI
+    for (size_t i = 0; i + 1 < jpg_len; i++) {
+        if (jpg[i] == 0xFF && jpg[i + 1] == 0xD9) {
+            jpg[i + 1] = 0;
+        }
+    }
+    memcpy(jpg, img2_start, 1024);
+    jpg[jpg_len - 2] = 0xFF;
+    jpg[jpg_len - 1] = 0xD9;
+    uint8_t *buf = jpeg_scan_frame(jpg, jpg_len, buf_len);
+    free(jpg);
+    TEST_ASSERT_NOT_NULL(buf);
+    // The stale bytes of an older frame are zeros here, as the backward search expects
+    memset(buf + jpg_len, 0, buf_len - jpg_len);
+
+    const int times = 16;
+    uint64_t t_backward = 0;
+    uint64_t t_scan = 0;
+    for (int i = 0; i < times; i++) {
+        uint64_t t1 = esp_timer_get_time();
+        TEST_ASSERT_EQUAL(jpg_len - 2, jpeg_scan_backward_eoi(buf, buf_len));
+        uint64_t t2 = esp_timer_get_time();
+        TEST_ASSERT_EQUAL(jpg_len - 2, jpeg_scan_in_buffers(buf, buf_len, 1024));
+        uint64_t t3 = esp_timer_get_time();
+        t_backward += t2 - t1;
+        t_scan += t3 - t2;
+    }
+
+    printf("EOI search Result\n");
+    printf("buffer  ,  frame  , backward memcmp, word scan \n");
+    printf("%7u , %7u , %8.2f ms    , %6.2f ms \n", (unsigned) buf_len, (unsigned) jpg_len,
+           t_backward / 1000.0f / times, t_scan / 1000.0f / times);
+    free(buf);
+}
+
+#if CONFIG_IDF_TARGET_ESP32
+// The ESP32 DMA filters as they were before the word-wide kernels, one bitfield read per sample
+typedef union {
+    struct {
+        uint32_t sample2:8;
+        uint32_t unused2:8;
+        uint32_t sample1:8;
+        uint32_t unused1:8;
+    };
+    uint32_t val;
+} dma_reference_elem_t;
+
+typedef size_t (*dma_filter_fn_t)(uint8_t *dst, const uint8_t *src, size_t len);
+
+static size_t dma_reference_jpeg(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    const dma_reference_elem_t *dma_el = (const dma_reference_elem_t *)src;
+    size_t elements = len / sizeof(dma_reference_elem_t);
+    size_t end = elements / 4;
+    for (size_t i = 0; i < end; ++i) {
+        dst[0] = dma_el[0].sample1;
+        dst[1] = dma_el[1].sample1;
+        dst[2] = dma_el[2].sample1;
+        dst[3] = dma_el[3].sample1;
+        dma_el += 4;
+        dst += 4;
+    }
+    return elements;
+}
+
+static size_t dma_reference_grayscale_highspeed(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    const dma_reference_elem_t *dma_el = (const dma_reference_elem_t *)src;
+    size_t elements = len / sizeof(dma_reference_elem_t);
+    size_t end = elements / 8;
+    for (size_t i = 0; i < end; ++i) {
+        dst[0] = dma_el[0].sample1;
+        dst[1] = dma_el[2].sample1;
+        dst[2] = dma_el[4].sample1;
+        dst[3] = dma_el[6].sample1;
+        dma_el += 8;
+        dst += 4;
+    }
+    if ((elements & 0x7) != 0) {
+        dst[0] = dma_el[0].sample1;
+        dst[1] = dma_el[2].sample1;
+        elements += 1;
+    }
+    return elements / 2;
+}
+
+static size_t dma_reference_yuyv(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    const dma_reference_elem_t *dma_el = (const dma_reference_elem_t *)src;
+    size_t elements = len / sizeof(dma_reference_elem_t);
+    size_t end = elements / 4;
+    for (size_t i = 0; i < end; ++i) {
+        dst[0] = dma_el[0].sample1;
+        dst[1] = dma_el[0].sample2;
+        dst[2] = dma_el[1].sample1;
+        dst[3] = dma_el[1].sample2;
+        dst[4] = dma_el[2].sample1;
+        dst[5] = dma_el[2].sample2;
+        dst[6] = dma_el[3].sample1;
+        dst[7] = dma_el[3].sample2;
+        dma_el += 4;
+        dst += 8;
+    }
+    return elements * 2;
+}
+
+static size_t dma_reference_yuyv_highspeed(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    const dma_reference_elem_t *dma_el = (const dma_reference_elem_t *)src;
+    size_t elements = len / sizeof(dma_reference_elem_t);
+    size_t end = elements / 8;
+    for (size_t i = 0; i < end; ++i) {
+        dst[0] = dma_el[0].sample1;
+        dst[1] = dma_el[1].sample1;
+        dst[2] = dma_el[2].sample1;
+        dst[3] = dma_el[3].sample1;
+        dst[4] = dma_el[4].sample1;
+        dst[5] = dma_el[5].sample1;
+        dst[6] = dma_el[6].sample1;
+        dst[7] = dma_el[7].sample1;
+        dma_el += 8;
+        dst += 8;
+    }
+    if ((elements & 0x7) != 0) {
+        dst[0] = dma_el[0].sample1;
+        dst[1] = dma_el[1].sample1;
+        dst[2] = dma_el[2].sample1;
+        dst[3] = dma_el[2].sample2;
+        elements += 4;
+    }
+    return elements;
+}
+
+static const struct {
+    const char *name;
+    dma_filter_fn_t reference;
+    dma_filter_fn_t filter;
+} dma_filters[] = {
+    { "jpeg", dma_reference_jpeg, cam_dma_filter_jpeg },
+    { "grayscale", dma_reference_jpeg, cam_dma_filter_grayscale },
+    { "grayscale_highspeed", dma_reference_grayscale_highspeed, cam_dma_filter_grayscale_highspeed },
+    { "yuyv", dma_reference_yuyv, cam_dma_filter_yuyv },
+    { "yuyv_highspeed", dma_reference_yuyv_highspeed, cam_dma_filter_yuyv_highspeed },
+};
+
+#define DMA_FILTER_COUNT (sizeof(dma_filters) / sizeof(dma_filters[0]))
+
+TEST_CASE("DMA filters match the bitfield filters", "[camera]")
+{
+    // Half DMA buffer sizes, plus lines that end in the middle of a group of elements
+    const size_t lens[] = { 4, 8, 12, 28, 32, 36, 60, 64, 1020, 1024, 1028, 4092, 4096 };
+    // Room for the elements the tail of the highspeed filters reads beyond len
+    const size_t src_len = 4096 + 32;
+    // Output is at most twice the input
+    const size_t dst_len = 2 * 4096 + 16;
+    uint32_t *src = heap_caps_malloc(src_len, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    uint8_t *expected = heap_caps_malloc(dst_len, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    uint8_t *actual = heap_caps_malloc(dst_len, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(src);
+    TEST_ASSERT_NOT_NULL(expected);
+    TEST_ASSERT_NOT_NULL(actual);
+
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < src_len / 4; i++) {
+        seed = seed * 1103515245 + 12345;
+        src[i] = seed ^ (seed >> 16);
+    }
+
+    for (int f = 0; f < DMA_FILTER_COUNT; f++) {
+        for (int l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+            // The frame buffer position is not always 32-bit aligned
+            for (int shift = 0; shift < 4; shift++) {
+                memset(expected, 0x5A, dst_len);
+                memset(actual, 0x5A, dst_len);
+                size_t r1 = dma_filters[f].reference(expected + shift, (const uint8_t *)src, lens[l]);
+                size_t r2 = dma_filters[f].filter(actual + shift, (const uint8_t *)src, lens[l]);
+                if (r1 != r2 || memcmp(expected, actual, dst_len) != 0) {
+                    printf("%s len=%u shift=%d differs\n", dma_filters[f].name, (unsigned) lens[l], shift);
+                }
+                TEST_ASSERT_EQUAL(r1, r2);
+                TEST_ASSERT_EQUAL_MEMORY(expected, actual, dst_len);
+            }
+        }
+    }
+    free(src);
+    free(expected);
+    free(actual);
+}
+
+TEST_CASE("DMA filters performance test", "[camera]")
+{
+    // One JPEG half DMA buffer of the ESP32, filtered as cam_task does
+    const size_t len = 4096;
+    const int times = 1024;
+    uint8_t *src = heap_caps_calloc(1, len + 32, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    uint8_t *dst = heap_caps_malloc(2 * len, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(src);
+    TEST_ASSERT_NOT_NULL(dst);
+
+    printf("DMA filter Result\n");
+    printf("filter              , bitfield  , word-wide \n");
+    for (int f = 0; f < DMA_FILTER_COUNT; f++) {
+        uint64_t t1 = esp_timer_get_time();
+        for (int i = 0; i < times; i++) {
+            dma_filters[f].reference(dst, src, len);
+        }
+        uint64_t t2 = esp_timer_get_time();
+        for (int i = 0; i < times; i++) {
+            dma_filters[f].filter(dst, src, len);
+        }
+        uint64_t t3 = esp_timer_get_time();
+        // MB/s of DMA input, which is what limits the pixel clock
+        float mb = (float) len * times / (1024 * 1024);
+        printf("%-19s , %6.1f MB/s, %6.1f MB/s \n", dma_filters[f].name,
+               mb * 1000000 / (t2 - t1), mb * 1000000 / (t3 - t2));
+    }
+    free(src);
+    free(dst);
+}
+#endif
+
+typedef struct {
+    const uint8_t *src;
+    int quality;
+    const uint8_t *expected;
+    size_t expected_len;
+    int mismatches;
+    SemaphoreHandle_t done;
+} jpeg_encode_job_t;
+
+static void jpeg_encode_task(void *arg)
+{
+    jpeg_encode_job_t *job = (jpeg_encode_job_t *)arg;
+    for (int i = 0; i < 20; i++) {
+        uint8_t *out = NULL;
+        size_t out_len = 0;
+        if (!fmt2jpg((uint8_t *)job->src, 160 * 120 * 2, 160, 120, PIXFORMAT_RGB565, job->quality, &out, &out_len)) {
+            job->mismatches++;
+            continue;
+        }
+        if (out_len != job->expected_len || memcmp(out, job->expected, out_len) != 0) {
+            job->mismatches++;
+        }
+        free(out);
+    }
+    xSemaphoreGive(job->done);
+    vTaskDelete(NULL);
+}
+
+TEST_CASE("JPEG encoders at different qualities run concurrently", "[camera]")
+{
+    // A QQVGA RGB565 test pattern with some detail, so the two qualities give different pictures
+    const size_t len = 160 * 120 * 2;
+    uint8_t *src = malloc(len);
+    TEST_ASSERT_NOT_NULL(src);
+    for (size_t i = 0; i < len; i++) {
+        src[i] = (i * 7) ^ (i >> 5) ^ ((i / 320) * 3);
+    }
+
+    jpeg_encode_job_t jobs[2] = {
+        { .src = src, .quality = 10 },
+        { .src = src, .quality = 90 },
+    };
+    uint8_t *expected[2];
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_TRUE(fmt2jpg(src, len, 160, 120, PIXFORMAT_RGB565, jobs[i].quality, &expected[i], &jobs[i].expected_len));
+        jobs[i].expected = expected[i];
+        jobs[i].done = xSemaphoreCreateBinary();
+        TEST_ASSERT_NOT_NULL(jobs[i].done);
+    }
+    TEST_ASSERT_NOT_EQUAL(jobs[0].expected_len, jobs[1].expected_len);
+
+    // One encoder on each core
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUAL(pdPASS, xTaskCreatePinnedToCore(jpeg_encode_task, "jpeg_encode", 4096, &jobs[i], 5, NULL, i % portNUM_PROCESSORS));
+    }
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_TRUE(xSemaphoreTake(jobs[i].done, pdMS_TO_TICKS(30000)));
+        vSemaphoreDelete(jobs[i].done);
+        free(expected[i]);
+        TEST_ASSERT_EQUAL(0, jobs[i].mismatches);
+    }
+    free(src);
+}
+
+TEST_CASE("JPEG encoder strips are joined into one picture", "[camera]")
+{
+    // A QVGA RGB888 gradient, so the decoded picture can be compared with the source
+    const int width = 320;
+    const int height = 240;
+    const size_t len = width * height * 3;
+    uint8_t *src = heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (NULL == src) {
+        src = malloc(len);
+    }
+    uint8_t *decoded = heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (NULL == decoded) {
+        decoded = malloc(len);
+    }
+    TEST_ASSERT_NOT_NULL(src);
+    TEST_ASSERT_NOT_NULL(decoded);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t *p = src + (y * width + x) * 3;
+            p[0] = x * 255 / width;
+            p[1] = y * 255 / height;
+            p[2] = (x + y) * 255 / (width + height);
+        }
+    }
+
+    uint8_t *jpg = NULL;
+    size_t jpg_len = 0;
+    uint64_t t1 = esp_timer_get_time();
+    TEST_ASSERT_TRUE(fmt2jpg(src, len, width, height, PIXFORMAT_RGB888, 90, &jpg, &jpg_len));
+    uint64_t t2 = esp_timer_get_time();
+
+    // One RSTn marker between every two strips, as many strips as tasks
+#if CONFIG_CAMERA_JPEG_OPTIMIZE_HUFFMAN
+    const int strips = 1;
+#else
+    const int strips = CONFIG_CAMERA_JPEG_ENCODE_TASKS;
+#endif
+    int restarts = 0;
+    bool dri = false;
+    for (size_t i = 0; i + 1 < jpg_len; i++) {
+        if (jpg[i] == 0xFF && jpg[i + 1] >= 0xD0 && jpg[i + 1] <= 0xD7) {
+            restarts++;
+        } else if (jpg[i] == 0xFF && jpg[i + 1] == 0xDD) {
+            dri = true;
+        }
+    }
+    TEST_ASSERT_EQUAL(strips > 1, dri);
+    TEST_ASSERT_EQUAL(strips - 1, restarts);
+
+    TEST_ASSERT_TRUE(fmt2rgb888(jpg, jpg_len, PIXFORMAT_JPEG, decoded));
+    uint64_t error = 0;
+    for (size_t i = 0; i < len; i++) {
+        error += abs(src[i] - decoded[i]);
+    }
+    printf("JPEG encoder strips=%d size=%u time=%.2f ms mean error=%.2f\n", strips,
+           (unsigned) jpg_len, (t2 - t1) / 1000.0f, (float) error / len);
+    TEST_ASSERT_LESS_THAN(4 * len, error);
+    free(jpg);
+    free(decoded);
+    free(src);
+}
+
+TEST_CASE("JPEG encoder keeps the quality of the pictures", "[camera]")
+{
+    extern const uint8_t img2_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img2_end[]   asm("_binary_test_inside_jpeg_end");
+    // PSNR of the jfdctint encoder with exact division, less 0.2 dB
+    static const struct {
+        uint8_t quality;
+        float psnr;
+    } bounds[] = {
+        { 10, 27.5f }, { 50, 33.3f }, { 80, 36.3f }, { 95, 46.0f },
+    };
+    const int width = 320;
+    const int height = 240;
+    const size_t len = width * height * 3;
+    uint8_t *src = heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (NULL == src) {
+        src = malloc(len);
+    }
+    uint8_t *decoded = heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (NULL == decoded) {
+        decoded = malloc(len);
+    }
+    TEST_ASSERT_NOT_NULL(src);
+    TEST_ASSERT_NOT_NULL(decoded);
+    TEST_ASSERT_TRUE(fmt2rgb888(img2_start, img2_end - img2_start, PIXFORMAT_JPEG, src));
+
+    for (int i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+        uint8_t *jpg = NULL;
+        size_t jpg_len = 0;
+        uint64_t t1 = esp_timer_get_time();
+        TEST_ASSERT_TRUE(fmt2jpg(src, len, width, height, PIXFORMAT_RGB888, bounds[i].quality, &jpg, &jpg_len));
+        uint64_t t2 = esp_timer_get_time();
+        TEST_ASSERT_TRUE(fmt2rgb888(jpg, jpg_len, PIXFORMAT_JPEG, decoded));
+        uint64_t error = 0;
+        for (size_t j = 0; j < len; j++) {
+            int d = src[j] - decoded[j];
+            error += d * d;
+        }
+        float psnr = 10.0f * log10f(255.0f * 255.0f * len / error);
+        printf("JPEG encoder quality=%d size=%u time=%.2f ms psnr=%.2f dB\n", bounds[i].quality,
+               (unsigned) jpg_len, (t2 - t1) / 1000.0f, psnr);
+        TEST_ASSERT_GREATER_THAN_FLOAT(bounds[i].psnr, psnr);
+        free(jpg);
+    }
+    free(decoded);
+    free(src);
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    int calls;
+} jpeg_batch_t;
+
+static size_t jpeg_batch_cb(void *arg, size_t index, const void *data, size_t len)
+{
+    jpeg_batch_t *batch = (jpeg_batch_t *)arg;
+    if (len == 0) {
+        return 0;
+    }
+    batch->calls++;
+    if (index + len <= batch->size) {
+        memcpy(batch->buf + index, data, len);
+    }
+    return len;
+}
+
+TEST_CASE("JPEG encoder writes the callback in batches", "[camera]")
+{
+    extern const uint8_t img3_start[] asm("_binary_test_outside_jpeg_start");
+    extern const uint8_t img3_end[]   asm("_binary_test_outside_jpeg_end");
+    const int width = 480;
+    const int height = 320;
+    const size_t len = width * height * 3;
+    uint8_t *src = heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (NULL == src) {
+        src = malloc(len);
+    }
+    TEST_ASSERT_NOT_NULL(src);
+    TEST_ASSERT_TRUE(fmt2rgb888(img3_start, img3_end - img3_start, PIXFORMAT_JPEG, src));
+
+    uint8_t *jpg = NULL;
+    size_t jpg_len = 0;
+    TEST_ASSERT_TRUE(fmt2jpg(src, len, width, height, PIXFORMAT_RGB888, 95, &jpg, &jpg_len));
+
+    // Same bytes through the callback, in batches of CONFIG_CAMERA_JPEG_OUT_BUF_SIZE,
+    // or of the 4 KB chunks that hold the strips written after the first one
+    jpeg_batch_t batch = { .buf = calloc(1, jpg_len), .size = jpg_len, .calls = 0 };
+    TEST_ASSERT_NOT_NULL(batch.buf);
+    uint64_t t1 = esp_timer_get_time();
+    TEST_ASSERT_TRUE(fmt2jpg_cb(src, len, width, height, PIXFORMAT_RGB888, 95, jpeg_batch_cb, &batch));
+    uint64_t t2 = esp_timer_get_time();
+    const size_t min_batch = CONFIG_CAMERA_JPEG_OUT_BUF_SIZE < 4096 ? CONFIG_CAMERA_JPEG_OUT_BUF_SIZE : 4096;
+    printf("JPEG encoder size=%u callbacks=%d time=%.2f ms\n", (unsigned) jpg_len, batch.calls, (t2 - t1) / 1000.0f);
+    TEST_ASSERT_EQUAL_MEMORY(jpg, batch.buf, jpg_len);
+    TEST_ASSERT_LESS_OR_EQUAL(jpg_len / min_batch + CONFIG_CAMERA_JPEG_ENCODE_TASKS, batch.calls);
+    free(batch.buf);
+    free(jpg);
+    free(src);
+}
+
+/**
+ * @brief i2c master initialization
+ */
+static esp_err_t i2c_master_init(int i2c_port)
+{
+    i2c_config_t conf = {
+        .mode = I2C_MODE_MASTER,
+        .sda_io_num = I2C_MASTER_SDA_IO,
+        .scl_io_num = I2C_MASTER_SCL_IO,
+        .sda_pullup_en = GPIO_PULLUP_ENABLE,
+        .scl_pullup_en = GPIO_PULLUP_ENABLE,
+        .master.clk_speed = I2C_MASTER_FREQ_HZ,
+    };
+
+    i2c_param_config(i2c_port, &conf);
+
+    return i2c_driver_install(i2c_port, conf.mode, 0, 0, 0);
+}
+
+TEST_CASE("Conversions image 227x149 jpeg decode test", "[camera]")
+{
+    img_jpeg_decode_test(0, 0);
+}
+
+TEST_CASE("Conversions image 320x240 jpeg decode test", "[camera]")
+{
+    img_jpeg_decode_test(1, 0);
+}
+
+TEST_CASE("Conversions image 480x320 jpeg decode test", "[camera]")
+{
+    img_jpeg_decode_test(2, 0);
+}
+
+TEST_CASE("Camera driver uses an i2c port initialized by other devices test", "[camera]")
+{
+    TEST_ESP_OK(i2c_master_init(I2C_MASTER_NUM));
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_QVGA, 2, -1, I2C_MASTER_NUM));
+    vTaskDelay(500 / portTICK_RATE_MS);
+    TEST_ESP_OK(esp_camera_deinit());
+    TEST_ESP_OK(i2c_driver_delete(I2C_MASTER_NUM));
+}
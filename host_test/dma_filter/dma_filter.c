@@ -0,0 +1,236 @@
+/*
+   Host test and micro-benchmark of the ESP32 I2S DMA filters of cam_hal.
+
+   Runs the word-wide filters of target/cam_dma_filter.c and the bitfield
+   filters they replaced over the same random DMA buffers, for line lengths
+   that end in the middle of a group of elements and at every alignment of
+   the frame buffer, and checks that both write the same bytes.
+   Then times both over one JPEG half DMA buffer and prints the MB/s of DMA
+   input per filter, and a total line to compare against a previous run.
+   The host has no PSRAM cache in the way, so the speedup here is smaller
+   than on the board.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cam_dma_filter.h"
+
+// The ESP32 DMA filters as they were before the word-wide kernels, one bitfield read per sample
+typedef union {
+	struct {
+		uint32_t sample2:8;
+		uint32_t unused2:8;
+		uint32_t sample1:8;
+		uint32_t unused1:8;
+	};
+	uint32_t val;
+} dma_reference_elem_t;
+
+typedef size_t (*dma_filter_fn_t)(uint8_t *dst, const uint8_t *src, size_t len);
+
+static size_t dma_reference_jpeg(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const dma_reference_elem_t *dma_el = (const dma_reference_elem_t *)src;
+	size_t elements = len / sizeof(dma_reference_elem_t);
+	size_t end = elements / 4;
+	for (size_t i = 0; i < end; ++i) {
+		dst[0] = dma_el[0].sample1;
+		dst[1] = dma_el[1].sample1;
+		dst[2] = dma_el[2].sample1;
+		dst[3] = dma_el[3].sample1;
+		dma_el += 4;
+		dst += 4;
+	}
+	return elements;
+}
+
+static size_t dma_reference_grayscale_highspeed(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const dma_reference_elem_t *dma_el = (const dma_reference_elem_t *)src;
+	size_t elements = len / sizeof(dma_reference_elem_t);
+	size_t end = elements / 8;
+	for (size_t i = 0; i < end; ++i) {
+		dst[0] = dma_el[0].sample1;
+		dst[1] = dma_el[2].sample1;
+		dst[2] = dma_el[4].sample1;
+		dst[3] = dma_el[6].sample1;
+		dma_el += 8;
+		dst += 4;
+	}
+	if ((elements & 0x7) != 0) {
+		dst[0] = dma_el[0].sample1;
+		dst[1] = dma_el[2].sample1;
+		elements += 1;
+	}
+	return elements / 2;
+}
+
+static size_t dma_reference_yuyv(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const dma_reference_elem_t *dma_el = (const dma_reference_elem_t *)src;
+	size_t elements = len / sizeof(dma_reference_elem_t);
+	size_t end = elements / 4;
+	for (size_t i = 0; i < end; ++i) {
+		dst[0] = dma_el[0].sample1;
+		dst[1] = dma_el[0].sample2;
+		dst[2] = dma_el[1].sample1;
+		dst[3] = dma_el[1].sample2;
+		dst[4] = dma_el[2].sample1;
+		dst[5] = dma_el[2].sample2;
+		dst[6] = dma_el[3].sample1;
+		dst[7] = dma_el[3].sample2;
+		dma_el += 4;
+		dst += 8;
+	}
+	return elements * 2;
+}
+
+static size_t dma_reference_yuyv_highspeed(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const dma_reference_elem_t *dma_el = (const dma_reference_elem_t *)src;
+	size_t elements = len / sizeof(dma_reference_elem_t);
+	size_t end = elements / 8;
+	for (size_t i = 0; i < end; ++i) {
+		dst[0] = dma_el[0].sample1;
+		dst[1] = dma_el[1].sample1;
+		dst[2] = dma_el[2].sample1;
+		dst[3] = dma_el[3].sample1;
+		dst[4] = dma_el[4].sample1;
+		dst[5] = dma_el[5].sample1;
+		dst[6] = dma_el[6].sample1;
+		dst[7] = dma_el[7].sample1;
+		dma_el += 8;
+		dst += 8;
+	}
+	if ((elements & 0x7) != 0) {
+		dst[0] = dma_el[0].sample1;
+		dst[1] = dma_el[1].sample1;
+		dst[2] = dma_el[2].sample1;
+		dst[3] = dma_el[2].sample2;
+		elements += 4;
+	}
+	return elements;
+}
+
+static const struct {
+	const char *name;
+	dma_filter_fn_t reference;
+	dma_filter_fn_t filter;
+} dmaFilters[] = {
+	{ "jpeg", dma_reference_jpeg, cam_dma_filter_jpeg },
+	{ "grayscale", dma_reference_jpeg, cam_dma_filter_grayscale },
+	{ "grayscale_highspeed", dma_reference_grayscale_highspeed, cam_dma_filter_grayscale_highspeed },
+	{ "yuyv", dma_reference_yuyv, cam_dma_filter_yuyv },
+	{ "yuyv_highspeed", dma_reference_yuyv_highspeed, cam_dma_filter_yuyv_highspeed },
+};
+
+#define DMA_FILTER_COUNT (sizeof(dmaFilters) / sizeof(dmaFilters[0]))
+
+// Half DMA buffer sizes, plus lines that end in the middle of a group of elements
+static const size_t lens[] = { 4, 8, 12, 20, 28, 32, 36, 44, 60, 64, 1020, 1024, 1028, 4092, 4096 };
+#define MAX_LEN 4096
+// Room for the elements the tail of the highspeed filters reads beyond len
+#define SRC_LEN (MAX_LEN + 32)
+// Output is at most twice the input
+#define DST_LEN (2 * MAX_LEN + 16)
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the number of mismatching cases
+static int check_filters(const uint32_t *src, int *checks)
+{
+	static uint8_t expected[DST_LEN];
+	static uint8_t actual[DST_LEN];
+	int failures = 0;
+	for (size_t f = 0; f < DMA_FILTER_COUNT; f++) {
+		int before = failures;
+		for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+			// The frame buffer position is not always 32-bit aligned
+			for (int shift = 0; shift < 4; shift++) {
+				memset(expected, 0x5A, DST_LEN);
+				memset(actual, 0x5A, DST_LEN);
+				size_t r1 = dmaFilters[f].reference(expected + shift, (const uint8_t *)src, lens[l]);
+				size_t r2 = dmaFilters[f].filter(actual + shift, (const uint8_t *)src, lens[l]);
+				(*checks)++;
+				if (r1 != r2 || memcmp(expected, actual, DST_LEN) != 0) {
+					printf("FAIL %s len=%zu shift=%d returned %zu, expected %zu\n", dmaFilters[f].name, lens[l], shift,
+						r2, r1);
+					failures++;
+				}
+			}
+		}
+		if (failures != before) printf("%s FAILED\n", dmaFilters[f].name);
+	}
+	return failures;
+}
+
+static double time_filter(dma_filter_fn_t fn, uint8_t *dst, const uint8_t *src, size_t len, int runs)
+{
+	volatile size_t sink = 0;
+	double start = now_seconds();
+	for (int i = 0; i < runs; i++) {
+		sink += fn(dst, src, len);
+	}
+	(void)sink;
+	return now_seconds() - start;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: dma-filter [-r runs] [-s shift]\n");
+	fprintf(stderr, "  -r  filtered half DMA buffers per filter (20000)\n");
+	fprintf(stderr, "  -s  byte offset of the frame buffer position, 0 to 3 (0)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int runs = 20000;
+	int shift = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			shift = atoi(argv[++i]);
+		} else {
+			usage();
+		}
+	}
+	if (runs < 1 || shift < 0 || shift > 3) usage();
+
+	static uint32_t src[SRC_LEN / 4];
+	static uint8_t dst[DST_LEN];
+	uint32_t seed = 0x12345678;
+	for (size_t i = 0; i < SRC_LEN / 4; i++) {
+		seed = seed * 1103515245 + 12345;
+		src[i] = seed ^ (seed >> 16);
+	}
+
+	int checks = 0;
+	int failures = check_filters(src, &checks);
+
+	// One JPEG half DMA buffer of the ESP32, filtered as cam_task does
+	double totalReference = 0;
+	double totalFilter = 0;
+	double mb = (double)MAX_LEN * runs / (1024 * 1024);
+	for (size_t f = 0; f < DMA_FILTER_COUNT; f++) {
+		double reference = time_filter(dmaFilters[f].reference, dst + shift, (const uint8_t *)src, MAX_LEN, runs);
+		double filter = time_filter(dmaFilters[f].filter, dst + shift, (const uint8_t *)src, MAX_LEN, runs);
+		// MB/s of DMA input, which is what limits the pixel clock
+		printf("%s bitfield_mb_s=%.1f word_mb_s=%.1f\n", dmaFilters[f].name, mb / reference, mb / filter);
+		totalReference += reference;
+		totalFilter += filter;
+	}
+	// One line for scripts to compare against a baseline
+	printf("BENCH filters=%zu runs=%d shift=%d checks=%d failures=%d bitfield_mb_s=%.1f word_mb_s=%.1f\n", DMA_FILTER_COUNT,
+		runs, shift, checks, failures, mb * DMA_FILTER_COUNT / totalReference, mb * DMA_FILTER_COUNT / totalFilter);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
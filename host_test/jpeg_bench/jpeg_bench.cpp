@@ -0,0 +1,178 @@
+/*
+   Micro-benchmark of the jpge encoder.
+
+   Decodes the test pictures of the esp32-camera component with tjpgd, then
+   encodes them to H2V2 JPEG at several qualities into a stream that only
+   counts bytes and put_buf() calls, like the callback of fmt2jpg_cb.
+   Prints one line per picture and quality, and a total line to compare
+   against a previous run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "jpge.h"
+#include "tjpgd.h"
+
+static const char *defaultPictures[] = {
+	PICTURES_DIR "/testimg.jpeg",
+	PICTURES_DIR "/test_inside.jpeg",
+	PICTURES_DIR "/test_outside.jpeg",
+};
+static const int qualities[] = { 50, 80, 95 };
+
+typedef struct {
+	std::vector<uint8_t> jpeg;
+	size_t index;
+	std::vector<uint8_t> rgb;
+	int width;
+	int height;
+} picture_t;
+
+// Counts what the encoder writes without keeping it
+class count_stream : public jpge::output_stream {
+public:
+	size_t size;
+	int calls;
+
+	count_stream() : size(0), calls(0) { }
+	virtual bool put_buf(const void *buf, int len)
+	{
+		if (buf) {
+			size += len;
+			calls++;
+		}
+		return true;
+	}
+	virtual jpge::uint get_size() const
+	{
+		return size;
+	}
+};
+
+static bool load_file(const char *path, std::vector<uint8_t> *data)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) return false;
+	uint8_t buf[4096];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+		data->insert(data->end(), buf, buf + len);
+	}
+	fclose(f);
+	return true;
+}
+
+static UINT read_jpeg(JDEC *decoder, BYTE *buf, UINT len)
+{
+	picture_t *picture = (picture_t *)decoder->device;
+	if (picture->index + len > picture->jpeg.size()) len = picture->jpeg.size() - picture->index;
+	if (buf) memcpy(buf, picture->jpeg.data() + picture->index, len);
+	picture->index += len;
+	return len;
+}
+
+static UINT write_rgb(JDEC *decoder, void *bitmap, JRECT *rect)
+{
+	picture_t *picture = (picture_t *)decoder->device;
+	int width = rect->right - rect->left + 1;
+	const uint8_t *src = (const uint8_t *)bitmap;
+	for (int y = rect->top; y <= rect->bottom; y++, src += width * 3) {
+		memcpy(&picture->rgb[(y * picture->width + rect->left) * 3], src, width * 3);
+	}
+	return 1;
+}
+
+static bool decode_picture(picture_t *picture)
+{
+	static uint8_t work[8192];
+	JDEC decoder;
+	picture->index = 0;
+	if (jd_prepare(&decoder, read_jpeg, work, sizeof(work), picture) != JDR_OK) return false;
+	picture->width = decoder.width;
+	picture->height = decoder.height;
+	picture->rgb.resize(picture->width * picture->height * 3);
+	return jd_decomp(&decoder, write_rgb, 0) == JDR_OK;
+}
+
+static bool encode_picture(const picture_t *picture, const jpge::params &params, count_stream *stream)
+{
+	jpge::jpeg_encoder encoder;
+	if (!encoder.init(stream, picture->width, picture->height, 3, params)) return false;
+	for (int y = 0; y < picture->height; y++) {
+		if (!encoder.process_scanline(&picture->rgb[y * picture->width * 3])) return false;
+	}
+	return encoder.process_scanline(NULL);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: jpeg-bench [-r runs] [-b batch] [-2] [pictures...]\n");
+	fprintf(stderr, "  -r  encodes of every picture and quality (20)\n");
+	fprintf(stderr, "  -b  output batch size in bytes, params::m_out_buf_size (2048)\n");
+	fprintf(stderr, "  -2  two pass encode with optimized Huffman tables\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int runs = 20;
+	jpge::params params;
+	std::vector<const char *> paths;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			params.m_out_buf_size = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-2") == 0) {
+			params.m_two_pass_flag = true;
+		} else if (argv[i][0] == '-') {
+			usage();
+		} else {
+			paths.push_back(argv[i]);
+		}
+	}
+	if (paths.empty()) paths.assign(defaultPictures, defaultPictures + sizeof(defaultPictures) / sizeof(defaultPictures[0]));
+	if (runs < 1 || !params.check()) usage();
+
+	double totalSeconds = 0;
+	double totalPixels = 0;
+	size_t totalBytes = 0;
+	long totalCalls = 0;
+	for (const char *path : paths) {
+		picture_t picture;
+		if (!load_file(path, &picture.jpeg) || !decode_picture(&picture)) {
+			fprintf(stderr, "%s: cannot decode\n", path);
+			return EXIT_FAILURE;
+		}
+		const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+		for (int quality : qualities) {
+			params.m_quality = quality;
+			count_stream stream;
+			auto start = std::chrono::steady_clock::now();
+			for (int run = 0; run < runs; run++) {
+				stream = count_stream();
+				if (!encode_picture(&picture, params, &stream)) {
+					fprintf(stderr, "%s: encode failed\n", path);
+					return EXIT_FAILURE;
+				}
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / runs;
+			double pixels = (double)picture.width * picture.height;
+			printf("%s %dx%d quality=%d bytes=%zu calls=%d ms=%.3f mpix_s=%.1f\n", name, picture.width, picture.height,
+				quality, stream.size, stream.calls, seconds * 1000, pixels / seconds / 1000000);
+			totalSeconds += seconds;
+			totalPixels += pixels;
+			totalBytes += stream.size;
+			totalCalls += stream.calls;
+		}
+	}
+	// One line for scripts to compare against a baseline
+	printf("BENCH pictures=%zu runs=%d batch=%d two_pass=%d bytes=%zu calls=%ld ms=%.3f mpix_s=%.1f\n", paths.size(), runs,
+		params.m_out_buf_size, params.m_two_pass_flag, totalBytes, totalCalls, totalSeconds * 1000, totalPixels / totalSeconds / 1000000);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+/*
+   Host test of the two pass encode of jpge.
+
+   Decodes the test pictures of the esp32-camera component with tjpgd, then
+   encodes them at several qualities once with the standard Huffman tables
+   and once with m_two_pass_flag, without and with restart markers.
+   Both encodes must decode to the same pixels, and the two pass one must be
+   smaller. With restart markers, the one pass strips of init_strip() written
+   one after the other must give the same file as the whole image, and a
+   two pass strip after the first must be refused.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "jpge.h"
+#include "tjpgd.h"
+
+static const char *defaultPictures[] = {
+	PICTURES_DIR "/testimg.jpeg",
+	PICTURES_DIR "/test_inside.jpeg",
+	PICTURES_DIR "/test_outside.jpeg",
+};
+static const int qualities[] = { 50, 80, 95 };
+// MCU rows between restart markers, 0 for none
+static const int restartRows[] = { 0, 2 };
+
+typedef struct {
+	std::vector<uint8_t> jpeg;
+	size_t index;
+	std::vector<uint8_t> rgb;
+	int width;
+	int height;
+} picture_t;
+
+// Keeps what the encoder writes
+class memory_stream : public jpge::output_stream {
+public:
+	std::vector<uint8_t> data;
+
+	virtual bool put_buf(const void *buf, int len)
+	{
+		if (buf) data.insert(data.end(), (const uint8_t *)buf, (const uint8_t *)buf + len);
+		return true;
+	}
+	virtual jpge::uint get_size() const
+	{
+		return data.size();
+	}
+};
+
+static bool load_file(const char *path, std::vector<uint8_t> *data)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) return false;
+	uint8_t buf[4096];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+		data->insert(data->end(), buf, buf + len);
+	}
+	fclose(f);
+	return true;
+}
+
+static UINT read_jpeg(JDEC *decoder, BYTE *buf, UINT len)
+{
+	picture_t *picture = (picture_t *)decoder->device;
+	if (picture->index + len > picture->jpeg.size()) len = picture->jpeg.size() - picture->index;
+	if (buf) memcpy(buf, picture->jpeg.data() + picture->index, len);
+	picture->index += len;
+	return len;
+}
+
+static UINT write_rgb(JDEC *decoder, void *bitmap, JRECT *rect)
+{
+	picture_t *picture = (picture_t *)decoder->device;
+	int width = rect->right - rect->left + 1;
+	const uint8_t *src = (const uint8_t *)bitmap;
+	for (int y = rect->top; y <= rect->bottom; y++, src += width * 3) {
+		memcpy(&picture->rgb[(y * picture->width + rect->left) * 3], src, width * 3);
+	}
+	return 1;
+}
+
+static bool decode_picture(picture_t *picture)
+{
+	static uint8_t work[8192];
+	JDEC decoder;
+	picture->index = 0;
+	if (jd_prepare(&decoder, read_jpeg, work, sizeof(work), picture) != JDR_OK) return false;
+	picture->width = decoder.width;
+	picture->height = decoder.height;
+	picture->rgb.resize(picture->width * picture->height * 3);
+	return jd_decomp(&decoder, write_rgb, 0) == JDR_OK;
+}
+
+// Encode the lines from firstLine to lastLine, the whole image when they are 0 and the height
+static bool encode_picture(const picture_t *picture, const jpge::params &params, int firstLine, int lastLine, memory_stream *stream)
+{
+	jpge::jpeg_encoder encoder;
+	if (!encoder.init_strip(stream, picture->width, picture->height, 3, firstLine, params)) return false;
+	for (int y = firstLine; y < lastLine; y++) {
+		if (!encoder.process_scanline(&picture->rgb[y * picture->width * 3])) return false;
+	}
+	return encoder.process_scanline(NULL);
+}
+
+// Encode the image in strips of restart_rows MCU rows, written one after the other
+static bool encode_strips(const picture_t *picture, const jpge::params &params, memory_stream *stream)
+{
+	// H2V2 MCUs are 16 lines high
+	int stripLines = params.m_restart_rows * 16;
+	for (int firstLine = 0; firstLine < picture->height; firstLine += stripLines) {
+		int lastLine = (firstLine + stripLines < picture->height) ? firstLine + stripLines : picture->height;
+		if (!encode_picture(picture, params, firstLine, lastLine, stream)) return false;
+	}
+	return true;
+}
+
+static bool decode_encoded(const memory_stream &stream, const picture_t *source, picture_t *decoded)
+{
+	decoded->jpeg = stream.data;
+	if (!decode_picture(decoded)) return false;
+	return decoded->width == source->width && decoded->height == source->height;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: jpeg-check [pictures...]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<const char *> paths;
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] == '-') usage();
+		paths.push_back(argv[i]);
+	}
+	if (paths.empty()) paths.assign(defaultPictures, defaultPictures + sizeof(defaultPictures) / sizeof(defaultPictures[0]));
+
+	int checks = 0;
+	int failures = 0;
+	size_t onePassBytes = 0;
+	size_t twoPassBytes = 0;
+	for (const char *path : paths) {
+		picture_t picture;
+		if (!load_file(path, &picture.jpeg) || !decode_picture(&picture)) {
+			fprintf(stderr, "%s: cannot decode\n", path);
+			return EXIT_FAILURE;
+		}
+		const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+		for (int restart : restartRows) {
+			for (int quality : qualities) {
+				jpge::params params;
+				params.m_quality = quality;
+				params.m_restart_rows = restart;
+				memory_stream onePass;
+				memory_stream twoPass;
+				picture_t onePassPicture;
+				picture_t twoPassPicture;
+				bool ok = encode_picture(&picture, params, 0, picture.height, &onePass) &&
+					decode_encoded(onePass, &picture, &onePassPicture);
+				params.m_two_pass_flag = true;
+				ok = ok && encode_picture(&picture, params, 0, picture.height, &twoPass) &&
+					decode_encoded(twoPass, &picture, &twoPassPicture);
+				checks++;
+				if (!ok) {
+					printf("FAIL %s restart=%d quality=%d encode or decode failed\n", name, restart, quality);
+					failures++;
+					continue;
+				}
+				// Only the Huffman tables differ, so the decoded pixels are the same
+				checks++;
+				if (onePassPicture.rgb != twoPassPicture.rgb) {
+					printf("FAIL %s restart=%d quality=%d pixels differ\n", name, restart, quality);
+					failures++;
+				}
+				checks++;
+				if (twoPass.data.size() >= onePass.data.size()) {
+					printf("FAIL %s restart=%d quality=%d two pass bytes=%zu not smaller than %zu\n", name, restart, quality,
+						twoPass.data.size(), onePass.data.size());
+					failures++;
+				}
+				printf("%s restart=%d quality=%d one_pass=%zu two_pass=%zu saved=%.1f%%\n", name, restart, quality,
+					onePass.data.size(), twoPass.data.size(), 100.0 - 100.0 * twoPass.data.size() / onePass.data.size());
+				onePassBytes += onePass.data.size();
+				twoPassBytes += twoPass.data.size();
+
+				if (restart == 0) continue;
+				// The strips of a one pass encode make up the same file
+				params.m_two_pass_flag = false;
+				memory_stream strips;
+				checks++;
+				if (!encode_strips(&picture, params, &strips) || strips.data != onePass.data) {
+					printf("FAIL %s restart=%d quality=%d strips differ from the whole image\n", name, restart, quality);
+					failures++;
+				}
+				// The tables of a two pass encode only fit the whole image
+				params.m_two_pass_flag = true;
+				memory_stream refused;
+				jpge::jpeg_encoder encoder;
+				checks++;
+				if (encoder.init_strip(&refused, picture.width, picture.height, 3, restart * 16, params)) {
+					printf("FAIL %s restart=%d quality=%d two pass strip accepted\n", name, restart, quality);
+					failures++;
+				}
+			}
+		}
+	}
+	// One line for scripts to compare against a baseline
+	printf("CHECK pictures=%zu checks=%d failures=%d one_pass_bytes=%zu two_pass_bytes=%zu\n", paths.size(), checks, failures,
+		onePassBytes, twoPassBytes);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,280 @@
+/*
+   Host test and micro-benchmark of the JPEG marker search of cam_hal.
+
+   Loads the test pictures of the esp32-camera component into a frame buffer
+   padded like cam_task leaves it, then checks that cam_jpeg_scan_eoi() finds
+   the same EOI as a byte by byte search when the frame is split into DMA
+   buffers of many sizes and placed at every alignment.
+   Hand made buffers check markers split between buffers, stuffed bytes and
+   missing markers. Prints one line per picture, and a total line that times
+   the scan against the old backward search.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cam_jpeg_scan.h"
+
+static const char *defaultPictures[] = {
+	PICTURES_DIR "/testimg.jpeg",
+	PICTURES_DIR "/test_inside.jpeg",
+	PICTURES_DIR "/test_outside.jpeg",
+};
+static const size_t dmaLens[] = { 1, 2, 3, 5, 7, 64, 1023, 1024, 4096 };
+
+static int checks;
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	checks++; \
+	if (!(cond)) { \
+		failures++; \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while (0)
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t *load_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) return NULL;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *data = malloc(size > 0 ? size : 1);
+	if (data != NULL && fread(data, 1, size, f) != (size_t)size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	*len = size;
+	return data;
+}
+
+// The frame buffer as cam_task fills it: the picture, then stale bytes up to the end of the last DMA buffer.
+// The stale bytes end with the EOI of an older and larger frame.
+// One spare byte in front lets the frame move to every alignment.
+static uint8_t *scan_frame(const uint8_t *jpg, size_t jpg_len, size_t buf_len)
+{
+	uint8_t *buf = malloc(buf_len + 4);
+	if (buf == NULL) return NULL;
+	memcpy(buf, jpg, jpg_len);
+	memset(buf + jpg_len, 0xA5, buf_len - jpg_len);
+	buf[buf_len - 2] = 0xFF;
+	buf[buf_len - 1] = 0xD9;
+	return buf;
+}
+
+// The first EOI of the frame, one byte at a time
+static int reference_eoi(const uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i + 1 < len; i++) {
+		if (buf[i] == 0xFF && buf[i + 1] == 0xD9) return i;
+	}
+	return -1;
+}
+
+// The EOI search cam_take used to do, backwards from the end of the buffer
+static int backward_eoi(const uint8_t *buf, size_t len)
+{
+	static const uint8_t eoi_marker[2] = { 0xFF, 0xD9 };
+	const uint8_t *dptr = buf + len - 2;
+	while (dptr > buf) {
+		if (memcmp(dptr, eoi_marker, 2) == 0) return dptr - buf;
+		dptr--;
+	}
+	return -1;
+}
+
+static int scan_in_buffers(const uint8_t *buf, size_t len, size_t dma_len)
+{
+	cam_jpeg_scan_t scan;
+	cam_jpeg_scan_reset(&scan);
+	for (size_t offset = 0; offset < len; offset += dma_len) {
+		size_t n = (len - offset < dma_len) ? len - offset : dma_len;
+		cam_jpeg_scan_eoi(&scan, buf + offset, n);
+	}
+	CHECK(scan.len == len, "scanned %zu of %zu bytes", scan.len, len);
+	return scan.eoi;
+}
+
+static void check_picture(const char *name, const uint8_t *jpg, size_t jpg_len)
+{
+	int before = failures;
+	size_t buf_len = (jpg_len / 1024 + 2) * 1024;
+	uint8_t *buf = scan_frame(jpg, jpg_len, buf_len);
+	if (buf == NULL) {
+		CHECK(0, "%s: out of memory", name);
+		return;
+	}
+	int expected = reference_eoi(buf, buf_len);
+	CHECK(expected > 0 && expected < (int)jpg_len, "%s: no EOI inside the picture (%d)", name, expected);
+	CHECK(cam_jpeg_find_soi(buf, 1024) == 0, "%s: SOI not at 0", name);
+	for (size_t i = 0; i < sizeof(dmaLens) / sizeof(dmaLens[0]); i++) {
+		int eoi = scan_in_buffers(buf, buf_len, dmaLens[i]);
+		CHECK(eoi == expected, "%s: dma_len=%zu eoi=%d expected=%d", name, dmaLens[i], eoi, expected);
+	}
+	// At every alignment of the buffer
+	for (int shift = 1; shift < 4; shift++) {
+		memmove(buf + 1, buf, buf_len + shift - 1);
+		int soi = cam_jpeg_find_soi(buf, 1024);
+		CHECK(soi == shift, "%s: shift=%d soi=%d", name, shift, soi);
+		for (size_t i = 0; i < sizeof(dmaLens) / sizeof(dmaLens[0]); i++) {
+			int eoi = scan_in_buffers(buf, buf_len + shift, dmaLens[i]);
+			CHECK(eoi == expected + shift, "%s: shift=%d dma_len=%zu eoi=%d expected=%d", name, shift, dmaLens[i], eoi,
+				expected + shift);
+		}
+	}
+	printf("%s bytes=%zu buffer=%zu eoi=%d %s\n", name, jpg_len, buf_len, expected, failures == before ? "ok" : "FAILED");
+	free(buf);
+}
+
+static void check_markers(void)
+{
+	uint8_t buf[16];
+	cam_jpeg_scan_t scan;
+
+	// EOI split between two buffers
+	memset(buf, 0, sizeof(buf));
+	buf[7] = 0xFF;
+	buf[8] = 0xD9;
+	cam_jpeg_scan_reset(&scan);
+	cam_jpeg_scan_eoi(&scan, buf, 8);
+	CHECK(scan.eoi == -1, "EOI found in the first half");
+	cam_jpeg_scan_eoi(&scan, buf + 8, 8);
+	CHECK(scan.eoi == 7, "split EOI eoi=%d", scan.eoi);
+
+	// Fill bytes before the marker, a stuffed 0xFF and a restart marker are not EOI
+	const uint8_t stuffed[] = { 0x12, 0xFF, 0x00, 0xFF, 0xD0, 0xFF, 0xFF, 0xFF, 0xD9, 0xFF, 0xD9 };
+	cam_jpeg_scan_reset(&scan);
+	cam_jpeg_scan_eoi(&scan, stuffed, sizeof(stuffed));
+	CHECK(scan.eoi == 7, "stuffed eoi=%d", scan.eoi);
+	for (size_t i = 1; i < sizeof(dmaLens) / sizeof(dmaLens[0]) && dmaLens[i] < sizeof(stuffed); i++) {
+		int eoi = scan_in_buffers(stuffed, sizeof(stuffed), dmaLens[i]);
+		CHECK(eoi == 7, "stuffed dma_len=%zu eoi=%d", dmaLens[i], eoi);
+	}
+
+	// 0xFF at the end of a buffer followed by something else
+	cam_jpeg_scan_reset(&scan);
+	cam_jpeg_scan_eoi(&scan, stuffed, 2);
+	cam_jpeg_scan_eoi(&scan, stuffed + 2, 2);
+	CHECK(scan.eoi == -1, "0xFF 0x00 split eoi=%d", scan.eoi);
+
+	// Empty buffers keep a pending 0xFF
+	cam_jpeg_scan_reset(&scan);
+	cam_jpeg_scan_eoi(&scan, buf, 8);
+	cam_jpeg_scan_eoi(&scan, buf + 8, 0);
+	cam_jpeg_scan_eoi(&scan, buf + 8, 8);
+	CHECK(scan.eoi == 7, "split EOI around an empty buffer eoi=%d", scan.eoi);
+
+	// No markers at all
+	memset(buf, 0xA5, sizeof(buf));
+	buf[sizeof(buf) - 1] = 0xFF;
+	cam_jpeg_scan_reset(&scan);
+	cam_jpeg_scan_eoi(&scan, buf, sizeof(buf));
+	CHECK(scan.eoi == -1, "no marker eoi=%d", scan.eoi);
+	CHECK(cam_jpeg_find_soi(buf, sizeof(buf)) == -1, "no marker soi");
+	buf[sizeof(buf) - 2] = 0xFF;
+	buf[sizeof(buf) - 1] = 0xD8;
+	CHECK(cam_jpeg_find_soi(buf, sizeof(buf)) == -1, "SOI without the next 0xFF");
+}
+
+// A UXGA frame buffer with a frame of half its size, made of the entropy data of a recorded picture
+static void bench(const uint8_t *jpg_src, size_t jpg_src_len, int runs, double *ms_backward, double *ms_scan)
+{
+	const size_t buf_len = 1600 * 1200 / 5;
+	const size_t jpg_len = buf_len / 2;
+	const size_t head = jpg_src_len > 2048 ? 1024 : jpg_src_len / 2;
+	size_t body = jpg_src_len - 2 - head;
+	uint8_t *jpg = malloc(jpg_len);
+	for (size_t offset = 0; offset < jpg_len; offset += body) {
+		memcpy(jpg + offset, jpg_src + head, (jpg_len - offset < body) ? jpg_len - offset : body);
+	}
+	// Keep only the last EOI
+	for (size_t i = 0; i + 1 < jpg_len; i++) {
+		if (jpg[i] == 0xFF && jpg[i + 1] == 0xD9) jpg[i + 1] = 0;
+	}
+	memcpy(jpg, jpg_src, head);
+	jpg[jpg_len - 2] = 0xFF;
+	jpg[jpg_len - 1] = 0xD9;
+	uint8_t *buf = scan_frame(jpg, jpg_len, buf_len);
+	free(jpg);
+	// The stale bytes of an older frame are zeros here, as the backward search expects
+	memset(buf + jpg_len, 0, buf_len - jpg_len);
+
+	double t_backward = 0;
+	double t_scan = 0;
+	for (int i = 0; i < runs; i++) {
+		double t1 = now_seconds();
+		int backward = backward_eoi(buf, buf_len);
+		double t2 = now_seconds();
+		int eoi = scan_in_buffers(buf, buf_len, 1024);
+		double t3 = now_seconds();
+		CHECK(backward == (int)jpg_len - 2, "backward eoi=%d", backward);
+		CHECK(eoi == (int)jpg_len - 2, "bench eoi=%d", eoi);
+		t_backward += t2 - t1;
+		t_scan += t3 - t2;
+	}
+	*ms_backward = t_backward * 1000 / runs;
+	*ms_scan = t_scan * 1000 / runs;
+	free(buf);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: jpeg-scan [-r runs] [pictures...]\n");
+	fprintf(stderr, "  -r  searches of the benchmark frame (200)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int runs = 200;
+	const char **paths = defaultPictures;
+	int count = sizeof(defaultPictures) / sizeof(defaultPictures[0]);
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else {
+			usage();
+		}
+	}
+	if (i < argc) {
+		paths = (const char **)argv + i;
+		count = argc - i;
+	}
+	if (runs < 1) usage();
+
+	check_markers();
+	double ms_backward = 0;
+	double ms_scan = 0;
+	for (i = 0; i < count; i++) {
+		size_t len;
+		uint8_t *jpg = load_file(paths[i], &len);
+		if (jpg == NULL || len < 4) {
+			fprintf(stderr, "%s: cannot read\n", paths[i]);
+			return EXIT_FAILURE;
+		}
+		const char *name = strrchr(paths[i], '/') ? strrchr(paths[i], '/') + 1 : paths[i];
+		check_picture(name, jpg, len);
+		// The benchmark frame is made of the first picture
+		if (i == 0) bench(jpg, len, runs, &ms_backward, &ms_scan);
+		free(jpg);
+	}
+	// One line for scripts to compare against a baseline
+	printf("BENCH pictures=%d runs=%d checks=%d failures=%d backward_ms=%.3f scan_ms=%.3f\n", count, runs, checks,
+		failures, ms_backward, ms_scan);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,274 @@
+/*
+   Synthetic camera for the linux host build.
+
+   Implements the part of the esp32-camera API that the application uses.
+   esp_camera_fb_get() replays the JPEG test pictures at CONFIG_SYNTHETIC_CAMERA_FPS
+   from a pool of fb_count frame buffers, so a slow consumer runs out of buffers
+   just like it does on the board.
+   A report task logs the frame rate, the upload counters, the trigger to upload
+   latency and the memory high-water mark.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_camera.h"
+
+#include "pipeline.h"
+#if CONFIG_SHUTTER_AUTO
+#include "auto_acquisition.h"
+#endif
+
+static const char *TAG = "SYNTH";
+
+extern const uint8_t testimg_jpeg_start[] asm("_binary_testimg_jpeg_start");
+extern const uint8_t testimg_jpeg_end[] asm("_binary_testimg_jpeg_end");
+extern const uint8_t test_inside_jpeg_start[] asm("_binary_test_inside_jpeg_start");
+extern const uint8_t test_inside_jpeg_end[] asm("_binary_test_inside_jpeg_end");
+extern const uint8_t test_outside_jpeg_start[] asm("_binary_test_outside_jpeg_start");
+extern const uint8_t test_outside_jpeg_end[] asm("_binary_test_outside_jpeg_end");
+
+typedef struct {
+	const uint8_t *buf;
+	size_t len;
+	size_t width;
+	size_t height;
+} picture_t;
+
+static picture_t pictures[3];
+static int pictureCount;
+static int pictureNext;
+
+static camera_fb_t *frames;
+static QueueHandle_t xQueueFree;
+static SemaphoreHandle_t xSemaphoreGet;
+static sensor_t sensor;
+static int64_t nextFrame;
+static uint32_t delivered;
+static uint32_t starved;
+
+// Read the picture size from the SOF0 marker
+static void jpeg_size(picture_t *picture)
+{
+	const uint8_t *p = picture->buf;
+	for (size_t i = 2; i + 9 < picture->len; i++) {
+		if (p[i] == 0xFF && p[i+1] == 0xC0) {
+			picture->height = (p[i+5] << 8) | p[i+6];
+			picture->width = (p[i+7] << 8) | p[i+8];
+			return;
+		}
+	}
+	picture->width = 0;
+	picture->height = 0;
+}
+
+// Grow the picture to CONFIG_SYNTHETIC_CAMERA_FRAME_SIZE with comment segments after SOI,
+// so it is still a complete JPEG like the ones the driver delivers
+static const uint8_t *pad_picture(const uint8_t *start, size_t *len)
+{
+	if (CONFIG_SYNTHETIC_CAMERA_FRAME_SIZE < *len + 4) return start;
+	uint8_t *padded = malloc(CONFIG_SYNTHETIC_CAMERA_FRAME_SIZE);
+	if (padded == NULL) return start;
+	size_t pad = CONFIG_SYNTHETIC_CAMERA_FRAME_SIZE - *len;
+	uint8_t *p = padded;
+	memcpy(p, start, 2);
+	p += 2;
+	while (pad >= 4) {
+		size_t segment = (pad > 65537) ? 65537 : pad;
+		if (pad - segment > 0 && pad - segment < 4) segment -= 4;
+		p[0] = 0xFF;
+		p[1] = 0xFE;
+		p[2] = (segment - 2) >> 8;
+		p[3] = (segment - 2) & 0xFF;
+		memset(p + 4, 0, segment - 4);
+		p += segment;
+		pad -= segment;
+	}
+	memcpy(p, start + 2, *len - 2);
+	*len = (p - padded) + *len - 2;
+	return padded;
+}
+
+static void add_picture(const uint8_t *start, const uint8_t *end)
+{
+	picture_t *picture = &pictures[pictureCount++];
+	picture->len = end - start;
+	picture->buf = pad_picture(start, &picture->len);
+	jpeg_size(picture);
+	ESP_LOGI(TAG, "picture %d: %zux%zu %zu bytes", pictureCount, picture->width, picture->height, picture->len);
+}
+
+static int stub_set_quality(sensor_t *s, int quality)
+{
+	s->status.quality = quality;
+	return 0;
+}
+
+static int stub_set_framesize(sensor_t *s, framesize_t framesize)
+{
+	s->status.framesize = framesize;
+	return 0;
+}
+
+static void report_task(void *pvParameters);
+
+esp_err_t esp_camera_init(const camera_config_t *config)
+{
+	add_picture(testimg_jpeg_start, testimg_jpeg_end);
+	add_picture(test_inside_jpeg_start, test_inside_jpeg_end);
+	add_picture(test_outside_jpeg_start, test_outside_jpeg_end);
+
+	size_t bufferSize = 0;
+	for (int i = 0; i < pictureCount; i++) {
+		if (pictures[i].len > bufferSize) bufferSize = pictures[i].len;
+	}
+
+	int fb_count = config->fb_count > 0 ? config->fb_count : 1;
+	frames = calloc(fb_count, sizeof(camera_fb_t));
+	xQueueFree = xQueueCreate(fb_count, sizeof(camera_fb_t *));
+	xSemaphoreGet = xSemaphoreCreateMutex();
+	if (frames == NULL || xQueueFree == NULL || xSemaphoreGet == NULL) return ESP_ERR_NO_MEM;
+	for (int i = 0; i < fb_count; i++) {
+		frames[i].buf = calloc(1, bufferSize);
+		if (frames[i].buf == NULL) return ESP_ERR_NO_MEM;
+		camera_fb_t *fb = &frames[i];
+		xQueueSend(xQueueFree, &fb, 0);
+	}
+
+	sensor.pixformat = PIXFORMAT_JPEG;
+	sensor.status.framesize = config->frame_size;
+	sensor.status.quality = config->jpeg_quality;
+	sensor.set_quality = stub_set_quality;
+	sensor.set_framesize = stub_set_framesize;
+
+	ESP_LOGI(TAG, "fb_count=%d buffer=%zu fps=%d", fb_count, bufferSize, CONFIG_SYNTHETIC_CAMERA_FPS);
+	nextFrame = esp_timer_get_time();
+	xTaskCreate(report_task, "REPORT", 1024*4, NULL, 1, NULL);
+	return ESP_OK;
+}
+
+esp_err_t esp_camera_deinit(void)
+{
+	return ESP_OK;
+}
+
+camera_fb_t *esp_camera_fb_get(void)
+{
+	const int64_t period = 1000000 / CONFIG_SYNTHETIC_CAMERA_FPS;
+	camera_fb_t *fb = NULL;
+
+	xSemaphoreTake(xSemaphoreGet, portMAX_DELAY);
+	// Wait for the next frame of the sensor, frames that nobody asked for are lost
+	int64_t now = esp_timer_get_time();
+	if (nextFrame < now - period) nextFrame = now;
+	if (nextFrame > now) vTaskDelay(pdMS_TO_TICKS((nextFrame - now + 999) / 1000));
+	nextFrame += period;
+
+	if (xQueueReceive(xQueueFree, &fb, pdMS_TO_TICKS(4000)) != pdTRUE) {
+		ESP_LOGW(TAG, "Failed to get the frame on time!");
+		starved++;
+		xSemaphoreGive(xSemaphoreGet);
+		return NULL;
+	}
+
+	picture_t *picture = &pictures[pictureNext];
+	pictureNext = (pictureNext + 1) % pictureCount;
+	memcpy(fb->buf, picture->buf, picture->len);
+	fb->len = picture->len;
+	fb->width = picture->width;
+	fb->height = picture->height;
+	fb->format = PIXFORMAT_JPEG;
+	gettimeofday(&fb->timestamp, NULL);
+	delivered++;
+	xSemaphoreGive(xSemaphoreGet);
+	return fb;
+}
+
+void esp_camera_fb_return(camera_fb_t *fb)
+{
+	if (fb == NULL) return;
+	xQueueSend(xQueueFree, &fb, 0);
+}
+
+sensor_t *esp_camera_sensor_get(void)
+{
+	return &sensor;
+}
+
+void esp_camera_get_stats(camera_stats_t *stats)
+{
+	memset(stats, 0, sizeof(camera_stats_t));
+	stats->timeout = starved;
+}
+
+// The synthetic camera only delivers JPEG, so nothing has to be converted
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+	ESP_LOGE(TAG, "fmt2jpg is not available in the host build");
+	return false;
+}
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void * arg)
+{
+	ESP_LOGE(TAG, "fmt2jpg_cb is not available in the host build");
+	return false;
+}
+
+static long max_rss_kb(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+	return usage.ru_maxrss;
+}
+
+static void report_task(void *pvParameters)
+{
+	int64_t startTime = esp_timer_get_time();
+	int64_t lastTime = startTime;
+	uint32_t lastDelivered = 0;
+	uint32_t lastUploaded = 0;
+	pipeline_stats_t pipeline;
+
+	while(1) {
+		vTaskDelay(pdMS_TO_TICKS(CONFIG_SYNTHETIC_REPORT_PERIOD * 1000));
+		int64_t now = esp_timer_get_time();
+		float seconds = (now - lastTime) / 1000000.0;
+		pipeline_get_stats(&pipeline);
+		ESP_LOGI(TAG, "camera %.1f fps, upload %.1f fps, queued=%"PRIu32" dropped=%"PRIu32" uploaded=%"PRIu32" failed=%"PRIu32" starved=%"PRIu32" max_rss=%ldKB",
+			(delivered - lastDelivered) / seconds, (pipeline.uploaded - lastUploaded) / seconds,
+			pipeline.queued, pipeline.dropped, pipeline.uploaded, pipeline.failed, starved, max_rss_kb());
+#if CONFIG_SHUTTER_AUTO
+		acquisition_stats_t acquisition;
+		acquisition_get_stats(&acquisition);
+		ESP_LOGI(TAG, "trigger %.1f fps, latency=%"PRId64"us jitter avg=%"PRId64"us max=%"PRId64"us missed=%"PRIu32,
+			acquisition.fps, acquisition.latency_us, acquisition.jitter_avg_us, acquisition.jitter_max_us, acquisition.missed);
+#endif
+		lastTime = now;
+		lastDelivered = delivered;
+		lastUploaded = pipeline.uploaded;
+
+#if CONFIG_SYNTHETIC_RUN_TIME
+		if (now - startTime >= CONFIG_SYNTHETIC_RUN_TIME * 1000000LL) {
+			// One line for scripts to compare against a baseline
+			float total = (now - startTime) / 1000000.0;
+			int64_t latency = 0;
+#if CONFIG_SHUTTER_AUTO
+			latency = acquisition.latency_us;
+#endif
+			printf("BENCH seconds=%.0f frames=%"PRIu32" upload_fps=%.2f dropped=%"PRIu32" failed=%"PRIu32" latency_us=%"PRId64" max_rss_kb=%ld\n",
+				total, pipeline.uploaded, pipeline.uploaded / total, pipeline.dropped, pipeline.failed, latency, max_rss_kb());
+			fflush(stdout);
+			exit(pipeline.uploaded > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+#endif
+	}
+}
@@ -0,0 +1,77 @@
+#!/usr/bin/python
+#-*- encoding: utf-8 -*-
+# Multipart upload server for the host build.
+# Accepts Content-Length and chunked requests with one or more pictures,
+# and prints the number of pictures and bytes received every second.
+import argparse
+import email.parser
+import email.policy
+import http.server
+import threading
+import time
+
+lock = threading.Lock()
+pictures = 0
+received = 0
+errors = 0
+
+def read_chunked(rfile):
+	body = b''
+	while True:
+		size = int(rfile.readline().split(b';')[0].strip(), 16)
+		if size == 0:
+			rfile.readline()
+			return body
+		body += rfile.read(size)
+		rfile.read(2)
+
+class UploadHandler(http.server.BaseHTTPRequestHandler):
+	protocol_version = "HTTP/1.1"
+
+	def do_POST(self):
+		global pictures, received, errors
+		if self.headers.get('Transfer-Encoding', '').lower() == 'chunked':
+			body = read_chunked(self.rfile)
+		else:
+			body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+		message = email.parser.BytesParser(policy=email.policy.HTTP).parsebytes(
+			b"Content-Type: " + self.headers.get('Content-Type', '').encode() + b"\r\n\r\n" + body)
+		count = 0
+		if message.is_multipart():
+			for part in message.iter_parts():
+				if part.get_filename(): count += 1
+		with lock:
+			if count == 0: errors += 1
+			pictures += count
+			received += len(body)
+		reply = "{} pictures\n".format(count).encode()
+		self.send_response(200 if count else 400)
+		self.send_header("Content-Type", "text/plain")
+		self.send_header("Content-Length", str(len(reply)))
+		# Like the real server, keep the connection only when asked to
+		if self.headers.get('Connection', '').lower() != 'keep-alive':
+			self.send_header("Connection", "close")
+			self.close_connection = True
+		self.end_headers()
+		self.wfile.write(reply)
+
+	def log_message(self, format, *args):
+		pass
+
+def report():
+	global pictures, received, errors
+	while True:
+		time.sleep(1)
+		with lock:
+			print("{} pictures/s {:.1f} KB/s errors={}".format(pictures, received / 1024, errors), flush=True)
+			pictures = 0
+			received = 0
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--port', type=int, help='http port', default=8000)
+args = parser.parse_args()
+
+threading.Thread(target=report, daemon=True).start()
+server = http.server.ThreadingHTTPServer(("127.0.0.1", args.port), UploadHandler)
+print("listening on 127.0.0.1:{}".format(args.port), flush=True)
+server.serve_forever()
@@ -1,3 +1,5 @@
+#include "sdkconfig.h"
+
 #if CONFIG_SHUTTER_AUTO
 
 
@@ -10,83 +12,228 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include "esp_timer.h"
 #include "esp_log.h"
 #include "esp_sleep.h"
-#include "sdkconfig.h"
 
+#include "auto_acquisition.h"
 
 
 extern QueueHandle_t xQueueCmd;
 
 static const char *TAG = "AUTO";
 
-uint64_t interval_us = 500000;
+// Stats are logged this often
+#define REPORT_INTERVAL_US 10000000LL
 
-CMD_t cmdBuf;
+// Keep this much headroom over the measured capture+upload latency
+#define LATENCY_MARGIN_PERCENT 10
 
-esp_timer_handle_t periodic_timer;
+// Limits of the fps and interval commands, the range of CONFIG_AUTO_INTERVAL_MS
+#define MIN_INTERVAL_MS 50
+#define MAX_INTERVAL_MS 3600000
 
+static TaskHandle_t schedulerTask;
+static esp_timer_handle_t deadline_timer;
+static portMUX_TYPE schedLock = portMUX_INITIALIZER_UNLOCKED;
 
-static void periodic_timer_callback(void* arg)
-{
-    int64_t time_since_boot = esp_timer_get_time();
-    ESP_LOGI(TAG, "Periodic timer called, time since boot: %lld us", time_since_boot);
-    
-    if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
-        ESP_LOGE(TAG, "xQueueSend fail");
-    }
-    ESP_LOGE(TAG, "xQueueSend SUCCESS");
-}
+static uint64_t target_interval_us = CONFIG_AUTO_INTERVAL_MS * 1000ULL;
+static int64_t latency_avg_us = 0;      // Moving average of capture+upload latency
+static acquisition_stats_t stats;
 
 
-void setup_timer(){
-    const esp_timer_create_args_t periodic_timer_args = {
-            .callback = &periodic_timer_callback,
-            /* name is optional, but may help identify the timer when debugging */
-            .name = "acuisition_timer"
-    };
+// Wake the scheduler task at the deadline
+static void deadline_timer_callback(void* arg)
+{
+    xTaskNotifyGive(schedulerTask);
+}
 
-    ESP_ERROR_CHECK(esp_timer_create(&periodic_timer_args, &periodic_timer));
-    /* The timer has been created but is not running yet */
+// Interval actually used: the target, stretched when the pipeline can't keep up
+static uint64_t effective_interval(void)
+{
+    portENTER_CRITICAL(&schedLock);
+    uint64_t interval = target_interval_us;
+#if CONFIG_AUTO_ADAPTIVE
+    uint64_t needed = latency_avg_us * (100 + LATENCY_MARGIN_PERCENT) / 100;
+    if (needed > interval) interval = needed;
+#endif
+    portEXIT_CRITICAL(&schedLock);
+    return interval;
+}
 
-    /* Start the timers */
-    ESP_ERROR_CHECK(esp_timer_start_periodic(periodic_timer, interval_us));
-    ESP_LOGI(TAG, "Started timer, time since boot: %lld us", esp_timer_get_time());
+// Change the target frame interval at runtime
+void acquisition_set_interval(uint64_t interval_us)
+{
+    if (interval_us == 0) return;
+    portENTER_CRITICAL(&schedLock);
+    target_interval_us = interval_us;
+    portEXIT_CRITICAL(&schedLock);
+    ESP_LOGI(TAG, "target interval=%"PRIu64" us", interval_us);
 }
 
-void print_timer_state(){
-    ESP_ERROR_CHECK(esp_timer_dump(stdout));
+// Called by the shutter loop with the time one frame took from trigger to upload
+void acquisition_report_latency(int64_t latency_us)
+{
+    portENTER_CRITICAL(&schedLock);
+    if (latency_avg_us == 0) {
+        latency_avg_us = latency_us;
+    } else {
+        latency_avg_us = (latency_avg_us * 7 + latency_us) / 8;
+    }
+    portEXIT_CRITICAL(&schedLock);
 }
 
-void delete_timer(){
-    /* Clean up and finish the example */
-    ESP_ERROR_CHECK(esp_timer_stop(periodic_timer));
-    ESP_ERROR_CHECK(esp_timer_delete(periodic_timer));
-    ESP_LOGI(TAG, "Stopped and deleted timer");
+void acquisition_get_stats(acquisition_stats_t *out)
+{
+    portENTER_CRITICAL(&schedLock);
+    *out = stats;
+    out->target_interval_us = target_interval_us;
+    out->latency_us = latency_avg_us;
+    portEXIT_CRITICAL(&schedLock);
 }
 
+// Parse "fps N" or "interval N" (milliseconds) and change the target interval.
+// Return false when the text is not one of them or the value is out of range
+bool acquisition_parse(const char *text)
+{
+    int value;
+    if (sscanf(text, "fps %d", &value) == 1) {
+        if (value < 1 || value > 1000 / MIN_INTERVAL_MS) return false;
+        acquisition_set_interval(1000000ULL / value);
+        return true;
+    }
+    if (sscanf(text, "interval %d", &value) == 1) {
+        if (value < MIN_INTERVAL_MS || value > MAX_INTERVAL_MS) return false;
+        acquisition_set_interval(value * 1000ULL);
+        return true;
+    }
+    return false;
+}
 
+// Append to the buffer, keeping track of the length
+#define METRICS_PRINT(...) \
+    do { \
+        if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); \
+    } while (0)
 
+// The scheduler statistics in the Prometheus text format for /metrics
+size_t acquisition_metrics(char *buf, size_t size)
+{
+    acquisition_stats_t s;
+    acquisition_get_stats(&s);
+    size_t len = 0;
+
+    METRICS_PRINT("# HELP camera_acquisition_fps Triggers per second of the automated shutter over the last report period.\n");
+    METRICS_PRINT("# TYPE camera_acquisition_fps gauge\n");
+    METRICS_PRINT("camera_acquisition_fps %.2f\n", s.fps);
+    METRICS_PRINT("# HELP camera_acquisition_interval_seconds Target interval, and the interval in use when the pipeline is slow.\n");
+    METRICS_PRINT("# TYPE camera_acquisition_interval_seconds gauge\n");
+    METRICS_PRINT("camera_acquisition_interval_seconds{interval=\"target\"} %.6f\n", s.target_interval_us / 1000000.0);
+    METRICS_PRINT("camera_acquisition_interval_seconds{interval=\"effective\"} %.6f\n", s.interval_us / 1000000.0);
+    METRICS_PRINT("# HELP camera_acquisition_jitter_seconds Delay of a trigger after its deadline over the last report period.\n");
+    METRICS_PRINT("# TYPE camera_acquisition_jitter_seconds gauge\n");
+    METRICS_PRINT("camera_acquisition_jitter_seconds{stat=\"avg\"} %.6f\n", s.jitter_avg_us / 1000000.0);
+    METRICS_PRINT("camera_acquisition_jitter_seconds{stat=\"max\"} %.6f\n", s.jitter_max_us / 1000000.0);
+    METRICS_PRINT("# TYPE camera_acquisition_latency_seconds gauge\n");
+    METRICS_PRINT("camera_acquisition_latency_seconds %.6f\n", s.latency_us / 1000000.0);
+    METRICS_PRINT("# TYPE camera_acquisition_triggers_total counter\n");
+    METRICS_PRINT("camera_acquisition_triggers_total %"PRIu32"\n", s.sent);
+    METRICS_PRINT("# HELP camera_acquisition_missed_ticks_total Ticks lost because the pipeline was busy.\n");
+    METRICS_PRINT("# TYPE camera_acquisition_missed_ticks_total counter\n");
+    METRICS_PRINT("camera_acquisition_missed_ticks_total %"PRIu32"\n", s.missed);
+
+    return (len < size) ? len : size - 1;
+}
 
 
 void auto_shutter(void *pvParameter)
 {
 	ESP_LOGI(TAG, "Start CONFIG_SHUTTER_AUTO");
+	CMD_t cmdBuf;
 	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
 	cmdBuf.command = CMD_TAKE;
+	schedulerTask = xTaskGetCurrentTaskHandle();
 
-    setup_timer();
+    const esp_timer_create_args_t deadline_timer_args = {
+            .callback = &deadline_timer_callback,
+            /* name is optional, but may help identify the timer when debugging */
+            .name = "acuisition_timer"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&deadline_timer_args, &deadline_timer));
+
+    // Deadlines are anchor + n * interval, so timer and wakeup delays don't add up
+    uint64_t interval = effective_interval();
+    int64_t anchor = esp_timer_get_time();
+    int64_t n = 0;
+
+    int64_t report_start = anchor;
+    uint32_t report_sent = 0;
+    int64_t jitter_sum = 0;
+    int64_t jitter_max = 0;
 
 	while(1) {
-        print_timer_state();
-		vTaskDelay(10000/portTICK_PERIOD_MS);
+        int64_t deadline = anchor + n * interval;
+        int64_t now = esp_timer_get_time();
+        if (deadline > now) {
+            ESP_ERROR_CHECK(esp_timer_start_once(deadline_timer, deadline - now));
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            now = esp_timer_get_time();
+        }
+
+        // Skip the ticks we slept through
+        int64_t late = now - deadline;
+        if (late >= interval) {
+            int64_t skipped = late / interval;
+            n += skipped;
+            late -= skipped * interval;
+            portENTER_CRITICAL(&schedLock);
+            stats.missed += skipped;
+            portEXIT_CRITICAL(&schedLock);
+        }
+
+        // Don't wait for the shutter loop, a busy pipeline counts as a missed tick
+        if (xQueueSend(xQueueCmd, &cmdBuf, 0) != pdPASS) {
+            ESP_LOGW(TAG, "pipeline busy, tick missed");
+            portENTER_CRITICAL(&schedLock);
+            stats.missed++;
+            portEXIT_CRITICAL(&schedLock);
+        } else {
+            report_sent++;
+            jitter_sum += late;
+            if (late > jitter_max) jitter_max = late;
+        }
+        n++;
+
+        // Follow changes of the target and of the measured latency
+        uint64_t next_interval = effective_interval();
+        if (next_interval != interval) {
+            ESP_LOGI(TAG, "interval %"PRIu64" -> %"PRIu64" us", interval, next_interval);
+            anchor = anchor + n * interval;
+            n = 0;
+            interval = next_interval;
+        }
+
+        if (now - report_start >= REPORT_INTERVAL_US) {
+            portENTER_CRITICAL(&schedLock);
+            stats.interval_us = interval;
+            stats.fps = report_sent * 1000000.0f / (now - report_start);
+            stats.jitter_avg_us = report_sent ? jitter_sum / report_sent : 0;
+            stats.jitter_max_us = jitter_max;
+            stats.sent += report_sent;
+            portEXIT_CRITICAL(&schedLock);
+            ESP_LOGI(TAG, "fps=%.2f interval=%"PRIu64" us jitter avg=%"PRId64" max=%"PRId64" us missed=%"PRIu32" latency=%"PRId64" us",
+                stats.fps, interval, stats.jitter_avg_us, stats.jitter_max_us, stats.missed, latency_avg_us);
+            report_start = now;
+            report_sent = 0;
+            jitter_sum = 0;
+            jitter_max = 0;
+        }
 	}
 
-    delete_timer();
+    ESP_ERROR_CHECK(esp_timer_delete(deadline_timer));
 	/* Never reach */
 	vTaskDelete( NULL );
 }
 #endif
-
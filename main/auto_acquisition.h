@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Statistics of the automated shutter
+typedef struct {
+    float fps;              // Achieved frame rate over the last report period
+    uint64_t target_interval_us;    // Interval asked for with acquisition_set_interval()
+    uint64_t interval_us;   // Interval in use, stretched when the pipeline is slow
+    int64_t jitter_avg_us;  // Average delay of a trigger after its deadline
+    int64_t jitter_max_us;  // Largest delay of a trigger after its deadline
+    int64_t latency_us;     // Moving average of capture+upload latency
+    uint32_t sent;          // Triggers sent to the shutter loop
+    uint32_t missed;        // Ticks lost because the pipeline was busy
+} acquisition_stats_t;
+
+// Function prototypes
+void acquisition_set_interval(uint64_t interval_us);
+void acquisition_report_latency(int64_t latency_us);
+void acquisition_get_stats(acquisition_stats_t *stats);
+bool acquisition_parse(const char *text);
+size_t acquisition_metrics(char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
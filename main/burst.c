@@ -0,0 +1,108 @@
+/*
+   Burst commands for the shutters.
+
+   A shutter sends CMD_TAKE for one picture, or CMD_BURST with the number
+   of pictures, the interval between them, and optionally the JPEG quality
+   and frame size to use for the burst.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_camera.h"
+
+#include "burst.h"
+#include "frame_broker.h"
+
+static const char *TAG = "BURST";
+
+// Fill in a command, clamping the parameters to what the camera accepts
+void burst_set(CMD_t *cmd, int count, int interval, int quality, int framesize)
+{
+	if (count < 1) count = 1;
+	if (count > BURST_MAX_FRAMES) count = BURST_MAX_FRAMES;
+	if (interval < 0) interval = 0;
+	if (interval > BURST_MAX_INTERVAL_MS) interval = BURST_MAX_INTERVAL_MS;
+	if (quality > 63) quality = 63;
+	if (quality < 0) quality = -1;
+	if (framesize < 0 || framesize >= FRAMESIZE_INVALID) framesize = -1;
+
+	cmd->burst.count = count;
+	cmd->burst.interval = interval;
+	cmd->burst.quality = quality;
+	cmd->burst.framesize = framesize;
+	// A single picture with the current settings is a plain shutter
+	cmd->command = (count == 1 && quality < 0 && framesize < 0) ? CMD_TAKE : CMD_BURST;
+}
+
+// The shutter press configured in menuconfig
+void burst_default(CMD_t *cmd)
+{
+	burst_set(cmd, CONFIG_BURST_COUNT, CONFIG_BURST_INTERVAL_MS, -1, -1);
+}
+
+// Parse "burst [count] [interval] [quality] [framesize]".
+// Return false when the text is not a burst request
+bool burst_parse(const char *text, CMD_t *cmd)
+{
+	if (strncmp(text, "burst", 5) != 0) return false;
+	int count = CONFIG_BURST_COUNT;
+	int interval = CONFIG_BURST_INTERVAL_MS;
+	int quality = -1;
+	int framesize = -1;
+	sscanf(text + 5, "%d %d %d %d", &count, &interval, &quality, &framesize);
+	burst_set(cmd, count, interval, quality, framesize);
+	ESP_LOGI(TAG, "count=%d interval=%d quality=%d framesize=%d",
+		cmd->burst.count, cmd->burst.interval, cmd->burst.quality, cmd->burst.framesize);
+	return true;
+}
+
+// Switch the sensor to the settings of the burst and keep the ones to go back to
+void burst_begin(const BURST_t *burst, BURST_t *saved)
+{
+	saved->quality = -1;
+	saved->framesize = -1;
+	sensor_t *sensor = esp_camera_sensor_get();
+	if (sensor == NULL) return;
+	if (burst->quality >= 0 && burst->quality != sensor->status.quality) {
+		saved->quality = sensor->status.quality;
+		sensor->set_quality(sensor, burst->quality);
+	}
+	if (burst->framesize >= 0 && burst->framesize != sensor->status.framesize) {
+		saved->framesize = sensor->status.framesize;
+		sensor->set_framesize(sensor, burst->framesize);
+	}
+	if (saved->quality >= 0 || saved->framesize >= 0) {
+		// The frame waiting in the driver was taken with the old settings
+		frame_handle_t *frame = frame_broker_get(0);
+		if (frame != NULL) frame_broker_release(frame);
+	}
+}
+
+void burst_end(const BURST_t *saved)
+{
+	sensor_t *sensor = esp_camera_sensor_get();
+	if (sensor == NULL) return;
+	if (saved->quality >= 0) sensor->set_quality(sensor, saved->quality);
+	if (saved->framesize >= 0) sensor->set_framesize(sensor, saved->framesize);
+}
+
+// Number the pictures of a burst: picture.jpg -> picture_2.jpg
+void burst_file_name(char *fileName, int index)
+{
+	char extension[16] = "";
+	char *dot = strrchr(fileName, '.');
+	if (dot != NULL && strlen(dot) < sizeof(extension)) {
+		strcpy(extension, dot);
+		*dot = 0;
+	}
+	char number[8];
+	snprintf(number, sizeof(number), "_%d", index);
+	// Remote file names are 64 bytes
+	size_t room = 64 - 1 - strlen(number) - strlen(extension);
+	if (strlen(fileName) > room) fileName[room] = 0;
+	strcat(fileName, number);
+	strcat(fileName, extension);
+}
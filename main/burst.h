@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include "cmd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BURST_MAX_FRAMES 10
+#define BURST_MAX_INTERVAL_MS 10000
+
+// Function prototypes
+void burst_default(CMD_t *cmd);
+bool burst_parse(const char *text, CMD_t *cmd);
+void burst_set(CMD_t *cmd, int count, int interval, int quality, int framesize);
+void burst_begin(const BURST_t *burst, BURST_t *saved);
+void burst_end(const BURST_t *saved);
+void burst_file_name(char *fileName, int index);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,9 +1,8 @@
 #include "camera_helpers.h"
+#include "frame_broker.h"
 
 static const char* TAG_CAMERA = "camera_helpers";
 
-camera_fb_t* fb;
-
 // Define camera configuration structure
 camera_config_t camera_config = {
     .pin_pwdn = CAM_PIN_PWDN,
@@ -28,13 +27,30 @@ camera_config_t camera_config = {
     .pixel_format = PIXFORMAT_JPEG,
     .frame_size = FRAMESIZE_VGA,
     .jpeg_quality = 12,
-    .fb_count = 1
+    .fb_count = CONFIG_CAMERA_FB_COUNT,
+    .fb_location = CAMERA_FB_IN_PSRAM,
+    .grab_mode = CAMERA_GRAB_LATEST
 };
 
 // Function to initialize the camera
 esp_err_t init_camera(int framesize) {
     // Set frame size
     camera_config.frame_size = framesize;
+#if CONFIG_PIPELINE_UPLOAD
+    // Frames waiting in the ring + the ones being uploaded, on top of the shared buffers
+#if CONFIG_BATCH_UPLOAD
+    camera_config.fb_count = CONFIG_CAMERA_FB_COUNT + CONFIG_PIPELINE_DEPTH + CONFIG_BATCH_MAX_FRAMES;
+#else
+    camera_config.fb_count = CONFIG_CAMERA_FB_COUNT + CONFIG_PIPELINE_DEPTH + 1;
+#endif
+#elif CONFIG_UPLOAD_FROM_RAM
+    // Pictures of a burst wait in the frame buffers until they are uploaded
+    camera_config.fb_count = CONFIG_CAMERA_FB_COUNT + CONFIG_BURST_COUNT - 1;
+#endif
+#if CONFIG_WS_STREAM
+    // Every WebSocket viewer holds one frame, waiting or being sent
+    camera_config.fb_count += CONFIG_WS_MAX_CLIENTS;
+#endif
 
     // Initialize the camera
     esp_err_t err = esp_camera_init(&camera_config);
@@ -47,49 +63,47 @@ esp_err_t init_camera(int framesize) {
     return ESP_OK;
 }
 
-// Function to capture an image to RAM
-esp_err_t camera_capture_RAM() {
-    // Acquire a frame
-    fb = esp_camera_fb_get();
-    if (!fb) {
-        ESP_LOGE(TAG_CAMERA, "Camera Capture Failed");
-        return ESP_FAIL;
-    }
-
-    // Return the frame buffer back to the driver for reuse
-    esp_camera_fb_return(fb);
-    return ESP_OK;
+// Quality for fmt2jpg (1-100, higher is better) from the sensor quality (0-63, lower is better),
+// so converted frames follow the rate control and the quality of a burst
+int camera_jpeg_quality(void) {
+    sensor_t* sensor = esp_camera_sensor_get();
+    int quality = (sensor != NULL) ? sensor->status.quality : camera_config.jpeg_quality;
+    quality = 100 - quality * 100 / 63;
+    return (quality < 1) ? 1 : quality;
 }
 
 // Function to capture an image to a file
 esp_err_t camera_capture(char* FileName, size_t* pictureSize) {
     // Clear internal queue
     for (int i = 0; i < 1; i++) {
-        camera_fb_t* fb = esp_camera_fb_get();
-        ESP_LOGI(TAG_CAMERA, "fb->len=%d", fb->len);
-        esp_camera_fb_return(fb);
+        frame_handle_t* frame = frame_broker_get(0);
+        if (frame) {
+            ESP_LOGI(TAG_CAMERA, "frame->len=%zu", frame->len);
+            frame_broker_release(frame);
+        }
     }
 
     // Acquire a frame
-    camera_fb_t* fb = esp_camera_fb_get();
-    if (!fb) {
+    frame_handle_t* frame = frame_broker_get(0);
+    if (!frame) {
         ESP_LOGE(TAG_CAMERA, "Camera Capture Failed");
         return ESP_FAIL;
     }
 
     // Replace this with your own function
-    // Process_image(fb->width, fb->height, fb->format, fb->buf, fb->len);
+    // Process_image(frame->width, frame->height, frame->format, frame->buf, frame->len);
     FILE* f = fopen(FileName, "wb");
     if (f == NULL) {
         ESP_LOGE(TAG_CAMERA, "Failed to open file for writing");
+        frame_broker_release(frame);
         return ESP_FAIL;
     }
-    fwrite(fb->buf, fb->len, 1, f);
-    ESP_LOGI(TAG_CAMERA, "fb->len=%d", fb->len);
-    *pictureSize = (size_t)fb->len;
+    fwrite(frame->buf, frame->len, 1, f);
+    ESP_LOGI(TAG_CAMERA, "frame->len=%zu", frame->len);
+    *pictureSize = (size_t)frame->len;
     fclose(f);
 
-    // Return the frame buffer back to the driver for reuse
-    esp_camera_fb_return(fb);
+    // Give the frame back to the broker
+    frame_broker_release(frame);
     return ESP_OK;
 }
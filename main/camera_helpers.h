@@ -21,12 +21,9 @@ typedef struct {
 resolution_t get_resolution(int framesize);
 int get_bytes_per_pixel(pixformat_t pixel_format);
 esp_err_t init_camera(int framesize);
-esp_err_t camera_capture_RAM();
+int camera_jpeg_quality(void);
 esp_err_t camera_capture(char* FileName, size_t* pictureSize);
 
-// Global variables
-extern camera_fb_t* fb;
-
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,124 @@
+/*
+   Change detection for static scenes.
+
+   Every JPEG frame is decoded at 1/8 scale, which only needs the DC
+   coefficient of each block, and the luma of the thumbnail is averaged
+   over a grid of cells. The grid is compared with a background that
+   slowly follows every frame. A frame is uploaded when enough cells
+   differ from the background, or when nothing was uploaded for the
+   heartbeat period.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_jpg_decode.h"
+
+#include "change_detect.h"
+
+#if CONFIG_CHANGE_DETECT
+static const char *TAG = "CHANGE";
+
+#define GRID_WIDTH 32
+#define GRID_HEIGHT 24
+#define GRID_CELLS (GRID_WIDTH * GRID_HEIGHT)
+#define BACKGROUND_SHIFT 4  // The background moves 1/16 of the way to every frame
+#define BACKGROUND_SCALE 16 // Fixed point of the background
+
+typedef struct {
+	const frame_handle_t *frame;
+	uint16_t width;         // Size of the thumbnail
+	uint16_t height;
+	uint32_t sum[GRID_CELLS];
+	uint16_t count[GRID_CELLS];
+} thumbnail_t;
+
+// Only used by the capturing task. esp_jpg_decode is not reentrant either.
+static thumbnail_t thumbnail;
+static int16_t background[GRID_CELLS];
+static size_t backgroundWidth;
+static size_t backgroundHeight;
+static int64_t lastUpload;
+
+static size_t thumbnail_read(void *arg, size_t index, uint8_t *buf, size_t len)
+{
+	thumbnail_t *thumb = (thumbnail_t *)arg;
+	if (index + len > thumb->frame->len) len = thumb->frame->len - index;
+	if (buf) memcpy(buf, thumb->frame->buf + index, len);
+	return len;
+}
+
+// Called with the RGB888 pixels of every block
+static bool thumbnail_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+	thumbnail_t *thumb = (thumbnail_t *)arg;
+	if (data == NULL) {
+		if (x == 0 && y == 0) {
+			// Start of the picture
+			thumb->width = w;
+			thumb->height = h;
+		}
+		return (thumb->width > 0 && thumb->height > 0);
+	}
+	for (int iy = 0; iy < h; iy++) {
+		int row = ((y + iy) * GRID_HEIGHT / thumb->height) * GRID_WIDTH;
+		for (int ix = 0; ix < w; ix++) {
+			if (x + ix >= thumb->width || y + iy >= thumb->height) {
+				data += 3;
+				continue;
+			}
+			int cell = row + (x + ix) * GRID_WIDTH / thumb->width;
+			thumb->sum[cell] += (77 * data[0] + 150 * data[1] + 29 * data[2]) >> 8;
+			thumb->count[cell]++;
+			data += 3;
+		}
+	}
+	return true;
+}
+
+// Return true when the frame must be uploaded
+bool change_detect_check(const frame_handle_t *frame)
+{
+	int64_t now = esp_timer_get_time();
+	if (frame->format != PIXFORMAT_JPEG) return true;
+
+	memset(&thumbnail, 0, sizeof(thumbnail));
+	thumbnail.frame = frame;
+	if (esp_jpg_decode(frame->len, JPG_SCALE_8X, thumbnail_read, thumbnail_write, &thumbnail) != ESP_OK) {
+		// Can't tell, let the server have it
+		ESP_LOGW(TAG, "Failed to decode the thumbnail");
+		return true;
+	}
+
+	bool reset = (frame->width != backgroundWidth || frame->height != backgroundHeight);
+	int cells = 0;
+	int changed = 0;
+	for (int cell = 0; cell < GRID_CELLS; cell++) {
+		// Small frames don't cover every cell
+		if (thumbnail.count[cell] == 0) continue;
+		cells++;
+		int luma = thumbnail.sum[cell] * BACKGROUND_SCALE / thumbnail.count[cell];
+		if (reset) {
+			background[cell] = luma;
+			continue;
+		}
+		if (abs(luma - background[cell]) > CONFIG_CHANGE_THRESHOLD * BACKGROUND_SCALE) changed++;
+		background[cell] = background[cell] + ((luma - background[cell]) >> BACKGROUND_SHIFT);
+	}
+	backgroundWidth = frame->width;
+	backgroundHeight = frame->height;
+
+	bool upload = reset || (changed * 100 >= CONFIG_CHANGE_AREA * cells);
+#if CONFIG_CHANGE_HEARTBEAT
+	if (now - lastUpload >= CONFIG_CHANGE_HEARTBEAT * 1000000LL) upload = true;
+#endif
+	ESP_LOGI(TAG, "changed=%d/%d upload=%d decode=%"PRId64"us", changed, cells, upload, esp_timer_get_time() - now);
+	if (upload) lastUpload = now;
+	return upload;
+}
+#endif
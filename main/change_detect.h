@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+#include "frame_broker.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Function prototypes
+bool change_detect_check(const frame_handle_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,10 +1,25 @@
+#pragma once
+
+#include "frame_broker.h"
+#include "frame_trace.h"
+
 #define CMD_TAKE	100
+#define CMD_BURST	110
 #define CMD_SEND	200
 #define CMD_HALT	900
 
+// Parameters of CMD_BURST
+typedef struct {
+    uint8_t count;          // Pictures to take
+    uint16_t interval;      // Milliseconds between pictures. 0 takes them back to back
+    int8_t quality;         // JPEG quality 0-63. -1 keeps the current one
+    int8_t framesize;       // framesize_t. -1 keeps the current one
+} BURST_t;
+
 typedef struct {
     uint16_t command;
     TaskHandle_t taskHandle;
+    BURST_t burst;          // CMD_BURST only
 } CMD_t;
 
 // Message to HTTP Client
@@ -12,6 +27,9 @@ typedef struct {
     uint16_t command;
     char localFileName[64];
     char remoteFileName[64];
+    frame_handle_t *frame;  // Frame to send from RAM. NULL means send localFileName
+    uint32_t storeSeq;      // Record of the frame store being drained. 0 for a new frame
+    frame_trace_t trace;    // Time the frame reached each stage
     TaskHandle_t taskHandle;
 } REQUEST_t;
 
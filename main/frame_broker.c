@@ -0,0 +1,175 @@
+/*
+   Frame broker on top of esp_camera_fb_get.
+
+   The stream, the uploader and the storage paths get frames from here
+   instead of from the driver. Each frame is handed out as a ref-counted
+   handle, and the frame buffer goes back to the driver only when the last
+   consumer releases it. Consumers asking for a frame at the same time
+   share one capture.
+*/
+
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "frame_broker.h"
+
+#define MAX_SUBSCRIBERS 4
+
+static const char *TAG = "BROKER";
+
+typedef struct {
+	frame_broker_cb_t cb;
+	void *ctx;
+} subscriber_t;
+
+static SemaphoreHandle_t captureMutex;
+static portMUX_TYPE refLock = portMUX_INITIALIZER_UNLOCKED;
+static frame_handle_t *latest = NULL;
+static uint32_t sequence = 0;
+static subscriber_t subscribers[MAX_SUBSCRIBERS];
+static int subscriberCount = 0;
+
+esp_err_t frame_broker_init(void)
+{
+	captureMutex = xSemaphoreCreateMutex();
+	if (captureMutex == NULL) return ESP_ERR_NO_MEM;
+	return ESP_OK;
+}
+
+// Get a frame.
+// When a frame taken within max_age_us is still held by another consumer it is shared,
+// otherwise a new frame is taken. Pass 0 to always take a new frame.
+// Return NULL when the capture failed.
+frame_handle_t *frame_broker_get(int64_t max_age_us)
+{
+	frame_handle_t *frame = NULL;
+	xSemaphoreTake(captureMutex, portMAX_DELAY);
+
+	portENTER_CRITICAL(&refLock);
+	if (latest != NULL && max_age_us > 0 && esp_timer_get_time() - latest->timestamp <= max_age_us) {
+		frame = latest;
+		frame->refs++;
+	}
+	portEXIT_CRITICAL(&refLock);
+	if (frame != NULL) {
+		xSemaphoreGive(captureMutex);
+		return frame;
+	}
+
+	frame = malloc(sizeof(frame_handle_t));
+	if (frame == NULL) {
+		ESP_LOGE(TAG, "malloc fail. frame_handle_t");
+		xSemaphoreGive(captureMutex);
+		return NULL;
+	}
+	camera_fb_t *fb = esp_camera_fb_get();
+	if (fb == NULL) {
+		ESP_LOGE(TAG, "Camera Capture Failed");
+		free(frame);
+		xSemaphoreGive(captureMutex);
+		return NULL;
+	}
+	frame->fb = fb;
+	frame->buf = fb->buf;
+	frame->len = fb->len;
+	frame->width = fb->width;
+	frame->height = fb->height;
+	frame->format = fb->format;
+	frame->timestamp = esp_timer_get_time();
+	frame->refs = 1;
+	frame->seq = ++sequence;
+	ESP_LOGD(TAG, "seq=%"PRIu32" len=%zu", frame->seq, frame->len);
+
+	portENTER_CRITICAL(&refLock);
+	latest = frame;
+	portEXIT_CRITICAL(&refLock);
+
+	for (int i = 0; i < subscriberCount; i++) {
+		subscribers[i].cb(frame, subscribers[i].ctx);
+	}
+	xSemaphoreGive(captureMutex);
+	return frame;
+}
+
+// Hand out a frame that isn't from the driver, like one read back from flash.
+// buf must come from heap_caps_malloc, it is freed with the last reference
+frame_handle_t *frame_broker_wrap(uint8_t *buf, size_t len, size_t width, size_t height, pixformat_t format, int64_t timestamp)
+{
+	frame_handle_t *frame = malloc(sizeof(frame_handle_t));
+	if (frame == NULL) {
+		ESP_LOGE(TAG, "malloc fail. frame_handle_t");
+		return NULL;
+	}
+	frame->fb = NULL;
+	frame->buf = buf;
+	frame->len = len;
+	frame->width = width;
+	frame->height = height;
+	frame->format = format;
+	frame->timestamp = timestamp;
+	frame->refs = 1;
+	frame->seq = 0;
+	return frame;
+}
+
+// Take one more reference to a frame
+frame_handle_t *frame_broker_retain(frame_handle_t *frame)
+{
+	portENTER_CRITICAL(&refLock);
+	frame->refs++;
+	portEXIT_CRITICAL(&refLock);
+	return frame;
+}
+
+// Drop a reference, the frame buffer goes back to the driver with the last one
+void frame_broker_release(frame_handle_t *frame)
+{
+	bool last = false;
+	portENTER_CRITICAL(&refLock);
+	frame->refs--;
+	if (frame->refs == 0) {
+		last = true;
+		if (latest == frame) latest = NULL;
+	}
+	portEXIT_CRITICAL(&refLock);
+	if (last == false) return;
+
+	ESP_LOGD(TAG, "return seq=%"PRIu32, frame->seq);
+	if (frame->fb != NULL) {
+		esp_camera_fb_return(frame->fb);
+	} else {
+		heap_caps_free(frame->buf);
+	}
+	free(frame);
+}
+
+// Check the JPEG markers of a frame. Other formats have none to check.
+esp_err_t frame_broker_check(const frame_handle_t *frame)
+{
+	if (frame->format != PIXFORMAT_JPEG) return ESP_OK;
+	if (frame->len < 4) return ESP_ERR_INVALID_SIZE;
+	if (frame->buf[0] != 0xFF || frame->buf[1] != 0xD8) return ESP_ERR_INVALID_STATE;
+	if (frame->buf[frame->len-2] != 0xFF || frame->buf[frame->len-1] != 0xD9) return ESP_ERR_INVALID_STATE;
+	return ESP_OK;
+}
+
+// Register a callback for every new frame.
+// Callbacks run in the capturing task and must be short.
+esp_err_t frame_broker_subscribe(frame_broker_cb_t cb, void *ctx)
+{
+	xSemaphoreTake(captureMutex, portMAX_DELAY);
+	if (subscriberCount == MAX_SUBSCRIBERS) {
+		xSemaphoreGive(captureMutex);
+		ESP_LOGE(TAG, "too many subscribers");
+		return ESP_ERR_NO_MEM;
+	}
+	subscribers[subscriberCount].cb = cb;
+	subscribers[subscriberCount].ctx = ctx;
+	subscriberCount++;
+	xSemaphoreGive(captureMutex);
+	return ESP_OK;
+}
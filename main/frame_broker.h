@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reference-counted frame shared by all consumers
+typedef struct {
+    camera_fb_t *fb;        // Frame buffer owned by the camera driver. NULL when buf is from the heap
+    uint8_t *buf;           // Pixel data
+    size_t len;             // Length of the pixel data
+    size_t width;
+    size_t height;
+    pixformat_t format;
+    uint32_t seq;           // Frame sequence number
+    int64_t timestamp;      // esp_timer_get_time() when the frame was taken
+    int refs;               // Consumers holding the frame
+} frame_handle_t;
+
+// Called from the capturing task for every new frame.
+// Call frame_broker_retain to keep the frame after returning.
+typedef void (*frame_broker_cb_t)(frame_handle_t *frame, void *ctx);
+
+// Function prototypes
+esp_err_t frame_broker_init(void);
+frame_handle_t *frame_broker_get(int64_t max_age_us);
+frame_handle_t *frame_broker_wrap(uint8_t *buf, size_t len, size_t width, size_t height, pixformat_t format, int64_t timestamp);
+frame_handle_t *frame_broker_retain(frame_handle_t *frame);
+void frame_broker_release(frame_handle_t *frame);
+esp_err_t frame_broker_check(const frame_handle_t *frame);
+esp_err_t frame_broker_subscribe(frame_broker_cb_t cb, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
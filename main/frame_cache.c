@@ -0,0 +1,87 @@
+/*
+   Copy of the most recent frame.
+
+   Frames are only copied when a reader asks for one and the cached copy is
+   too old, so nothing is copied while nobody polls.
+   Readers get a reference to the cached frame and may send it for as long
+   as they like. A new frame replaces the cached one without waiting for
+   the readers, the old copy is freed when the last reader releases it.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "frame_cache.h"
+
+static const char *TAG = "CACHE";
+
+static SemaphoreHandle_t cacheMutex;
+static cached_frame_t *latest = NULL;
+static uint32_t sequence = 0;
+
+void frame_cache_init(void)
+{
+	cacheMutex = xSemaphoreCreateMutex();
+	configASSERT( cacheMutex );
+}
+
+// Drop one reference, the caller holds cacheMutex
+static void frame_cache_unref(cached_frame_t *frame)
+{
+	frame->refs--;
+	if (frame->refs == 0) {
+		heap_caps_free(frame->buf);
+		free(frame);
+	}
+}
+
+// Store a copy of a JPEG frame as the most recent one.
+// timestamp is when the frame was taken, so the age of the copy is the age of the frame.
+esp_err_t frame_cache_put(const uint8_t *buf, size_t len, int64_t timestamp)
+{
+	cached_frame_t *frame = malloc(sizeof(cached_frame_t));
+	if (frame == NULL) {
+		ESP_LOGE(TAG, "malloc fail. cached_frame_t");
+		return ESP_ERR_NO_MEM;
+	}
+	frame->buf = heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	if (frame->buf == NULL) {
+		ESP_LOGE(TAG, "heap_caps_malloc fail. len=%zu", len);
+		free(frame);
+		return ESP_ERR_NO_MEM;
+	}
+	memcpy(frame->buf, buf, len);
+	frame->len = len;
+	frame->timestamp = timestamp;
+	frame->refs = 1;
+
+	xSemaphoreTake(cacheMutex, portMAX_DELAY);
+	frame->seq = ++sequence;
+	if (latest != NULL) frame_cache_unref(latest);
+	latest = frame;
+	xSemaphoreGive(cacheMutex);
+	ESP_LOGD(TAG, "seq=%"PRIu32" len=%zu", frame->seq, len);
+	return ESP_OK;
+}
+
+// Get the most recent frame, or NULL when no frame has been stored yet.
+// The frame must be given back with frame_cache_release.
+cached_frame_t *frame_cache_get(void)
+{
+	xSemaphoreTake(cacheMutex, portMAX_DELAY);
+	cached_frame_t *frame = latest;
+	if (frame != NULL) frame->refs++;
+	xSemaphoreGive(cacheMutex);
+	return frame;
+}
+
+void frame_cache_release(cached_frame_t *frame)
+{
+	xSemaphoreTake(cacheMutex, portMAX_DELAY);
+	frame_cache_unref(frame);
+	xSemaphoreGive(cacheMutex);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "frame_broker.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Copy of a captured JPEG frame
+typedef struct {
+    uint8_t *buf;       // JPEG data in PSRAM
+    size_t len;         // Length of the JPEG data
+    uint32_t seq;       // Sequence number, counts up with each new frame
+    int64_t timestamp;  // esp_timer_get_time() when the frame was taken
+    int refs;           // Readers holding the frame
+} cached_frame_t;
+
+// Function prototypes
+void frame_cache_init(void);
+esp_err_t frame_cache_put(const uint8_t *buf, size_t len, int64_t timestamp);
+cached_frame_t *frame_cache_get(void);
+void frame_cache_release(cached_frame_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,446 @@
+/*
+   Log-structured ring of frames on a raw flash partition.
+
+   Frames that could not be uploaded are appended here and a drain task
+   uploads them in order once the server answers again. It queues up to
+   CONFIG_FRAME_STORE_DRAIN_BATCH records at a time, so a batch upload can
+   send them in one request, and marks them uploaded in order as the
+   results come back.
+
+   Every record starts on a sector boundary with a header followed by the
+   JPEG data, and the ring wraps to the start of the partition when the
+   next record doesn't fit. Appends only erase the sectors they are about
+   to write, so the oldest records are overwritten when the ring is full.
+
+   The state word of a header is programmed from 1 to 0 only, in place:
+   first when the record is complete, then when it has been uploaded.
+   A record whose commit bit is still set was interrupted and is ignored
+   at boot, so a reset in the middle of an append loses only that frame.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+
+#include "cmd.h"
+#include "frame_store.h"
+
+#define RECORD_MAGIC		0x474F4C46	// "FLOG"
+#define SECTOR_SIZE			0x1000
+
+// State bits, cleared in this order
+#define STATE_COMMITTED		0x00000001
+#define STATE_UPLOADED		0x00000002
+
+// Wait this long for http_post_task before giving a record up as failed
+#define DRAIN_TIMEOUT_MS	60000
+#define DRAIN_BACKOFF_MIN_MS	1000
+#define DRAIN_BACKOFF_MAX_MS	60000
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+	int64_t timestamp;
+	uint32_t size;
+	uint16_t width;
+	uint16_t height;
+	uint32_t format;
+	uint32_t crc;				// CRC of the data
+	char remoteFileName[64];
+	uint32_t headerCrc;			// CRC of the fields above
+	uint32_t state;
+} record_header_t;
+
+// Result of the upload of a record, from http_post_task to the drain task
+typedef struct {
+	uint32_t seq;
+	uint32_t result;
+} drain_result_t;
+
+static const char *TAG = "STORE";
+
+extern QueueHandle_t xQueueRequest;
+
+static const esp_partition_t *partition = NULL;
+static SemaphoreHandle_t storeMutex;
+static QueueHandle_t drainResults;
+
+static uint32_t head = 0;			// Offset of the next record
+static uint32_t nextSeq = 1;
+static uint32_t tail = 0;			// Offset of the oldest pending record
+static uint32_t tailSeq = 0;
+static frame_store_stats_t stats;
+
+static uint32_t record_span(uint32_t size)
+{
+	uint32_t len = sizeof(record_header_t) + size;
+	return (len + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+}
+
+static uint32_t header_crc(const record_header_t *header)
+{
+	return esp_rom_crc32_le(0, (const uint8_t *)header, offsetof(record_header_t, headerCrc));
+}
+
+// Read the header at offset. Return false unless it is a complete record
+static bool read_header(uint32_t offset, record_header_t *header)
+{
+	if (offset + sizeof(record_header_t) > partition->size) return false;
+	if (esp_partition_read(partition, offset, header, sizeof(record_header_t)) != ESP_OK) return false;
+	if (header->magic != RECORD_MAGIC) return false;
+	if (header->headerCrc != header_crc(header)) return false;
+	if (offset + record_span(header->size) > partition->size) return false;
+	if (header->state & STATE_COMMITTED) return false;
+	return true;
+}
+
+// Find the pending record with the lowest sequence number >= seq.
+// The caller holds storeMutex
+static bool find_pending(uint32_t seq, uint32_t *offset, uint32_t *foundSeq)
+{
+	bool found = false;
+	record_header_t header;
+	for (uint32_t off = 0; off < partition->size; off += SECTOR_SIZE) {
+		if (read_header(off, &header) == false) continue;
+		if ((header.state & STATE_UPLOADED) == 0) continue;
+		if (header.seq < seq) continue;
+		if (found && header.seq >= *foundSeq) continue;
+		found = true;
+		*offset = off;
+		*foundSeq = header.seq;
+	}
+	return found;
+}
+
+// Find the pending record following the one with sequence number seq at offset.
+// The caller holds storeMutex
+static bool next_pending(uint32_t offset, uint32_t seq, uint32_t *foundOffset, uint32_t *foundSeq)
+{
+	if (seq + 1 >= nextSeq) return false;
+
+	// Records follow each other, or the next one is at the start of the partition
+	record_header_t header;
+	uint32_t next = offset;
+	if (read_header(offset, &header)) next = offset + record_span(header.size);
+	uint32_t candidates[2] = { next, 0 };
+	for (int i = 0; i < 2; i++) {
+		if (read_header(candidates[i], &header) && header.seq == seq + 1 && (header.state & STATE_UPLOADED)) {
+			*foundOffset = candidates[i];
+			*foundSeq = header.seq;
+			return true;
+		}
+	}
+
+	// A record is missing, look for the next one anywhere
+	return find_pending(seq + 1, foundOffset, foundSeq);
+}
+
+// Move tail to the record following it.
+// The caller holds storeMutex
+static void advance_tail(void)
+{
+	stats.pending--;
+	if (stats.pending == 0) {
+		tail = head;
+		tailSeq = nextSeq;
+		return;
+	}
+
+	if (next_pending(tail, tailSeq, &tail, &tailSeq) == false) {
+		ESP_LOGW(TAG, "lost track of %"PRIu32" pending records", stats.pending);
+		stats.pending = 0;
+		tail = head;
+		tailSeq = nextSeq;
+	}
+}
+
+// Rebuild the ring state from the headers on flash
+static void recover(void)
+{
+	record_header_t header;
+	uint32_t lastSeq = 0;
+	uint32_t uploadedSeq = 0;
+	head = 0;
+	for (uint32_t off = 0; off < partition->size; off += SECTOR_SIZE) {
+		if (read_header(off, &header) == false) continue;
+		if (header.seq > lastSeq) {
+			lastSeq = header.seq;
+			head = off + record_span(header.size);
+		}
+		if ((header.state & STATE_UPLOADED) == 0 && header.seq > uploadedSeq) uploadedSeq = header.seq;
+	}
+	if (head >= partition->size) head = 0;
+	nextSeq = lastSeq + 1;
+
+	// Records are drained in order, so everything after the last uploaded one is pending
+	stats.pending = 0;
+	for (uint32_t off = 0; off < partition->size; off += SECTOR_SIZE) {
+		if (read_header(off, &header) == false) continue;
+		if ((header.state & STATE_UPLOADED) && header.seq > uploadedSeq) stats.pending++;
+	}
+	if (stats.pending == 0 || find_pending(uploadedSeq + 1, &tail, &tailSeq) == false) {
+		stats.pending = 0;
+		tail = head;
+		tailSeq = nextSeq;
+	}
+	ESP_LOGI(TAG, "recovered next seq=%"PRIu32" head=0x%"PRIx32" pending=%"PRIu32" tail seq=%"PRIu32,
+		nextSeq, head, stats.pending, tailSeq);
+}
+
+esp_err_t frame_store_init(const char *partition_label)
+{
+	partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_label);
+	if (partition == NULL) {
+		ESP_LOGE(TAG, "Failed to find partition [%s]", partition_label);
+		return ESP_ERR_NOT_FOUND;
+	}
+	ESP_LOGI(TAG, "partition [%s] offset=0x%"PRIx32" size=0x%"PRIx32, partition_label, partition->address, partition->size);
+	storeMutex = xSemaphoreCreateMutex();
+	if (storeMutex == NULL) return ESP_ERR_NO_MEM;
+	// Room for the late results of a batch the drain task gave up on, next to the current one
+	drainResults = xQueueCreate(CONFIG_FRAME_STORE_DRAIN_BATCH * 2, sizeof(drain_result_t));
+	if (drainResults == NULL) return ESP_ERR_NO_MEM;
+	recover();
+	return ESP_OK;
+}
+
+// Append a frame to the log, overwriting the oldest records when the ring is full
+esp_err_t frame_store_append(frame_handle_t *frame, const char *remoteFileName)
+{
+	uint32_t span = record_span(frame->len);
+	if (span > partition->size) {
+		ESP_LOGE(TAG, "frame too large. len=%zu", frame->len);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	xSemaphoreTake(storeMutex, portMAX_DELAY);
+	if (head + span > partition->size) head = 0;
+
+	// Give up the pending records in the sectors we are about to erase
+	record_header_t header;
+	while (stats.pending > 0 && read_header(tail, &header) &&
+		tail < head + span && head < tail + record_span(header.size)) {
+		ESP_LOGW(TAG, "ring full, overwrite seq=%"PRIu32, tailSeq);
+		stats.overwritten++;
+		advance_tail();
+	}
+
+	esp_err_t ret = esp_partition_erase_range(partition, head, span);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "esp_partition_erase_range fail. offset=0x%"PRIx32" %s", head, esp_err_to_name(ret));
+		xSemaphoreGive(storeMutex);
+		return ret;
+	}
+
+	memset(&header, 0xff, sizeof(header));
+	header.magic = RECORD_MAGIC;
+	header.seq = nextSeq;
+	header.timestamp = frame->timestamp;
+	header.size = frame->len;
+	header.width = frame->width;
+	header.height = frame->height;
+	header.format = frame->format;
+	header.crc = esp_rom_crc32_le(0, frame->buf, frame->len);
+	memset(header.remoteFileName, 0, sizeof(header.remoteFileName));
+	strncpy(header.remoteFileName, remoteFileName, sizeof(header.remoteFileName)-1);
+	header.headerCrc = header_crc(&header);
+
+	// Header and data first, the commit bit last
+	ret = esp_partition_write(partition, head, &header, sizeof(header));
+	if (ret == ESP_OK) ret = esp_partition_write(partition, head + sizeof(header), frame->buf, frame->len);
+	if (ret == ESP_OK) {
+		header.state &= ~STATE_COMMITTED;
+		ret = esp_partition_write(partition, head + offsetof(record_header_t, state), &header.state, sizeof(header.state));
+	}
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "esp_partition_write fail. offset=0x%"PRIx32" %s", head, esp_err_to_name(ret));
+		xSemaphoreGive(storeMutex);
+		return ret;
+	}
+
+	ESP_LOGI(TAG, "stored seq=%"PRIu32" offset=0x%"PRIx32" len=%zu", nextSeq, head, frame->len);
+	if (stats.pending == 0) {
+		tail = head;
+		tailSeq = nextSeq;
+	}
+	stats.pending++;
+	stats.stored++;
+	nextSeq++;
+	head += span;
+	if (head >= partition->size) head = 0;
+	xSemaphoreGive(storeMutex);
+	return ESP_OK;
+}
+
+uint32_t frame_store_pending(void)
+{
+	if (partition == NULL) return 0;
+	xSemaphoreTake(storeMutex, portMAX_DELAY);
+	uint32_t pending = stats.pending;
+	xSemaphoreGive(storeMutex);
+	return pending;
+}
+
+void frame_store_get_stats(frame_store_stats_t *out)
+{
+	xSemaphoreTake(storeMutex, portMAX_DELAY);
+	*out = stats;
+	xSemaphoreGive(storeMutex);
+}
+
+// Read a pending record into a new frame: the oldest one when *seq is 0,
+// else the one following the record with sequence number *seq at *offset.
+// *offset and *seq move to the record read.
+// Return NULL when there is none
+static frame_handle_t *read_pending(uint32_t *offset, uint32_t *seq, char *remoteFileName, size_t nameLen)
+{
+	frame_handle_t *frame = NULL;
+	xSemaphoreTake(storeMutex, portMAX_DELAY);
+	while (stats.pending > 0) {
+		uint32_t off = tail;
+		uint32_t offSeq = tailSeq;
+		if (*seq != 0 && next_pending(*offset, *seq, &off, &offSeq) == false) break;
+
+		record_header_t header;
+		uint8_t *buf = NULL;
+		bool valid = read_header(off, &header) && header.seq == offSeq;
+		if (valid) {
+			buf = heap_caps_malloc(header.size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+			if (buf == NULL) {
+				ESP_LOGE(TAG, "heap_caps_malloc fail. len=%"PRIu32, header.size);
+				break;
+			}
+			if (esp_partition_read(partition, off + sizeof(header), buf, header.size) != ESP_OK ||
+				esp_rom_crc32_le(0, buf, header.size) != header.crc) {
+				heap_caps_free(buf);
+				valid = false;
+			}
+		}
+		if (valid == false) {
+			// Only the oldest record is skipped, a later one is skipped once it is the oldest
+			if (*seq != 0) break;
+			ESP_LOGW(TAG, "skip corrupted seq=%"PRIu32, offSeq);
+			stats.corrupted++;
+			advance_tail();
+			continue;
+		}
+
+		frame = frame_broker_wrap(buf, header.size, header.width, header.height, header.format, header.timestamp);
+		if (frame == NULL) {
+			heap_caps_free(buf);
+			break;
+		}
+		snprintf(remoteFileName, nameLen, "%s", header.remoteFileName);
+		*offset = off;
+		*seq = header.seq;
+		break;
+	}
+	xSemaphoreGive(storeMutex);
+	return frame;
+}
+
+// Mark a record as uploaded. It may have been overwritten in the meantime
+static void mark_uploaded(uint32_t seq)
+{
+	xSemaphoreTake(storeMutex, portMAX_DELAY);
+	if (stats.pending > 0 && tailSeq == seq) {
+		uint32_t state = ~(STATE_COMMITTED | STATE_UPLOADED);
+		esp_err_t ret = esp_partition_write(partition, tail + offsetof(record_header_t, state), &state, sizeof(state));
+		if (ret != ESP_OK) ESP_LOGE(TAG, "esp_partition_write fail. %s", esp_err_to_name(ret));
+		stats.uploaded++;
+		advance_tail();
+	}
+	xSemaphoreGive(storeMutex);
+}
+
+// Called by http_post_task with the result of the upload of a record
+void frame_store_done(uint32_t seq, uint32_t result)
+{
+	drain_result_t done = { .seq = seq, .result = result };
+	// The drain task gave up waiting when the queue is full, it sends the record again
+	if (xQueueSend(drainResults, &done, 0) != pdPASS) {
+		ESP_LOGW(TAG, "result of seq=%"PRIu32" dropped", seq);
+	}
+}
+
+// Upload the backlog through http_post_task, oldest first
+void frame_store_drain_task(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start drain. batch=%d", CONFIG_FRAME_STORE_DRAIN_BATCH);
+	REQUEST_t requestBuf;
+	memset(&requestBuf, 0, sizeof(requestBuf));
+	requestBuf.command = CMD_SEND;
+	// The results come back through frame_store_done(), so http_post_task doesn't flush a batch for each record
+	requestBuf.taskHandle = NULL;
+	TickType_t backoff = pdMS_TO_TICKS(DRAIN_BACKOFF_MIN_MS);
+	uint32_t seqs[CONFIG_FRAME_STORE_DRAIN_BATCH];
+	uint32_t results[CONFIG_FRAME_STORE_DRAIN_BATCH];
+	bool done[CONFIG_FRAME_STORE_DRAIN_BATCH];
+
+	while(1) {
+		if (frame_store_pending() == 0) {
+			vTaskDelay(pdMS_TO_TICKS(1000));
+			continue;
+		}
+
+		// Queue the oldest records before waiting for any result
+		int queued = 0;
+		uint32_t offset = 0;
+		uint32_t seq = 0;
+		while (queued < CONFIG_FRAME_STORE_DRAIN_BATCH) {
+			requestBuf.frame = read_pending(&offset, &seq, requestBuf.remoteFileName, sizeof(requestBuf.remoteFileName));
+			if (requestBuf.frame == NULL) break;
+			requestBuf.storeSeq = seq;
+			if (xQueueSend(xQueueRequest, &requestBuf, portMAX_DELAY) != pdPASS) {
+				frame_broker_release(requestBuf.frame);
+				break;
+			}
+			seqs[queued] = seq;
+			results[queued] = ESP_ERR_TIMEOUT;
+			done[queued] = false;
+			queued++;
+		}
+
+		// Results of an earlier batch that timed out are ignored
+		int received = 0;
+		while (received < queued) {
+			drain_result_t result;
+			if (xQueueReceive(drainResults, &result, pdMS_TO_TICKS(DRAIN_TIMEOUT_MS)) != pdTRUE) break;
+			for (int i = 0; i < queued; i++) {
+				if (seqs[i] == result.seq && done[i] == false) {
+					results[i] = result.result;
+					done[i] = true;
+					received++;
+					break;
+				}
+			}
+		}
+
+		// Records are marked in order, the ones after a failure are sent again
+		for (int i = 0; i < queued; i++) {
+			if (results[i] != 0) {
+				// The server is still unreachable, try again later
+				ESP_LOGW(TAG, "drain seq=%"PRIu32" fail value=%"PRIx32" retry in %"PRIu32" ms",
+					seqs[i], results[i], pdTICKS_TO_MS(backoff));
+				vTaskDelay(backoff);
+				backoff = backoff * 2;
+				if (backoff > pdMS_TO_TICKS(DRAIN_BACKOFF_MAX_MS)) backoff = pdMS_TO_TICKS(DRAIN_BACKOFF_MAX_MS);
+				break;
+			}
+			backoff = pdMS_TO_TICKS(DRAIN_BACKOFF_MIN_MS);
+			mark_uploaded(seqs[i]);
+			ESP_LOGI(TAG, "drained seq=%"PRIu32" pending=%"PRIu32, seqs[i], frame_store_pending());
+		}
+
+		// Give the other tasks a chance between batches
+		vTaskDelay(1);
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "frame_broker.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t pending;       // Records waiting for upload
+    uint32_t stored;        // Records appended since boot
+    uint32_t uploaded;      // Records drained since boot
+    uint32_t overwritten;   // Pending records lost because the ring was full
+    uint32_t corrupted;     // Records skipped because the CRC didn't match
+} frame_store_stats_t;
+
+// Function prototypes
+esp_err_t frame_store_init(const char *partition_label);
+esp_err_t frame_store_append(frame_handle_t *frame, const char *remoteFileName);
+uint32_t frame_store_pending(void);
+void frame_store_get_stats(frame_store_stats_t *stats);
+void frame_store_done(uint32_t seq, uint32_t result);
+void frame_store_drain_task(void *pvParameters);
+
+#ifdef __cplusplus
+}
+#endif
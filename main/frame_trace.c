@@ -0,0 +1,193 @@
+/*
+   Per-frame latency tracing.
+
+   Every request carries the time it reached each stage between the shutter
+   and the answer of the server. When the upload is done, the time spent in
+   each stage goes into a histogram with four buckets per octave, from 100us
+   to about 90s. frame_trace_metrics() prints p50/p95/p99 of every stage and
+   the frame counters in the Prometheus text format for /metrics.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_camera.h"
+
+#include "frame_trace.h"
+#include "pipeline.h"
+
+#define TRACE_BUCKETS 80
+#define TRACE_TOTAL TRACE_STAGES  // Histogram of trigger to response
+
+static const char *TAG = "TRACE";
+
+// Label of the histogram of the time spent before reaching a stage
+static const char *stageNames[TRACE_STAGES + 1] = {
+	"trigger", "fb_get", "validate", "connect", "headers", "body", "response", "total"
+};
+
+typedef struct {
+	uint32_t buckets[TRACE_BUCKETS];
+	uint32_t count;
+	uint64_t sum;  // microseconds
+} histogram_t;
+
+static uint32_t bounds[TRACE_BUCKETS];  // Upper bound of each bucket in microseconds
+static histogram_t histograms[TRACE_STAGES + 1];
+static uint32_t counters[TRACE_COUNTERS];
+static uint32_t uploaded;
+static uint32_t failed;
+static portMUX_TYPE traceLock = portMUX_INITIALIZER_UNLOCKED;
+
+void frame_trace_init(void)
+{
+	double bound = 100.0;
+	for (int i = 0; i < TRACE_BUCKETS; i++) {
+		bounds[i] = bound;
+		bound = bound * 1.189207115;  // 2^(1/4)
+	}
+	ESP_LOGI(TAG, "buckets up to %"PRIu32"us", bounds[TRACE_BUCKETS-1]);
+}
+
+void frame_trace_start(frame_trace_t *trace)
+{
+	memset(trace, 0, sizeof(frame_trace_t));
+	trace->time[TRACE_TRIGGER] = esp_timer_get_time();
+}
+
+void frame_trace_mark(frame_trace_t *trace, trace_stage_t stage)
+{
+	trace->time[stage] = esp_timer_get_time();
+}
+
+static void histogram_add(histogram_t *histogram, int64_t value)
+{
+	if (value < 0) value = 0;
+	int low = 0;
+	int high = TRACE_BUCKETS - 1;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (value <= bounds[mid]) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	histogram->buckets[low]++;
+	histogram->count++;
+	histogram->sum += value;
+}
+
+void frame_trace_finish(frame_trace_t *trace, uint32_t result)
+{
+	taskENTER_CRITICAL(&traceLock);
+	if (result != 0) {
+		failed++;
+	} else if (trace->time[TRACE_RESPONSE] != 0) {
+		uploaded++;
+		// Frames taken before a reboot have no trigger, they only count the network stages
+		int previous = -1;
+		for (int stage = 0; stage < TRACE_STAGES; stage++) {
+			if (trace->time[stage] == 0) continue;
+			if (previous >= 0) histogram_add(&histograms[stage], trace->time[stage] - trace->time[previous]);
+			previous = stage;
+		}
+		if (trace->time[TRACE_TRIGGER] != 0) {
+			histogram_add(&histograms[TRACE_TOTAL], trace->time[TRACE_RESPONSE] - trace->time[TRACE_TRIGGER]);
+		}
+	}
+	taskEXIT_CRITICAL(&traceLock);
+}
+
+void frame_trace_count(trace_counter_t counter)
+{
+	taskENTER_CRITICAL(&traceLock);
+	counters[counter]++;
+	taskEXIT_CRITICAL(&traceLock);
+}
+
+// Estimate a quantile in seconds, interpolating inside the bucket
+static double histogram_quantile(const histogram_t *histogram, double quantile)
+{
+	if (histogram->count == 0) return 0;
+	double rank = quantile * histogram->count;
+	uint32_t below = 0;
+	for (int i = 0; i < TRACE_BUCKETS; i++) {
+		if (below + histogram->buckets[i] >= rank) {
+			double lower = (i == 0) ? 0 : bounds[i-1];
+			double fraction = (rank - below) / histogram->buckets[i];
+			return (lower + (bounds[i] - lower) * fraction) / 1000000.0;
+		}
+		below = below + histogram->buckets[i];
+	}
+	return bounds[TRACE_BUCKETS-1] / 1000000.0;
+}
+
+// Append to the buffer, keeping track of the length
+#define METRICS_PRINT(...) \
+	do { \
+		if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); \
+	} while (0)
+
+size_t frame_trace_metrics(char *buf, size_t size)
+{
+	static const double quantiles[] = { 0.5, 0.95, 0.99 };
+	size_t len = 0;
+
+	METRICS_PRINT("# HELP camera_stage_seconds Time spent before reaching each stage of the upload.\n");
+	METRICS_PRINT("# TYPE camera_stage_seconds summary\n");
+	for (int stage = TRACE_FB_GET; stage <= TRACE_TOTAL; stage++) {
+		// Copy one histogram at a time, this runs on the small stack of the web server
+		histogram_t histogram;
+		taskENTER_CRITICAL(&traceLock);
+		histogram = histograms[stage];
+		taskEXIT_CRITICAL(&traceLock);
+		for (int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+			METRICS_PRINT("camera_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n",
+				stageNames[stage], quantiles[i], histogram_quantile(&histogram, quantiles[i]));
+		}
+		METRICS_PRINT("camera_stage_seconds_sum{stage=\"%s\"} %.6f\n", stageNames[stage], histogram.sum / 1000000.0);
+		METRICS_PRINT("camera_stage_seconds_count{stage=\"%s\"} %"PRIu32"\n", stageNames[stage], histogram.count);
+	}
+
+	uint32_t counts[TRACE_COUNTERS];
+	taskENTER_CRITICAL(&traceLock);
+	uint32_t uploadedCount = uploaded;
+	uint32_t failedCount = failed;
+	memcpy(counts, counters, sizeof(counts));
+	taskEXIT_CRITICAL(&traceLock);
+
+	pipeline_stats_t pipeline;
+	pipeline_get_stats(&pipeline);
+	camera_stats_t camera;
+	esp_camera_get_stats(&camera);
+
+	METRICS_PRINT("# TYPE camera_frames_uploaded_total counter\n");
+	METRICS_PRINT("camera_frames_uploaded_total %"PRIu32"\n", uploadedCount);
+	METRICS_PRINT("# TYPE camera_frames_failed_total counter\n");
+	METRICS_PRINT("camera_frames_failed_total %"PRIu32"\n", failedCount);
+	METRICS_PRINT("# TYPE camera_frames_dropped_total counter\n");
+	METRICS_PRINT("camera_frames_dropped_total %"PRIu32"\n", pipeline.dropped);
+	METRICS_PRINT("# TYPE camera_frames_invalid_total counter\n");
+	METRICS_PRINT("camera_frames_invalid_total %"PRIu32"\n", counts[TRACE_INVALID]);
+	METRICS_PRINT("# TYPE camera_frames_unchanged_total counter\n");
+	METRICS_PRINT("camera_frames_unchanged_total %"PRIu32"\n", counts[TRACE_UNCHANGED]);
+	METRICS_PRINT("# TYPE camera_frames_stored_total counter\n");
+	METRICS_PRINT("camera_frames_stored_total %"PRIu32"\n", counts[TRACE_STORED]);
+	METRICS_PRINT("# TYPE camera_upload_retries_total counter\n");
+	METRICS_PRINT("camera_upload_retries_total %"PRIu32"\n", counts[TRACE_RETRY]);
+	METRICS_PRINT("# HELP camera_driver_errors_total Frames the camera driver could not deliver.\n");
+	METRICS_PRINT("# TYPE camera_driver_errors_total counter\n");
+	METRICS_PRINT("camera_driver_errors_total{error=\"fb_ovf\"} %"PRIu32"\n", camera.fb_overflow);
+	METRICS_PRINT("camera_driver_errors_total{error=\"no_soi\"} %"PRIu32"\n", camera.no_soi);
+	METRICS_PRINT("camera_driver_errors_total{error=\"no_eoi\"} %"PRIu32"\n", camera.no_eoi);
+	METRICS_PRINT("camera_driver_errors_total{error=\"timeout\"} %"PRIu32"\n", camera.timeout);
+	METRICS_PRINT("# TYPE camera_uptime_seconds gauge\n");
+	METRICS_PRINT("camera_uptime_seconds %"PRId64"\n", esp_timer_get_time() / 1000000);
+
+	return (len < size) ? len : size - 1;
+}
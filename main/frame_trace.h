@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Stages of a frame from the shutter to the answer of the server
+typedef enum {
+    TRACE_TRIGGER = 0,  // Shutter command received
+    TRACE_FB_GET,       // Frame returned by the camera
+    TRACE_VALIDATED,    // SOI/EOI markers checked
+    TRACE_CONNECT,      // Connected to the HTTP server
+    TRACE_HEADERS,      // Request headers sent
+    TRACE_BODY,         // Picture sent
+    TRACE_RESPONSE,     // Response parsed
+    TRACE_STAGES
+} trace_stage_t;
+
+// Events counted besides the frames
+typedef enum {
+    TRACE_RETRY = 0,    // Request sent again on a new connection
+    TRACE_INVALID,      // Frame without SOI/EOI markers, not uploaded
+    TRACE_UNCHANGED,    // Frame of a static scene, not uploaded
+    TRACE_STORED,       // Frame queued in the frame store, uploaded later by the drain task
+    TRACE_COUNTERS
+} trace_counter_t;
+
+// Carried by every request
+typedef struct {
+    int64_t time[TRACE_STAGES];  // esp_timer_get_time() at each stage. 0 when not reached
+} frame_trace_t;
+
+// Function prototypes
+void frame_trace_init(void);
+void frame_trace_start(frame_trace_t *trace);
+void frame_trace_mark(frame_trace_t *trace, trace_stage_t stage);
+void frame_trace_finish(frame_trace_t *trace, uint32_t result);
+void frame_trace_count(trace_counter_t counter);
+size_t frame_trace_metrics(char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,6 +8,7 @@
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "cmd.h"
+#include "burst.h"
 
 #if CONFIG_SHUTTER_GPIO
 
@@ -20,7 +21,7 @@ void gpio(void *pvParameter)
 	ESP_LOGI(TAG, "Start CONFIG_GPIO_INPUT=%d", CONFIG_GPIO_INPUT);
 	CMD_t cmdBuf;
 	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	cmdBuf.command = CMD_TAKE;
+	burst_default(&cmdBuf);
 
 	// set the GPIO as a input
 	gpio_reset_pin(CONFIG_GPIO_INPUT);
@@ -9,11 +9,14 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -21,7 +24,14 @@
 #include "lwip/netdb.h"
 #include "lwip/dns.h"
 
+#include "img_converters.h"
+
 #include "cmd.h"
+#include "camera_helpers.h"
+#include "pipeline.h"
+#include "frame_store.h"
+#include "frame_trace.h"
+#include "rate_control.h"
 
 /* Constants that are configurable in menuconfig */
 #if 0
@@ -36,7 +46,64 @@ extern QueueHandle_t xQueueRequest;
 
 static const char *TAG = "POST";
 
-void http_post_task(void *pvParameters)
+#if CONFIG_WEB_KEEP_ALIVE
+// Connection kept open across frames
+static struct sockaddr_in serverAddr;
+static bool serverAddrValid = false;
+static int keepAliveSocket = -1;
+#endif
+
+// Write the whole buffer to the socket
+static int write_all(int s, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	while (len > 0) {
+		int sent = write(s, p, len);
+		if (sent < 0) return sent;
+		p += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+// Write part of the request body, as one chunk in chunked mode
+static int write_body(int s, const void *data, size_t len)
+{
+#if CONFIG_CHUNKED_UPLOAD
+	// A zero length chunk would end the body
+	if (len == 0) return 0;
+	char chunkSize[12];
+	sprintf(chunkSize, "%zx\r\n", len);
+	if (write_all(s, chunkSize, strlen(chunkSize)) < 0) return -1;
+	if (write_all(s, data, len) < 0) return -1;
+	return write_all(s, "\r\n", 2);
+#else
+	return write_all(s, data, len);
+#endif
+}
+
+#if CONFIG_CHUNKED_UPLOAD
+typedef struct {
+	int s;
+	bool failed;
+} jpg_chunk_t;
+
+// Send the JPEG encoder output as it is produced
+static size_t jpg_chunk_cb(void *arg, size_t index, const void *data, size_t len)
+{
+	jpg_chunk_t *chunk = arg;
+	if (chunk->failed) return 0;
+	if (write_body(chunk->s, data, len) < 0) {
+		chunk->failed = true;
+		return 0;
+	}
+	return len;
+}
+#endif
+
+// Resolve CONFIG_WEB_SERVER and connect to it.
+// Return the socket, or a negative result code on failure.
+static int http_connect(void)
 {
 	const struct addrinfo hints = {
 		.ai_family = AF_INET,
@@ -44,184 +111,536 @@ void http_post_task(void *pvParameters)
 	};
 	struct addrinfo *res;
 	struct in_addr *addr;
-	char recv_buf[64];
 
-	REQUEST_t requestBuf;
-	while(1) {
-		ESP_LOGI(TAG,"Waitting....");
-		xQueueReceive(xQueueRequest, &requestBuf, portMAX_DELAY);
-		ESP_LOGI(TAG,"requestBuf.command=%d", requestBuf.command);
-		if (requestBuf.command == CMD_HALT) break;
+#if CONFIG_WEB_KEEP_ALIVE
+	if (keepAliveSocket >= 0) {
+		// Reuse the connection unless the server has closed it while we were idle
+		char peek;
+		int readed = recv(keepAliveSocket, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (readed < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return keepAliveSocket;
+		ESP_LOGI(TAG, "... kept connection is gone, reconnecting");
+		close(keepAliveSocket);
+		keepAliveSocket = -1;
+	}
+	if (serverAddrValid == false) {
+#endif
+	int err = getaddrinfo(CONFIG_WEB_SERVER, CONFIG_WEB_PORT, &hints, &res);
 
-		ESP_LOGI(TAG,"requestBuf.localFileName=%s", requestBuf.localFileName);
-		ESP_LOGI(TAG,"requestBuf.remoteFileName=%s", requestBuf.remoteFileName);
-		struct stat statBuf;
-		if (stat(requestBuf.localFileName, &statBuf) == 0) {
-			ESP_LOGI(TAG, "st_size=%d", (int)statBuf.st_size);
-		} else {
-			ESP_LOGE(TAG, "stat fail");
-			xTaskNotify(requestBuf.taskHandle, 0x01, eSetValueWithOverwrite);
-			continue;
-		}
+	if(err != 0 || res == NULL) {
+		ESP_LOGE(TAG, "DNS lookup failed err=%d res=%p", err, res);
+		//vTaskDelay(1000 / portTICK_PERIOD_MS);
+		return -0x02;
+	}
 
-		int err = getaddrinfo(CONFIG_WEB_SERVER, CONFIG_WEB_PORT, &hints, &res);
+	/* Code to print the resolved IP.
+	   Note: inet_ntoa is non-reentrant, look at ipaddr_ntoa_r for "real" code */
+	addr = &((struct sockaddr_in *)res->ai_addr)->sin_addr;
+	ESP_LOGI(TAG, "DNS lookup succeeded. IP=%s", inet_ntoa(*addr));
+#if CONFIG_WEB_KEEP_ALIVE
+	memcpy(&serverAddr, res->ai_addr, sizeof(serverAddr));
+	serverAddrValid = true;
+	freeaddrinfo(res);
+	}
 
-		if(err != 0 || res == NULL) {
-			ESP_LOGE(TAG, "DNS lookup failed err=%d res=%p", err, res);
-			//vTaskDelay(1000 / portTICK_PERIOD_MS);
-			xTaskNotify(requestBuf.taskHandle, 0x02, eSetValueWithOverwrite);
-			continue;
-		}
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	if(s < 0) {
+		ESP_LOGE(TAG, "... Failed to allocate socket.");
+		return -0x03;
+	}
+	ESP_LOGI(TAG, "... allocated socket");
 
-		/* Code to print the resolved IP.
-		   Note: inet_ntoa is non-reentrant, look at ipaddr_ntoa_r for "real" code */
-		addr = &((struct sockaddr_in *)res->ai_addr)->sin_addr;
-		ESP_LOGI(TAG, "DNS lookup succeeded. IP=%s", inet_ntoa(*addr));
+	if(connect(s, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) != 0) {
+		ESP_LOGE(TAG, "... socket connect failed errno=%d", errno);
+		close(s);
+		// Resolve again next time, the server may have moved
+		serverAddrValid = false;
+		return -0x04;
+	}
+	ESP_LOGI(TAG, "... connected");
+	keepAliveSocket = s;
+#else
 
-		int s = socket(res->ai_family, res->ai_socktype, 0);
-		if(s < 0) {
-			ESP_LOGE(TAG, "... Failed to allocate socket.");
-			freeaddrinfo(res);
-			//vTaskDelay(1000 / portTICK_PERIOD_MS);
-			xTaskNotify(requestBuf.taskHandle, 0x03, eSetValueWithOverwrite);
-			continue;
+	int s = socket(res->ai_family, res->ai_socktype, 0);
+	if(s < 0) {
+		ESP_LOGE(TAG, "... Failed to allocate socket.");
+		freeaddrinfo(res);
+		//vTaskDelay(1000 / portTICK_PERIOD_MS);
+		return -0x03;
+	}
+	ESP_LOGI(TAG, "... allocated socket");
+
+	if(connect(s, res->ai_addr, res->ai_addrlen) != 0) {
+		ESP_LOGE(TAG, "... socket connect failed errno=%d", errno);
+		close(s);
+		freeaddrinfo(res);
+		//vTaskDelay(4000 / portTICK_PERIOD_MS);
+		return -0x04;
+	}
+
+	ESP_LOGI(TAG, "... connected");
+	freeaddrinfo(res);
+#endif
+
+	struct timeval receiving_timeout;
+	receiving_timeout.tv_sec = 5;
+	receiving_timeout.tv_usec = 0;
+	if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &receiving_timeout,
+			sizeof(receiving_timeout)) < 0) {
+		ESP_LOGE(TAG, "... failed to set socket receiving timeout");
+		close(s);
+#if CONFIG_WEB_KEEP_ALIVE
+		keepAliveSocket = -1;
+#endif
+		//vTaskDelay(4000 / portTICK_PERIOD_MS);
+		return -0x09;
+	}
+	ESP_LOGI(TAG, "... set socket receiving timeout success");
+	return s;
+}
+
+// Close the connection unless it is kept for the next request
+static void http_close(int s, bool keepOpen)
+{
+#if CONFIG_WEB_KEEP_ALIVE
+	if (keepOpen) return;
+	keepAliveSocket = -1;
+#endif
+	close(s);
+}
+
+#if CONFIG_WEB_KEEP_ALIVE
+// Find a header in the response header block and return its value
+static char *find_header(char *headers, const char *name)
+{
+	size_t nameLen = strlen(name);
+	char *line = strstr(headers, "\r\n");
+	while (line != NULL) {
+		line += 2;
+		if (strncmp(line, "\r\n", 2) == 0) break;
+		if (strncasecmp(line, name, nameLen) == 0 && line[nameLen] == ':') {
+			char *value = line + nameLen + 1;
+			while (*value == ' ') value++;
+			return value;
 		}
-		ESP_LOGI(TAG, "... allocated socket");
+		line = strstr(line, "\r\n");
+	}
+	return NULL;
+}
 
-		if(connect(s, res->ai_addr, res->ai_addrlen) != 0) {
-			ESP_LOGE(TAG, "... socket connect failed errno=%d", errno);
-			close(s);
-			freeaddrinfo(res);
-			//vTaskDelay(4000 / portTICK_PERIOD_MS);
-			xTaskNotify(requestBuf.taskHandle, 0x04, eSetValueWithOverwrite);
-			continue;
+// Read one HTTP response, using Content-Length to find its end.
+// Return the number of bytes kept in responseBuf, or -1 when the socket died.
+static int http_read_response(int s, char *responseBuf, size_t responseSize, bool *keepOpen)
+{
+	int responseLen = 0;
+	char *body = NULL;
+	*keepOpen = false;
+	bzero(responseBuf, responseSize);
+
+	// Read the header block
+	while (body == NULL) {
+		if (responseLen >= responseSize - 1) {
+			ESP_LOGE(TAG, "response header too large");
+			return responseLen;
 		}
+		int readed = read(s, responseBuf + responseLen, responseSize - 1 - responseLen);
+		ESP_LOGD(TAG, "readed=%d", readed);
+		if (readed <= 0) return (responseLen == 0) ? -1 : responseLen;
+		responseLen = responseLen + readed;
+		responseBuf[responseLen] = 0;
+		body = strstr(responseBuf, "\r\n\r\n");
+	}
+	body += 4;
 
-		ESP_LOGI(TAG, "... connected");
-		freeaddrinfo(res);
+	char *contentLength = find_header(responseBuf, "Content-Length");
+	if (contentLength == NULL) {
+		// The server will mark the end of the body by closing the connection
+		ESP_LOGW(TAG, "No Content-Length in response");
+		return responseLen;
+	}
 
-		char HEADER[512];
-		char header[128];
-
-		sprintf(header, "POST %s HTTP/1.1\r\n", CONFIG_WEB_PATH);
-		strcpy(HEADER, header);
-		sprintf(header, "Host: %s:%s\r\n", CONFIG_WEB_SERVER, CONFIG_WEB_PORT);
-		strcat(HEADER, header);
-		sprintf(header, "User-Agent: esp-idf/%d.%d.%d esp32\r\n", ESP_IDF_VERSION_MAJOR, ESP_IDF_VERSION_MINOR, ESP_IDF_VERSION_PATCH);
-		strcat(HEADER, header);
-		sprintf(header, "Accept: */*\r\n");
-		strcat(HEADER, header);
-		sprintf(header, "Content-Type: multipart/form-data; boundary=%s\r\n", BOUNDARY);
-		strcat(HEADER, header);
-	
-		char BODY[512];
-		sprintf(header, "--%s\r\n", BOUNDARY);
-		strcpy(BODY, header);
-		sprintf(header, "Content-Disposition: form-data; name=\"upfile\"; filename=\"%s\"\r\n", requestBuf.remoteFileName);
-		strcat(BODY, header);
-		sprintf(header, "Content-Type: application/octet-stream\r\n\r\n");
-		strcat(BODY, header);
-
-		char END[128];
-		sprintf(header, "\r\n--%s--\r\n\r\n", BOUNDARY);
-		strcpy(END, header);
-		
-		int dataLength = strlen(BODY) + strlen(END) + statBuf.st_size;
-		sprintf(header, "Content-Length: %d\r\n\r\n", dataLength);
-		strcat(HEADER, header);
-
-		ESP_LOGD(TAG, "[%s]", HEADER);
-		if (write(s, HEADER, strlen(HEADER)) < 0) {
-			ESP_LOGE(TAG, "... socket send failed");
-			close(s);
-			//vTaskDelay(4000 / portTICK_PERIOD_MS);
-			xTaskNotify(requestBuf.taskHandle, 0x05, eSetValueWithOverwrite);
-			continue;
+	// Skip the rest of the body
+	int remain = atoi(contentLength) - (responseLen - (body - responseBuf));
+	char recv_buf[64];
+	while (remain > 0) {
+		int readed = read(s, recv_buf, (remain < sizeof(recv_buf)) ? remain : sizeof(recv_buf));
+		if (readed <= 0) return responseLen;
+		remain = remain - readed;
+	}
+
+	char *connection = find_header(responseBuf, "Connection");
+	if (connection != NULL && strncasecmp(connection, "close", 5) == 0) {
+		ESP_LOGI(TAG, "Server closes the connection");
+	} else {
+		*keepOpen = true;
+	}
+	return responseLen;
+}
+#endif
+
+// Build the part header in front of a picture
+static void part_header(char *part, REQUEST_t *requestBuf, bool first)
+{
+	char header[128];
+	sprintf(header, "%s--%s\r\n", first ? "" : "\r\n", BOUNDARY);
+	strcpy(part, header);
+	sprintf(header, "Content-Disposition: form-data; name=\"upfile\"; filename=\"%s\"\r\n", requestBuf->remoteFileName);
+	strcat(part, header);
+	sprintf(header, "Content-Type: application/octet-stream\r\n\r\n");
+	strcat(part, header);
+}
+
+// All the pictures of a request reach a stage together
+static void trace_mark_all(REQUEST_t *requests, int count, trace_stage_t stage)
+{
+	for (int i = 0; i < count; i++) {
+		frame_trace_mark(&requests[i].trace, stage);
+	}
+}
+
+// Post pictures as the parts of one request and return the result code for the requesters
+static uint32_t http_post(REQUEST_t *requests, int count)
+{
+#if !CONFIG_CHUNKED_UPLOAD
+	// Content-Length needs the size of every picture up front
+	size_t totalSize = 0;
+	for (int i = 0; i < count; i++) {
+		REQUEST_t *requestBuf = &requests[i];
+		ESP_LOGI(TAG,"requestBuf.localFileName=%s", requestBuf->localFileName);
+		ESP_LOGI(TAG,"requestBuf.remoteFileName=%s", requestBuf->remoteFileName);
+		size_t pictureSize;
+		if (requestBuf->frame != NULL) {
+			pictureSize = requestBuf->frame->len;
+			ESP_LOGI(TAG, "frame->len=%zu", pictureSize);
+		} else {
+			struct stat statBuf;
+			if (stat(requestBuf->localFileName, &statBuf) == 0) {
+				ESP_LOGI(TAG, "st_size=%d", (int)statBuf.st_size);
+				pictureSize = statBuf.st_size;
+			} else {
+				ESP_LOGE(TAG, "stat fail");
+				return 0x01;
+			}
 		}
-		ESP_LOGI(TAG, "HEADER socket send success");
+		totalSize = totalSize + pictureSize;
+	}
+#endif
+
+	char HEADER[512];
+	char header[128];
 
+	sprintf(header, "POST %s HTTP/1.1\r\n", CONFIG_WEB_PATH);
+	strcpy(HEADER, header);
+	sprintf(header, "Host: %s:%s\r\n", CONFIG_WEB_SERVER, CONFIG_WEB_PORT);
+	strcat(HEADER, header);
+	sprintf(header, "User-Agent: esp-idf/%d.%d.%d esp32\r\n", ESP_IDF_VERSION_MAJOR, ESP_IDF_VERSION_MINOR, ESP_IDF_VERSION_PATCH);
+	strcat(HEADER, header);
+	sprintf(header, "Accept: */*\r\n");
+	strcat(HEADER, header);
+#if CONFIG_WEB_KEEP_ALIVE
+	sprintf(header, "Connection: keep-alive\r\n");
+	strcat(HEADER, header);
+#endif
+	sprintf(header, "Content-Type: multipart/form-data; boundary=%s\r\n", BOUNDARY);
+	strcat(HEADER, header);
+
+	char BODY[512];
+	char END[128];
+	sprintf(header, "\r\n--%s--\r\n\r\n", BOUNDARY);
+	strcpy(END, header);
+
+#if CONFIG_CHUNKED_UPLOAD
+	sprintf(header, "Transfer-Encoding: chunked\r\n\r\n");
+#else
+	int dataLength = totalSize + strlen(END);
+	for (int i = 0; i < count; i++) {
+		part_header(BODY, &requests[i], i == 0);
+		dataLength = dataLength + strlen(BODY);
+	}
+	sprintf(header, "Content-Length: %d\r\n\r\n", dataLength);
+#endif
+	strcat(HEADER, header);
+
+	int s;
+	uint32_t sendFailed;	// Result when a write to the socket fails
+#if CONFIG_WEB_KEEP_ALIVE
+	// A kept connection may have been closed by the server while we were idle.
+	// Then any write before the response fails, so reconnect once and send the request again.
+	bool reused = (keepAliveSocket >= 0);
+retry:
+#endif
+	s = http_connect();
+	if (s < 0) return -s;
+	trace_mark_all(requests, count, TRACE_CONNECT);
+
+	ESP_LOGD(TAG, "[%s]", HEADER);
+	if (write(s, HEADER, strlen(HEADER)) < 0) {
+		sendFailed = 0x05;
+		goto send_failed;
+	}
+	ESP_LOGI(TAG, "HEADER socket send success");
+	trace_mark_all(requests, count, TRACE_HEADERS);
+
+	for (int i = 0; i < count; i++) {
+		REQUEST_t *requestBuf = &requests[i];
+		part_header(BODY, requestBuf, i == 0);
 		ESP_LOGD(TAG, "[%s]", BODY);
-		if (write(s, BODY, strlen(BODY)) < 0) {
-			ESP_LOGE(TAG, "... socket send failed");
-			close(s);
-			//vTaskDelay(4000 / portTICK_PERIOD_MS);
-			xTaskNotify(requestBuf.taskHandle, 0x06, eSetValueWithOverwrite);
-			continue;
+		if (write_body(s, BODY, strlen(BODY)) < 0) {
+			sendFailed = 0x06;
+			goto send_failed;
 		}
 		ESP_LOGI(TAG, "BODY socket send success");
 
-		FILE* f=fopen(requestBuf.localFileName, "rb");
-		uint8_t dataBuffer[128];
-		if (f == NULL) {
-			ESP_LOGE(TAG, "Failed to open file for reading");
-		}
-		while(!feof(f)) {
-			int len = fread(dataBuffer, 1, sizeof(dataBuffer), f);
-			if (write(s, dataBuffer, len) < 0) {
-				ESP_LOGE(TAG, "... socket send failed");
-				close(s);
-				//vTaskDelay(4000 / portTICK_PERIOD_MS);
-				xTaskNotify(requestBuf.taskHandle, 0x07, eSetValueWithOverwrite);
-				continue;
+#if CONFIG_CHUNKED_UPLOAD
+		if (requestBuf->frame != NULL && requestBuf->frame->format != PIXFORMAT_JPEG) {
+			// Send the JPEG while it is being encoded
+			frame_handle_t *frame = requestBuf->frame;
+			jpg_chunk_t chunk = { .s = s, .failed = false };
+			bool converted = fmt2jpg_cb(frame->buf, frame->len, frame->width, frame->height, frame->format, camera_jpeg_quality(), jpg_chunk_cb, &chunk);
+			if (chunk.failed) {
+				sendFailed = 0x07;
+				goto send_failed;
 			}
+			if (converted == false) {
+				ESP_LOGE(TAG, "... JPEG streaming failed");
+				http_close(s, false);
+				return 0x07;
+			}
+		} else
+#endif
+		if (requestBuf->frame != NULL) {
+			// Send the JPEG straight out of the frame buffer
+			if (write_body(s, requestBuf->frame->buf, requestBuf->frame->len) < 0) {
+				sendFailed = 0x07;
+				goto send_failed;
+			}
+		} else {
+			FILE* f=fopen(requestBuf->localFileName, "rb");
+			uint8_t dataBuffer[128];
+			if (f == NULL) {
+				ESP_LOGE(TAG, "Failed to open file for reading");
+				http_close(s, false);
+				return 0x07;
+			}
+			while(!feof(f)) {
+				int len = fread(dataBuffer, 1, sizeof(dataBuffer), f);
+				if (write_body(s, dataBuffer, len) < 0) {
+					fclose(f);
+					sendFailed = 0x07;
+					goto send_failed;
+				}
+			}
+			fclose(f);
 		}
-		fclose(f);
 		ESP_LOGI(TAG, "DATA socket send success");
+		frame_trace_mark(&requestBuf->trace, TRACE_BODY);
+	}
 
-		if (write(s, END, strlen(END)) < 0) {
-			ESP_LOGE(TAG, "... socket send failed");
-			close(s);
-			//vTaskDelay(4000 / portTICK_PERIOD_MS);
-			xTaskNotify(requestBuf.taskHandle, 0x08, eSetValueWithOverwrite);
-			continue;
-		}
-		ESP_LOGI(TAG, "END socket send success");
-
-		struct timeval receiving_timeout;
-		receiving_timeout.tv_sec = 5;
-		receiving_timeout.tv_usec = 0;
-		if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &receiving_timeout,
-				sizeof(receiving_timeout)) < 0) {
-			ESP_LOGE(TAG, "... failed to set socket receiving timeout");
-			close(s);
-			//vTaskDelay(4000 / portTICK_PERIOD_MS);
-			xTaskNotify(requestBuf.taskHandle, 0x09, eSetValueWithOverwrite);
-			continue;
+#if CONFIG_CHUNKED_UPLOAD
+	// The zero length chunk ends the body
+	if (write_body(s, END, strlen(END)) < 0 || write_all(s, "0\r\n\r\n", 5) < 0) {
+#else
+	if (write(s, END, strlen(END)) < 0) {
+#endif
+		sendFailed = 0x08;
+		goto send_failed;
+	}
+	ESP_LOGI(TAG, "END socket send success");
+
+	/* Read HTTP response */
+#if CONFIG_WEB_KEEP_ALIVE
+	char responseBuf[512];
+	bool keepOpen;
+	int responseLen = http_read_response(s, responseBuf, sizeof(responseBuf), &keepOpen);
+	if (responseLen < 0) {
+		ESP_LOGE(TAG, "... connection closed before response");
+		http_close(s, false);
+		if (reused) {
+			reused = false;
+			frame_trace_count(TRACE_RETRY);
+			goto retry;
 		}
-		ESP_LOGI(TAG, "... set socket receiving timeout success");
-
-		/* Read HTTP response */
-		int readed;
-		char responseBuf[256];
-		int responseLen = 0;
-		bzero(responseBuf, sizeof(responseBuf));
-		do {
-			bzero(recv_buf, sizeof(recv_buf));
-			readed = read(s, recv_buf, sizeof(recv_buf)-1);
-			ESP_LOGI(TAG, "readed=%d", readed);
+		return 0x90;
+	}
+	ESP_LOGI(TAG, "responseLen=%d keepOpen=%d", responseLen, keepOpen);
+#else
+	int readed;
+	char recv_buf[64];
+	char responseBuf[256];
+	int responseLen = 0;
+	bool keepOpen = false;
+	bzero(responseBuf, sizeof(responseBuf));
+	do {
+		bzero(recv_buf, sizeof(recv_buf));
+		readed = read(s, recv_buf, sizeof(recv_buf)-1);
+		ESP_LOGI(TAG, "readed=%d", readed);
 #if 0
-			for(int i = 0; i < readed; i++) {
-				putchar(recv_buf[i]);
-			}
+		for(int i = 0; i < readed; i++) {
+			putchar(recv_buf[i]);
+		}
 #endif
-			if (responseLen + readed < sizeof(responseBuf)-1) {
-				strcat(responseBuf, recv_buf);
-				responseLen = responseLen + readed;
-			}
-		} while(readed > 0);
+		if (responseLen + readed < sizeof(responseBuf)-1) {
+			strcat(responseBuf, recv_buf);
+			responseLen = responseLen + readed;
+		}
+	} while(readed > 0);
 #if 0
-		printf("\n");
+	printf("\n");
+#endif
+	ESP_LOGI(TAG, "done reading from socket. Last readed=%d responseLen=%d errno=%d.", readed, responseLen, errno);
 #endif
 
-		/* send response */
-		ESP_LOGI(TAG, "done reading from socket. Last readed=%d responseLen=%d errno=%d.", readed, responseLen, errno);
-		ESP_LOGI(TAG, "responseBuf=[%.*s]", responseLen, responseBuf);
-		if (strncmp(responseBuf, "HTTP/1.1 200", 12) == 0) {
-			xTaskNotify(requestBuf.taskHandle, 0x00, eSetValueWithOverwrite);
-		} else {
-			xTaskNotify(requestBuf.taskHandle, 0x90, eSetValueWithOverwrite);
+	/* send response */
+	ESP_LOGI(TAG, "responseBuf=[%.*s]", responseLen, responseBuf);
+	trace_mark_all(requests, count, TRACE_RESPONSE);
+	http_close(s, keepOpen);
+	if (strncmp(responseBuf, "HTTP/1.1 200", 12) == 0) {
+		return 0x00;
+	} else {
+		return 0x90;
+	}
+
+send_failed:
+	ESP_LOGE(TAG, "... socket send failed");
+	http_close(s, false);
+#if CONFIG_WEB_KEEP_ALIVE
+	// Nothing of the response has been read yet
+	if (reused) {
+		reused = false;
+		frame_trace_count(TRACE_RETRY);
+		goto retry;
+	}
+#endif
+	return sendFailed;
+}
+
+// Hand the result to the requester and let the frame go
+static void http_post_done(REQUEST_t *requestBuf, uint32_t result)
+{
+	// We are done with the frame
+	if (requestBuf->frame != NULL) {
+		frame_broker_release(requestBuf->frame);
+	}
+	pipeline_uploaded(result);
+	frame_trace_finish(&requestBuf->trace, result);
+	if (requestBuf->taskHandle != NULL) {
+		xTaskNotify(requestBuf->taskHandle, result, eSetValueWithOverwrite);
+	}
+#if CONFIG_FRAME_STORE
+	if (requestBuf->storeSeq != 0) frame_store_done(requestBuf->storeSeq, result);
+#endif
+}
+
+#if CONFIG_FRAME_STORE
+// Queue a new frame behind the backlog of the frame store, the drain task sends it in order
+static void http_post_store(REQUEST_t *requestBuf)
+{
+	esp_err_t ret = frame_store_append(requestBuf->frame, requestBuf->remoteFileName);
+	if (ret != ESP_OK) {
+		http_post_done(requestBuf, ret);
+		return;
+	}
+	// Not uploaded yet, so it is counted apart from the uploaded frames
+	frame_broker_release(requestBuf->frame);
+	pipeline_stored();
+	frame_trace_count(TRACE_STORED);
+	if (requestBuf->taskHandle != NULL) {
+		xTaskNotify(requestBuf->taskHandle, 0, eSetValueWithOverwrite);
+	}
+}
+#endif
+
+// Post the requests and complete them all with the same result
+static void http_post_flush(REQUEST_t *requests, int count)
+{
+	if (count == 0) return;
+	ESP_LOGI(TAG, "post %d pictures", count);
+#if CONFIG_RATE_CONTROL
+	int64_t startTime = esp_timer_get_time();
+#endif
+	uint32_t result = http_post(requests, count);
+#if CONFIG_RATE_CONTROL
+	if (result == 0) {
+		size_t bytes = 0;
+		for (int i = 0; i < count; i++) {
+			if (requests[i].frame != NULL) bytes = bytes + requests[i].frame->len;
 		}
-		close(s);
+		rate_control_report(bytes, count, esp_timer_get_time() - startTime);
+	}
+#endif
+	for (int i = 0; i < count; i++) {
+#if CONFIG_FRAME_STORE
+		if (result != 0 && requests[i].frame != NULL && requests[i].storeSeq == 0) {
+			// Keep the frame until the server is back
+			frame_store_append(requests[i].frame, requests[i].remoteFileName);
+		}
+#endif
+		http_post_done(&requests[i], result);
+	}
+}
 
+void http_post_task(void *pvParameters)
+{
+	REQUEST_t requestBuf;
+#if CONFIG_BATCH_UPLOAD
+	// Frames waiting to go out in one request
+	REQUEST_t batch[CONFIG_BATCH_MAX_FRAMES];
+	int batchCount = 0;
+	size_t batchBytes = 0;
+	int64_t batchStart = 0;
+#endif
+	while(1) {
+		TickType_t wait = portMAX_DELAY;
+#if CONFIG_BATCH_UPLOAD
+		if (batchCount > 0) {
+			// Don't hold the oldest frame longer than CONFIG_BATCH_MAX_AGE_MS
+			int64_t age = (esp_timer_get_time() - batchStart) / 1000;
+			wait = (age < CONFIG_BATCH_MAX_AGE_MS) ? pdMS_TO_TICKS(CONFIG_BATCH_MAX_AGE_MS - age) : 0;
+		}
+#endif
+		ESP_LOGI(TAG,"Waitting....");
+		if (xQueueReceive(xQueueRequest, &requestBuf, wait) != pdTRUE) {
+#if CONFIG_BATCH_UPLOAD
+			http_post_flush(batch, batchCount);
+			batchCount = 0;
+#endif
+			continue;
+		}
+		ESP_LOGI(TAG,"requestBuf.command=%d", requestBuf.command);
+		if (requestBuf.command == CMD_HALT) {
+#if CONFIG_BATCH_UPLOAD
+			http_post_flush(batch, batchCount);
+#endif
+			break;
+		}
+
+#if CONFIG_FRAME_STORE
+		if (requestBuf.frame != NULL && requestBuf.storeSeq == 0 && frame_store_pending() > 0) {
+#if CONFIG_BATCH_UPLOAD
+			// Frames taken earlier go first
+			http_post_flush(batch, batchCount);
+			batchCount = 0;
+#endif
+			http_post_store(&requestBuf);
+			continue;
+		}
+#endif
+
+#if CONFIG_BATCH_UPLOAD
+		if (batchCount == 0) {
+			batchStart = esp_timer_get_time();
+			batchBytes = 0;
+		}
+		batch[batchCount++] = requestBuf;
+		if (requestBuf.frame != NULL) batchBytes = batchBytes + requestBuf.frame->len;
+
+		// Somebody waiting for the result can't wait for the batch to fill up
+		if (batchCount == CONFIG_BATCH_MAX_FRAMES || batchBytes >= CONFIG_BATCH_MAX_BYTES ||
+			requestBuf.taskHandle != NULL) {
+			http_post_flush(batch, batchCount);
+			batchCount = 0;
+		}
+#else
+		http_post_flush(&requestBuf, 1);
+#endif
 	}
 }
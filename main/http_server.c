@@ -8,20 +8,34 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
 #include <inttypes.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <mbedtls/base64.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
-#include "esp_vfs.h"
-#include "esp_spiffs.h"
+#include "esp_timer.h"
 #include "esp_http_server.h"
 
 #include "cmd.h"
+#include "burst.h"
 
 #include "camera_helpers.h"
+#include "frame_broker.h"
+#include "frame_cache.h"
+#include "frame_trace.h"
+#if CONFIG_SHUTTER_AUTO
+#include "auto_acquisition.h"
+#endif
 
 static const char *TAG = "HTTP";
 
@@ -69,7 +83,7 @@ esp_err_t Image2Base64(char * filename, size_t fsize, unsigned char * base64_buf
 	//image_buffer = malloc(fsize + 1);
 	image_buffer = malloc(fsize);
 	if (image_buffer == NULL) {
-		ESP_LOGE(TAG, "malloc fail. image_buffer %d", fsize);
+		ESP_LOGE(TAG, "malloc fail. image_buffer %zu", fsize);
 		return ESP_FAIL;
 	}
 
@@ -86,7 +100,7 @@ esp_err_t Image2Base64(char * filename, size_t fsize, unsigned char * base64_buf
 
 	size_t encord_len;
 	esp_err_t ret = mbedtls_base64_encode(base64_buffer, base64_buffer_len, &encord_len, image_buffer, fsize);
-	ESP_LOGI(TAG, "mbedtls_base64_encode=%d encord_len=%d", ret, encord_len);
+	ESP_LOGI(TAG, "mbedtls_base64_encode=%d encord_len=%zu", ret, encord_len);
 	free(image_buffer);
 	return ret;
 }
@@ -97,7 +111,7 @@ esp_err_t Image2Base64FromRAM(unsigned char * base64_buffer, size_t base64_buffe
 {
 	size_t encord_len;
 	esp_err_t ret = mbedtls_base64_encode(base64_buffer, base64_buffer_len, &encord_len, image_buffer, image_buffer_size);
-	ESP_LOGI(TAG, "mbedtls_base64_encode=%d encord_len=%d", ret, encord_len);
+	ESP_LOGI(TAG, "mbedtls_base64_encode=%d encord_len=%zu", ret, encord_len);
 	return ret;
 }
 
@@ -131,7 +145,7 @@ static esp_err_t root_get_handler(httpd_req_t *req)
 	size_t img_src_buffer_len = base64Size + 1;
 	img_src_buffer = malloc(img_src_buffer_len);
 	if (img_src_buffer == NULL) {
-		ESP_LOGE(TAG, "malloc fail. img_src_buffer_len %d", img_src_buffer_len);
+		ESP_LOGE(TAG, "malloc fail. img_src_buffer_len %zu", img_src_buffer_len);
 	} else {
 		esp_err_t ret = Image2Base64(localFileName, st.st_size, img_src_buffer, img_src_buffer_len);
 		ESP_LOGI(TAG, "Image2Base64=%d", ret);
@@ -163,12 +177,16 @@ static esp_err_t root_get_handler(httpd_req_t *req)
 static esp_err_t root_get_handler_ram(httpd_req_t *req)
 {
 
-	camera_capture_RAM();
+	frame_handle_t *frame = frame_broker_get(0);
+	if (frame == NULL) {
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Camera Capture Failed");
+		return ESP_FAIL;
+	}
 
 	// Handle Show Image
 	ESP_LOGI(TAG, "root_get_handler_ram");
 
-	int32_t base64Size = calcBase64EncodedSize(fb->len);
+	int32_t base64Size = calcBase64EncodedSize(frame->len);
 	ESP_LOGI(TAG, "base64Size=%"PRIi32, base64Size);
 
 	/* Send HTML file header */
@@ -179,9 +197,9 @@ static esp_err_t root_get_handler_ram(httpd_req_t *req)
 	size_t img_src_buffer_len = base64Size + 1;
 	img_src_buffer = malloc(img_src_buffer_len);
 	if (img_src_buffer == NULL) {
-		ESP_LOGE(TAG, "malloc fail. img_src_buffer_len %d", img_src_buffer_len);
+		ESP_LOGE(TAG, "malloc fail. img_src_buffer_len %zu", img_src_buffer_len);
 	} else {
-		esp_err_t ret = Image2Base64FromRAM(img_src_buffer, img_src_buffer_len, fb->buf, fb->len);
+		esp_err_t ret = Image2Base64FromRAM(img_src_buffer, img_src_buffer_len, frame->buf, frame->len);
 		ESP_LOGI(TAG, "Image2Base64=%d", ret);
 		if (ret != 0) {
 			ESP_LOGE(TAG, "Error in mbedtls encode! ret = -0x%x", -ret);
@@ -193,6 +211,7 @@ static esp_err_t root_get_handler_ram(httpd_req_t *req)
 		}
 	}
 	if (img_src_buffer != NULL) free(img_src_buffer);
+	frame_broker_release(frame);
 
 	/* Finish the file list table */
 	httpd_resp_sendstr_chunk(req, "</tbody></table>");
@@ -206,13 +225,526 @@ static esp_err_t root_get_handler_ram(httpd_req_t *req)
 	return ESP_OK;
 }
 
+/* MJPEG live stream
+   Each viewer is served by one of the stream workers through an async request,
+   so the server task keeps handling other requests while the stream runs. */
+#define PART_BOUNDARY "123456789000000000000987654321"
+static const char* _STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
+static const char* _STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
+static const char* _STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n";
+
+static QueueHandle_t xQueueStream;
+static SemaphoreHandle_t xSemaphoreStream;
+
+// Send frames to one viewer until the viewer goes away
+static void stream_frames(httpd_req_t *req)
+{
+	char part_buf[64];
+	const TickType_t interval = pdMS_TO_TICKS(1000 / CONFIG_STREAM_MAX_FPS);
+	TickType_t lastWake = xTaskGetTickCount();
+	uint32_t lastSeq = 0;
+
+	httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
+	httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+	while(1) {
+		// Viewers share frames taken within one frame interval
+		frame_handle_t *frame = frame_broker_get(1000000LL / CONFIG_STREAM_MAX_FPS);
+		if (frame != NULL && frame->seq == lastSeq) {
+			// This viewer has sent that one already
+			frame_broker_release(frame);
+			frame = frame_broker_get(0);
+		}
+		if (frame == NULL) {
+			ESP_LOGE(TAG, "Camera Capture Failed");
+			break;
+		}
+		lastSeq = frame->seq;
+
+		uint8_t *jpg_buf = frame->buf;
+		size_t jpg_len = frame->len;
+		if (frame->format != PIXFORMAT_JPEG) {
+			if (fmt2jpg(frame->buf, frame->len, frame->width, frame->height, frame->format, camera_jpeg_quality(), &jpg_buf, &jpg_len) == false) {
+				ESP_LOGE(TAG, "JPEG compression failed");
+				frame_broker_release(frame);
+				break;
+			}
+		}
+
+		// Send the JPEG straight from the frame buffer
+		esp_err_t ret = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+		if (ret == ESP_OK) {
+			size_t hlen = snprintf(part_buf, sizeof(part_buf), _STREAM_PART, jpg_len);
+			ret = httpd_resp_send_chunk(req, part_buf, hlen);
+		}
+		if (ret == ESP_OK) {
+			ret = httpd_resp_send_chunk(req, (const char *)jpg_buf, jpg_len);
+		}
+
+		if (frame->format != PIXFORMAT_JPEG) free(jpg_buf);
+		frame_broker_release(frame);
+		if (ret != ESP_OK) {
+			ESP_LOGI(TAG, "stream closed");
+			break;
+		}
+
+		// Limit the frame rate
+		vTaskDelayUntil(&lastWake, interval);
+	}
+}
+
+static void stream_worker(void *pvParameters)
+{
+	httpd_req_t *req;
+	while(1) {
+		xQueueReceive(xQueueStream, &req, portMAX_DELAY);
+		ESP_LOGI(TAG, "stream start on socket %d", httpd_req_to_sockfd(req));
+		stream_frames(req);
+		httpd_req_async_handler_complete(req);
+		xSemaphoreGive(xSemaphoreStream);
+	}
+
+	// Never reach here
+	vTaskDelete(NULL);
+}
+
+/* stream handler */
+static esp_err_t stream_handler(httpd_req_t *req)
+{
+	ESP_LOGI(TAG, "stream_handler");
+	if (xSemaphoreTake(xSemaphoreStream, 0) != pdTRUE) {
+		ESP_LOGW(TAG, "too many viewers");
+		httpd_resp_set_status(req, "503 Service Unavailable");
+		httpd_resp_sendstr(req, "Too many viewers");
+		return ESP_OK;
+	}
+
+	// Hand the request over to a stream worker
+	httpd_req_t *async_req;
+	esp_err_t ret = httpd_req_async_handler_begin(req, &async_req);
+	if (ret != ESP_OK) {
+		xSemaphoreGive(xSemaphoreStream);
+		return ret;
+	}
+	xQueueSend(xQueueStream, &async_req, portMAX_DELAY);
+	return ESP_OK;
+}
+
+#if CONFIG_WS_STREAM
+/* WebSocket push channel
+   Every new frame of the broker is pushed to the viewers of /ws as a binary message.
+   Each viewer has its own sender task and holds at most one frame, waiting or being sent,
+   so a slow viewer skips frames instead of holding back the others or the server task.
+   The sender checks that the socket still belongs to the viewer before writing to it,
+   and the server does not close the socket while a send is in progress.
+   Text messages on the same socket control the camera:
+   "shutter", "burst [count] [interval] [quality] [framesize]", "quality N" and "framesize N".
+   With the automated shutter also "fps N" and "interval N" (milliseconds). */
+typedef struct {
+	int fd;                     // Socket of the viewer. -1 when the slot is free
+	uint32_t session;           // Incremented for every viewer of the slot, so a reused socket number is told apart
+	frame_handle_t *pending;    // Frame waiting for the sender
+	bool sending;               // The sender is writing to the socket
+	int64_t lastPush;           // Timestamp of the last frame handed to the sender
+	uint32_t skipped;           // Frames dropped because the viewer was busy
+	char reply[32];             // Answer to a control message. Empty when there is none
+	TaskHandle_t task;
+	SemaphoreHandle_t sendLock; // Held by the sender while it writes to the socket
+} ws_client_t;
+
+static httpd_handle_t wsServer;
+static ws_client_t wsClients[CONFIG_WS_MAX_CLIENTS];
+static portMUX_TYPE wsLock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t wsPumpTask;
+
+// Called by the broker in the capturing task for every new frame
+static void ws_on_frame(frame_handle_t *frame, void *ctx)
+{
+	if (frame->format != PIXFORMAT_JPEG) return;
+	// Allow some jitter, the pump asks for frames at exactly this interval
+	const int64_t interval = 1000000LL / CONFIG_STREAM_MAX_FPS * 3 / 4;
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		ws_client_t *client = &wsClients[i];
+		bool taken = false;
+		frame_broker_retain(frame);
+		taskENTER_CRITICAL(&wsLock);
+		if (client->fd >= 0 && frame->timestamp - client->lastPush >= interval) {
+			// The camera_config.fb_count has one frame buffer per viewer
+			if (client->pending == NULL && !client->sending) {
+				client->pending = frame;
+				client->lastPush = frame->timestamp;
+				taken = true;
+			} else {
+				client->skipped++;
+			}
+		}
+		taskEXIT_CRITICAL(&wsLock);
+		if (taken) {
+			xTaskNotifyGive(client->task);
+		} else {
+			frame_broker_release(frame);
+		}
+	}
+}
+
+// Send the replies and the frames of one viewer
+static void ws_sender(void *pvParameters)
+{
+	ws_client_t *client = (ws_client_t *)pvParameters;
+	char reply[sizeof(client->reply)];
+	while(1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		taskENTER_CRITICAL(&wsLock);
+		int fd = client->fd;
+		uint32_t session = client->session;
+		frame_handle_t *frame = client->pending;
+		client->pending = NULL;
+		client->sending = (frame != NULL);
+		strcpy(reply, client->reply);
+		client->reply[0] = 0;
+		taskEXIT_CRITICAL(&wsLock);
+
+		xSemaphoreTake(client->sendLock, portMAX_DELAY);
+		// Skip the send when the socket was closed, and maybe reused by another client, after it was taken
+		taskENTER_CRITICAL(&wsLock);
+		bool owner = (fd >= 0 && client->fd == fd && client->session == session);
+		taskEXIT_CRITICAL(&wsLock);
+		if (owner) {
+			esp_err_t ret = ESP_OK;
+			httpd_ws_frame_t pkt;
+			memset(&pkt, 0, sizeof(httpd_ws_frame_t));
+			pkt.final = true;
+			if (reply[0] != 0) {
+				pkt.type = HTTPD_WS_TYPE_TEXT;
+				pkt.payload = (uint8_t *)reply;
+				pkt.len = strlen(reply);
+				ret = httpd_ws_send_frame_async(wsServer, fd, &pkt);
+			}
+			if (ret == ESP_OK && frame != NULL) {
+				pkt.type = HTTPD_WS_TYPE_BINARY;
+				pkt.payload = frame->buf;
+				pkt.len = frame->len;
+				ret = httpd_ws_send_frame_async(wsServer, fd, &pkt);
+			}
+			if (ret != ESP_OK) {
+				ESP_LOGI(TAG, "ws viewer on socket %d gone", fd);
+				// Still the socket of this viewer, ws_close waits for the sendLock
+				httpd_sess_trigger_close(wsServer, fd);
+			}
+		}
+		xSemaphoreGive(client->sendLock);
+
+		// Give the frame buffer back before the viewer can take the next one
+		if (frame != NULL) frame_broker_release(frame);
+		taskENTER_CRITICAL(&wsLock);
+		client->sending = false;
+		taskEXIT_CRITICAL(&wsLock);
+	}
+
+	// Never reach here
+	vTaskDelete(NULL);
+}
+
+static int ws_viewers(void)
+{
+	int viewers = 0;
+	taskENTER_CRITICAL(&wsLock);
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		if (wsClients[i].fd >= 0) viewers++;
+	}
+	taskEXIT_CRITICAL(&wsLock);
+	return viewers;
+}
+
+// Take frames while somebody is watching, unless other consumers already do
+static void ws_pump(void *pvParameters)
+{
+	const TickType_t interval = pdMS_TO_TICKS(1000 / CONFIG_STREAM_MAX_FPS);
+	TickType_t lastWake = xTaskGetTickCount();
+	while(1) {
+		if (ws_viewers() == 0) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			lastWake = xTaskGetTickCount();
+			continue;
+		}
+		// A frame taken within the interval was pushed already
+		frame_handle_t *frame = frame_broker_get(1000000LL / CONFIG_STREAM_MAX_FPS);
+		if (frame == NULL) {
+			ESP_LOGE(TAG, "Camera Capture Failed");
+		} else {
+			frame_broker_release(frame);
+		}
+		vTaskDelayUntil(&lastWake, interval);
+	}
+
+	// Never reach here
+	vTaskDelete(NULL);
+}
+
+// Apply a control message. Return false when it is not understood.
+static bool ws_control(const char *text)
+{
+	CMD_t cmdBuf;
+	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
+	burst_default(&cmdBuf);
+	if (strcmp(text, "shutter") == 0 || burst_parse(text, &cmdBuf)) {
+		if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
+			ESP_LOGE(TAG, "xQueueSend fail");
+			return false;
+		}
+		return true;
+	}
+
+#if CONFIG_SHUTTER_AUTO
+	if (acquisition_parse(text)) return true;
+#endif
+
+	sensor_t *s = esp_camera_sensor_get();
+	int value;
+	if (s == NULL) return false;
+	if (sscanf(text, "quality %d", &value) == 1) {
+		if (value < 0 || value > 63) return false;
+		return (s->set_quality(s, value) == 0);
+	}
+	if (sscanf(text, "framesize %d", &value) == 1) {
+		if (value < 0 || value >= FRAMESIZE_INVALID) return false;
+		return (s->set_framesize(s, (framesize_t)value) == 0);
+	}
+	return false;
+}
+
+/* ws handler */
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+	int fd = httpd_req_to_sockfd(req);
+	if (req->method == HTTP_GET) {
+		// Handshake done, the viewer gets frames from now on
+		int slot = -1;
+		taskENTER_CRITICAL(&wsLock);
+		for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+			if (wsClients[i].fd < 0) {
+				slot = i;
+				wsClients[i].fd = fd;
+				wsClients[i].session++;
+				wsClients[i].lastPush = 0;
+				wsClients[i].skipped = 0;
+				wsClients[i].reply[0] = 0;
+				break;
+			}
+		}
+		taskEXIT_CRITICAL(&wsLock);
+		if (slot < 0) {
+			ESP_LOGW(TAG, "too many ws viewers");
+			return ESP_FAIL;
+		}
+		ESP_LOGI(TAG, "ws viewer on socket %d", fd);
+		xTaskNotifyGive(wsPumpTask);
+		return ESP_OK;
+	}
+
+	char text[64];
+	httpd_ws_frame_t pkt;
+	memset(&pkt, 0, sizeof(httpd_ws_frame_t));
+	esp_err_t ret = httpd_ws_recv_frame(req, &pkt, 0);
+	if (ret != ESP_OK) return ret;
+	if (pkt.len >= sizeof(text)) {
+		ESP_LOGW(TAG, "ws message too long %zu", pkt.len);
+		return ESP_FAIL;
+	}
+	pkt.payload = (uint8_t *)text;
+	ret = httpd_ws_recv_frame(req, &pkt, sizeof(text) - 1);
+	if (ret != ESP_OK) return ret;
+	if (pkt.type != HTTPD_WS_TYPE_TEXT) return ESP_OK;
+	text[pkt.len] = 0;
+	ESP_LOGI(TAG, "ws message [%s]", text);
+
+	// The sender of this viewer answers
+	const char *reply = ws_control(text) ? "{\"result\":\"OK\"}" : "{\"result\":\"NG\"}";
+	TaskHandle_t sender = NULL;
+	taskENTER_CRITICAL(&wsLock);
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		if (wsClients[i].fd == fd) {
+			strcpy(wsClients[i].reply, reply);
+			sender = wsClients[i].task;
+		}
+	}
+	taskEXIT_CRITICAL(&wsLock);
+	if (sender != NULL) xTaskNotifyGive(sender);
+	return ESP_OK;
+}
+
+// Called by the server for every socket it closes
+static void ws_close(httpd_handle_t hd, int sockfd)
+{
+	frame_handle_t *frame = NULL;
+	int slot = -1;
+	uint32_t skipped = 0;
+	taskENTER_CRITICAL(&wsLock);
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		if (wsClients[i].fd == sockfd) {
+			slot = i;
+			skipped = wsClients[i].skipped;
+			wsClients[i].fd = -1;
+			frame = wsClients[i].pending;
+			wsClients[i].pending = NULL;
+		}
+	}
+	taskEXIT_CRITICAL(&wsLock);
+	if (slot >= 0) {
+		ESP_LOGI(TAG, "ws viewer on socket %d closed, skipped=%"PRIu32, sockfd, skipped);
+		// Abort a send in progress and wait for it, so the socket number is not reused under the sender
+		shutdown(sockfd, SHUT_RDWR);
+		xSemaphoreTake(wsClients[slot].sendLock, portMAX_DELAY);
+		xSemaphoreGive(wsClients[slot].sendLock);
+	}
+	if (frame != NULL) frame_broker_release(frame);
+	close(sockfd);
+}
+#endif
+
+/* Snapshot of the most recent frame
+   Pollers share the cached frame, a new frame is only taken when the cached one is too old. */
+static SemaphoreHandle_t xSemaphoreSnapshot;
+
+static cached_frame_t *snapshot_get(void)
+{
+	const int64_t maxAge = CONFIG_SNAPSHOT_MAX_AGE_MS * 1000LL;
+	cached_frame_t *frame = frame_cache_get();
+	if (frame != NULL && esp_timer_get_time() - frame->timestamp <= maxAge) return frame;
+
+	// Only one poller takes a picture, the others wait for it
+	xSemaphoreTake(xSemaphoreSnapshot, portMAX_DELAY);
+	if (frame != NULL) frame_cache_release(frame);
+	frame = frame_cache_get();
+	if (frame == NULL || esp_timer_get_time() - frame->timestamp > maxAge) {
+		// A frame another consumer took within maxAge is copied, otherwise a new one is taken
+		frame_handle_t *handle = frame_broker_get(maxAge);
+		if (handle == NULL) {
+			ESP_LOGE(TAG, "Camera Capture Failed");
+		} else {
+			esp_err_t ret = ESP_ERR_NOT_SUPPORTED;
+			if (handle->format == PIXFORMAT_JPEG) ret = frame_cache_put(handle->buf, handle->len, handle->timestamp);
+			frame_broker_release(handle);
+			if (ret == ESP_OK) {
+				if (frame != NULL) frame_cache_release(frame);
+				frame = frame_cache_get();
+			}
+		}
+	}
+	xSemaphoreGive(xSemaphoreSnapshot);
+	return frame;
+}
+
+typedef enum {
+	RANGE_IGNORED,			// Not a single byte range we understand, send the whole picture
+	RANGE_SATISFIABLE,
+	RANGE_UNSATISFIABLE,	// A valid byte range that starts at or past the end
+} range_result_t;
+
+// Parse "bytes=first-last", "bytes=first-" or "bytes=-suffix".
+// Other units, malformed specs and lists of several ranges are ignored, as RFC 9110 allows.
+static range_result_t parse_range(const char *range, size_t len, size_t *first, size_t *last)
+{
+	if (strncasecmp(range, "bytes=", 6) != 0) return RANGE_IGNORED;
+	const char *p = range + 6;
+	char *end;
+	if (*p == '-') {
+		if (!isdigit((unsigned char)p[1])) return RANGE_IGNORED;
+		unsigned long suffix = strtoul(p + 1, &end, 10);
+		if (*end != 0) return RANGE_IGNORED;
+		if (suffix == 0 || len == 0) return RANGE_UNSATISFIABLE;
+		*first = (suffix >= len) ? 0 : len - suffix;
+		*last = len - 1;
+		return RANGE_SATISFIABLE;
+	}
+	if (!isdigit((unsigned char)*p)) return RANGE_IGNORED;
+	unsigned long from = strtoul(p, &end, 10);
+	if (*end != '-') return RANGE_IGNORED;
+	p = end + 1;
+	unsigned long to = ULONG_MAX;
+	if (*p != 0) {
+		if (!isdigit((unsigned char)*p)) return RANGE_IGNORED;
+		to = strtoul(p, &end, 10);
+		// A second range follows, or garbage
+		if (*end != 0 || to < from) return RANGE_IGNORED;
+	}
+	if (from >= len) return RANGE_UNSATISFIABLE;
+	*first = from;
+	*last = (to >= len) ? len - 1 : to;
+	return RANGE_SATISFIABLE;
+}
+
+/* snapshot handler */
+static esp_err_t snapshot_handler(httpd_req_t *req)
+{
+	cached_frame_t *frame = snapshot_get();
+	if (frame == NULL) {
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Camera Capture Failed");
+		return ESP_FAIL;
+	}
+	ESP_LOGD(TAG, "snapshot seq=%"PRIu32" len=%zu", frame->seq, frame->len);
+
+	char etag[16];
+	snprintf(etag, sizeof(etag), "\"%"PRIu32"\"", frame->seq);
+	httpd_resp_set_hdr(req, "ETag", etag);
+	httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+	httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+
+	// Nothing to send when the client has this frame already
+	char value[64];
+	if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) == ESP_OK
+		&& strcmp(value, etag) == 0) {
+		httpd_resp_set_status(req, "304 Not Modified");
+		httpd_resp_send(req, NULL, 0);
+		frame_cache_release(frame);
+		return ESP_OK;
+	}
+
+	httpd_resp_set_type(req, "image/jpeg");
+	size_t first = 0;
+	size_t last = frame->len - 1;
+	char content_range[48];
+	if (httpd_req_get_hdr_value_str(req, "Range", value, sizeof(value)) == ESP_OK) {
+		range_result_t range = parse_range(value, frame->len, &first, &last);
+		if (range == RANGE_SATISFIABLE) {
+			snprintf(content_range, sizeof(content_range), "bytes %zu-%zu/%zu", first, last, frame->len);
+			httpd_resp_set_status(req, "206 Partial Content");
+			httpd_resp_set_hdr(req, "Content-Range", content_range);
+		} else if (range == RANGE_UNSATISFIABLE) {
+			snprintf(content_range, sizeof(content_range), "bytes */%zu", frame->len);
+			httpd_resp_set_status(req, "416 Range Not Satisfiable");
+			httpd_resp_set_hdr(req, "Content-Range", content_range);
+			httpd_resp_send(req, NULL, 0);
+			frame_cache_release(frame);
+			return ESP_OK;
+		}
+	}
+
+	// Send the cached JPEG bytes as they are
+	esp_err_t ret = httpd_resp_send(req, (const char *)frame->buf + first, last - first + 1);
+	frame_cache_release(frame);
+	return ret;
+}
+
 #if CONFIG_SHUTTER_HTTP
 /* shutter handler */
 static esp_err_t shutter_handler(httpd_req_t *req)
 {
     CMD_t cmdBuf;
     cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-    cmdBuf.command = CMD_TAKE;
+    burst_default(&cmdBuf);
+
+    // ?count=5&interval=100&quality=10&framesize=8 asks for a burst
+    char query[128];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        int value[4] = { cmdBuf.burst.count, cmdBuf.burst.interval, -1, -1 };
+        const char *keys[4] = { "count", "interval", "quality", "framesize" };
+        char param[16];
+        for (int i = 0; i < 4; i++) {
+            if (httpd_query_key_value(query, keys[i], param, sizeof(param)) == ESP_OK) value[i] = atoi(param);
+        }
+        burst_set(&cmdBuf, value[0], value[1], value[2], value[3]);
+        ESP_LOGI(TAG, "count=%d interval=%d quality=%d framesize=%d", value[0], value[1], value[2], value[3]);
+    }
     if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
         ESP_LOGE(TAG, "xQueueSend fail");
     } else {
@@ -228,6 +760,47 @@ static esp_err_t shutter_handler(httpd_req_t *req)
 }
 #endif
 
+#if CONFIG_SHUTTER_AUTO
+/* acquisition handler
+   ?fps=N or ?interval=N (milliseconds) changes the rate of the automated shutter */
+static esp_err_t acquisition_handler(httpd_req_t *req)
+{
+	char query[64];
+	char param[16];
+	char text[32] = "";
+	if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+		if (httpd_query_key_value(query, "fps", param, sizeof(param)) == ESP_OK) {
+			snprintf(text, sizeof(text), "fps %s", param);
+		} else if (httpd_query_key_value(query, "interval", param, sizeof(param)) == ESP_OK) {
+			snprintf(text, sizeof(text), "interval %s", param);
+		}
+	}
+	const char *reply = acquisition_parse(text) ? "{\"result\":\"OK\"}" : "{\"result\":\"NG\"}";
+	httpd_resp_set_type(req, "application/json");
+	return httpd_resp_send(req, reply, HTTPD_RESP_USE_STRLEN);
+}
+#endif
+
+
+/* Prometheus metrics handler */
+#define METRICS_BUFFER_SIZE 6144
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+	char *buf = malloc(METRICS_BUFFER_SIZE);
+	if (buf == NULL) {
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+		return ESP_FAIL;
+	}
+	size_t len = frame_trace_metrics(buf, METRICS_BUFFER_SIZE);
+#if CONFIG_SHUTTER_AUTO
+	len += acquisition_metrics(buf + len, METRICS_BUFFER_SIZE - len);
+#endif
+	httpd_resp_set_type(req, "text/plain; version=0.0.4");
+	httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+	esp_err_t ret = httpd_resp_send(req, buf, len);
+	free(buf);
+	return ret;
+}
 
 /* favicon get handler */
 static esp_err_t favicon_get_handler(httpd_req_t *req)
@@ -246,6 +819,10 @@ esp_err_t start_server(int port)
 	config.lru_purge_enable = true;
 	// TCP Port number for receiving and transmitting HTTP traffic
 	config.server_port = port;
+#if CONFIG_WS_STREAM
+	// Free the slot of a WebSocket viewer with its socket
+	config.close_fn = ws_close;
+#endif
 
 	// Start the httpd server
 	//ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
@@ -254,6 +831,34 @@ esp_err_t start_server(int port)
 		return ESP_FAIL;
 	}
 
+	// Create stream workers
+	xQueueStream = xQueueCreate( CONFIG_STREAM_MAX_CLIENTS, sizeof(httpd_req_t *) );
+	configASSERT( xQueueStream );
+	xSemaphoreStream = xSemaphoreCreateCounting( CONFIG_STREAM_MAX_CLIENTS, CONFIG_STREAM_MAX_CLIENTS );
+	configASSERT( xSemaphoreStream );
+	for (int i = 0; i < CONFIG_STREAM_MAX_CLIENTS; i++) {
+		xTaskCreate(stream_worker, "STREAM", 1024*4, NULL, 2, NULL);
+	}
+
+	xSemaphoreSnapshot = xSemaphoreCreateMutex();
+	configASSERT( xSemaphoreSnapshot );
+
+#if CONFIG_WS_STREAM
+	// Create WebSocket senders
+	wsServer = server;
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		wsClients[i].fd = -1;
+		wsClients[i].session = 0;
+		wsClients[i].pending = NULL;
+		wsClients[i].sending = false;
+		wsClients[i].sendLock = xSemaphoreCreateMutex();
+		configASSERT( wsClients[i].sendLock );
+		xTaskCreate(ws_sender, "WS", 1024*3, &wsClients[i], 2, &wsClients[i].task);
+	}
+	xTaskCreate(ws_pump, "WSPUMP", 1024*3, NULL, 2, &wsPumpTask);
+	ESP_ERROR_CHECK(frame_broker_subscribe(ws_on_frame, NULL));
+#endif
+
 	// Set URI handlers
 	httpd_uri_t _root_get_handler = {
 		.uri		 = "/",
@@ -263,6 +868,37 @@ esp_err_t start_server(int port)
 	};
 	httpd_register_uri_handler(server, &_root_get_handler);
 
+	httpd_uri_t _stream_handler = {
+		.uri		 = "/stream",
+		.method		 = HTTP_GET,
+		.handler	 = stream_handler,
+	};
+	httpd_register_uri_handler(server, &_stream_handler);
+
+	httpd_uri_t _snapshot_handler = {
+		.uri		 = "/snapshot.jpg",
+		.method		 = HTTP_GET,
+		.handler	 = snapshot_handler,
+	};
+	httpd_register_uri_handler(server, &_snapshot_handler);
+
+	httpd_uri_t _metrics_handler = {
+		.uri		 = "/metrics",
+		.method		 = HTTP_GET,
+		.handler	 = metrics_handler,
+	};
+	httpd_register_uri_handler(server, &_metrics_handler);
+
+#if CONFIG_WS_STREAM
+	httpd_uri_t _ws_handler = {
+		.uri		 = "/ws",
+		.method		 = HTTP_GET,
+		.handler	 = ws_handler,
+		.is_websocket = true
+	};
+	httpd_register_uri_handler(server, &_ws_handler);
+#endif
+
 #if CONFIG_SHUTTER_HTTP
 	httpd_uri_t _shutter_handler = {
 		.uri		 = CONFIG_SHUTTER_URL,
@@ -273,6 +909,15 @@ esp_err_t start_server(int port)
 	httpd_register_uri_handler(server, &_shutter_handler);
 #endif
 
+#if CONFIG_SHUTTER_AUTO
+	httpd_uri_t _acquisition_handler = {
+		.uri		 = "/acquisition",
+		.method		 = HTTP_GET,
+		.handler	 = acquisition_handler,
+	};
+	httpd_register_uri_handler(server, &_acquisition_handler);
+#endif
+
 	httpd_uri_t _favicon_get_handler = {
 		.uri		 = "/favicon.ico",
 		.method		 = HTTP_GET,
@@ -7,6 +7,7 @@
 #include "freertos/queue.h"
 #include "esp_log.h"
 #include "cmd.h"
+#include "burst.h"
 
 #if CONFIG_SHUTTER_ENTER
 extern QueueHandle_t xQueueCmd;
@@ -18,7 +19,7 @@ void keyin(void *pvParameters)
 	ESP_LOGI(TAG, "Start");
 	CMD_t cmdBuf;
 	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	cmdBuf.command = CMD_TAKE;
+	burst_default(&cmdBuf);
 
 	uint16_t c;
 	while (1) {
@@ -21,9 +21,11 @@
 #include "freertos/queue.h"
 #include "freertos/event_groups.h"
 #include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#if !CONFIG_IDF_TARGET_LINUX
 #include "esp_wifi.h"
 #include "esp_event.h"
-#include "esp_log.h"
 #include "nvs_flash.h"
 #include "esp_vfs.h"
 #include "esp_spiffs.h"
@@ -31,12 +33,32 @@
 #include "mdns.h"
 #include "lwip/dns.h"
 #include "driver/gpio.h"
+#endif
 
 
 #include "camera_helpers.h"
 
 #include "cmd.h"
+#include "pipeline.h"
+#include "frame_broker.h"
+#include "frame_cache.h"
+#include "frame_store.h"
+#include "frame_trace.h"
+#include "burst.h"
+#include "rate_control.h"
+#include "change_detect.h"
+#if CONFIG_SHUTTER_AUTO
+#include "auto_acquisition.h"
+#endif
+
+static const char *TAG = "MAIN";
+
+QueueHandle_t xQueueCmd;
+QueueHandle_t xQueueHttp;
+QueueHandle_t xQueueRequest;
 
+// The host build (host_test) runs on a machine that is already online
+#if !CONFIG_IDF_TARGET_LINUX
 #if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0))
 #define sntp_setoperatingmode esp_sntp_setoperatingmode
 #define sntp_setservername esp_sntp_setservername
@@ -51,14 +73,8 @@ static EventGroupHandle_t s_wifi_event_group;
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT BIT1
 
-static const char *TAG = "MAIN";
-
 static int s_retry_num = 0;
 
-QueueHandle_t xQueueCmd;
-QueueHandle_t xQueueHttp;
-QueueHandle_t xQueueRequest;
-
 
 static void event_handler(void* arg, esp_event_base_t event_base,
 								int32_t event_id, void* event_data)
@@ -212,7 +228,7 @@ esp_err_t mountSPIFFS(char * partition_label, char * base_path) {
 	if (ret != ESP_OK) {
 		ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
 	} else {
-		ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+		ESP_LOGI(TAG, "Partition size: total: %zu, used: %zu", total, used);
 	}
 	ESP_LOGI(TAG, "Mount SPIFFS filesystem");
 	return ret;
@@ -251,6 +267,7 @@ static esp_err_t obtain_time(void)
 	return ESP_OK;
 }
 #endif
+#endif // !CONFIG_IDF_TARGET_LINUX
 
 void http_post_task(void *pvParameters);
 
@@ -276,8 +293,32 @@ void auto_shutter(void *pvParameters);
 
 void http_task(void *pvParameters);
 
+#if !CONFIG_PIPELINE_UPLOAD
+// Hand a picture to http_post_task and wait for the upload
+static void post_request(REQUEST_t *requestBuf)
+{
+	if (xQueueSend(xQueueRequest, requestBuf, 10) != pdPASS) {
+		ESP_LOGE(TAG, "xQueueSend fail");
+		if (requestBuf->frame != NULL) frame_broker_release(requestBuf->frame);
+	} else {
+		uint32_t value = ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+		ESP_LOGI(TAG, "ulTaskNotifyTake value=%"PRIx32, value);
+	}
+}
+#endif
+
+#if CONFIG_UPLOAD_FROM_RAM && !CONFIG_PIPELINE_UPLOAD
+// Pictures of a burst waiting for upload, one per reserved frame buffer.
+// A longer runtime burst is uploaded in groups of this size.
+#define BURST_HELD_FRAMES CONFIG_BURST_COUNT
+static REQUEST_t heldRequests[BURST_HELD_FRAMES];
+#endif
+
 void app_main(void)
 {
+#if CONFIG_IDF_TARGET_LINUX
+	esp_err_t ret;
+#else
 	// Initialize NVS
 	esp_err_t ret = nvs_flash_init();
 	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -291,8 +332,10 @@ void app_main(void)
 
 	// Initialize mDNS
 	// initialise_mdns();
+#endif
 
 #if CONFIG_REMOTE_IS_VARIABLE_NAME
+#if !CONFIG_IDF_TARGET_LINUX
 	// obtain time over NTP
 	ESP_LOGI(TAG, "Connecting to WiFi and getting time over NTP.");
 	ret = obtain_time();
@@ -300,6 +343,7 @@ void app_main(void)
 		ESP_LOGE(TAG, "Fail to getting time over NTP.");
 		return;
 	}
+#endif
 
 	// update 'now' variable with current time
 	time_t now;
@@ -312,12 +356,17 @@ void app_main(void)
 	ESP_LOGI(TAG, "The current date/time is: %s", strftime_buf);
 #endif
 
+#if CONFIG_IDF_TARGET_LINUX
+	// Local files go to the host file system
+	char *base_path = "/tmp";
+#else
 	// Initialize SPIFFS
 	ESP_LOGI(TAG, "Initializing SPIFFS");
 	char *partition_label = "storage";
 	char *base_path = "/spiffs";
 	ret = mountSPIFFS(partition_label, base_path);
 	if (ret != ESP_OK) return;
+#endif
 
 #if CONFIG_ENABLE_FLASH
 	// Enable Flash Light
@@ -330,13 +379,37 @@ void app_main(void)
 	/* Create Queue */
 	xQueueCmd = xQueueCreate( 1, sizeof(CMD_t) );
 	configASSERT( xQueueCmd );
+#if CONFIG_PIPELINE_UPLOAD
+	xQueueRequest = xQueueCreate( CONFIG_PIPELINE_DEPTH, sizeof(REQUEST_t) );
+#else
 	xQueueRequest = xQueueCreate( 1, sizeof(REQUEST_t) );
+#endif
 	configASSERT( xQueueRequest );
+	pipeline_init(xQueueRequest);
 	xQueueHttp = xQueueCreate( 10, sizeof(HTTP_t) );
 	configASSERT( xQueueHttp );
 
+	/* Share captured frames between all consumers */
+	ESP_ERROR_CHECK(frame_broker_init());
+
+	/* Time every frame from the shutter to the server for /metrics */
+	frame_trace_init();
+
+	/* Keep a copy of the latest frame for the built-in WEB server */
+	frame_cache_init();
+
+#if CONFIG_FRAME_STORE
+	/* Keep frames on flash while the server is unreachable */
+	ESP_ERROR_CHECK(frame_store_init(CONFIG_FRAME_STORE_PARTITION));
+#endif
+
 	/* Create HTTP Client Task */
-	xTaskCreate(&http_post_task, "POST", 4096, NULL, 5, NULL);
+	xTaskCreate(&http_post_task, "POST", 1024*6, NULL, 5, NULL);
+
+#if CONFIG_FRAME_STORE
+	/* Create Drain Task */
+	xTaskCreate(&frame_store_drain_task, "DRAIN", 4096, NULL, 4, NULL);
+#endif
 
 	/* Create Shutter Task */
 #if CONFIG_SHUTTER_ENTER
@@ -368,14 +441,17 @@ void app_main(void)
 	xTaskCreate(auto_shutter, "auto", 1024*4, NULL, 2, NULL);
 #endif
 
+	/* Create HTTP Task */
+	char cparam0[64];
+#if CONFIG_IDF_TARGET_LINUX
+	strcpy(cparam0, "127.0.0.1");
+#else
 	/* Get the local IP address */
 	esp_netif_ip_info_t ip_info;
 	ESP_ERROR_CHECK(esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_STA_DEF"), &ip_info));
-
-	/* Create HTTP Task */
-	char cparam0[64];
 	//sprintf(cparam0, "%s", ip4addr_ntoa(&ip_info.ip));
 	sprintf(cparam0, IPSTR, IP2STR(&ip_info.ip));
+#endif
 	ESP_LOGI(TAG, "cparam0=[%s]", cparam0);
 	xTaskCreate(http_task, "HTTP", 1024*6, (void *)cparam0, 2, NULL);
 
@@ -404,10 +480,21 @@ void app_main(void)
 		while(1) { vTaskDelay(1); }
 	}
 
+#if CONFIG_RATE_CONTROL
+	/* Create Rate Control Task */
+	xTaskCreate(rate_control_task, "RATE", 1024*3, NULL, 2, NULL);
+#endif
 
 	REQUEST_t requestBuf;
 	requestBuf.command = CMD_SEND;
+	requestBuf.frame = NULL;
+	requestBuf.storeSeq = 0;
+#if CONFIG_PIPELINE_UPLOAD
+	// Don't wait for http_post_task
+	requestBuf.taskHandle = NULL;
+#else
 	requestBuf.taskHandle = xTaskGetCurrentTaskHandle();
+#endif
 	//sprintf(requestBuf.localFileName, "%s/picture.jpg", base_path);
 	snprintf(requestBuf.localFileName, sizeof(requestBuf.localFileName)-1, "%s/picture.jpg", base_path);
 	ESP_LOGI(TAG, "localFileName=%s",requestBuf.localFileName);
@@ -432,85 +519,146 @@ void app_main(void)
 	httpBuf.taskHandle = xTaskGetCurrentTaskHandle();
 	strcpy(httpBuf.localFileName, requestBuf.localFileName);
 	CMD_t cmdBuf;
+#if CONFIG_REMOTE_IS_FIXED_NAME
+	// The pictures of a burst are numbered from this name
+	char fixedFileName[64];
+	strcpy(fixedFileName, requestBuf.remoteFileName);
+#endif
 
 	while(1) {
 		ESP_LOGI(TAG,"Waitting %s ....", SHUTTER);
 		xQueueReceive(xQueueCmd, &cmdBuf, portMAX_DELAY);
 		ESP_LOGI(TAG,"cmdBuf.command=%d", cmdBuf.command);
 		if (cmdBuf.command == CMD_HALT) break;
+#if CONFIG_SHUTTER_AUTO
+		int64_t startTime = esp_timer_get_time();
+#endif
 
-		// Delete local file
-		struct stat statBuf;
-		if (stat(requestBuf.localFileName, &statBuf) == 0) {
-			// Delete it if it exists
-			unlink(requestBuf.localFileName);
+		// A burst takes all its pictures before waiting for any upload
+		int frames = 1;
+		TickType_t interval = 0;
+		BURST_t saved;
+		if (cmdBuf.command == CMD_BURST) {
+			frames = cmdBuf.burst.count;
+			interval = pdMS_TO_TICKS(cmdBuf.burst.interval);
+			burst_begin(&cmdBuf.burst, &saved);
 		}
+#if CONFIG_UPLOAD_FROM_RAM && !CONFIG_PIPELINE_UPLOAD
+		int held = 0;
+#endif
+		TickType_t lastWake = xTaskGetTickCount();
+
+		for (int frame = 0; frame < frames; frame++) {
+			if (frame > 0 && interval > 0) vTaskDelayUntil(&lastWake, interval);
+			frame_trace_start(&requestBuf.trace);
+
+#if !CONFIG_UPLOAD_FROM_RAM
+			// Delete local file
+			struct stat statBuf;
+			if (stat(requestBuf.localFileName, &statBuf) == 0) {
+				// Delete it if it exists
+				unlink(requestBuf.localFileName);
+			}
+#endif
 
 #if CONFIG_REMOTE_IS_VARIABLE_NAME
-		time(&now);
-		now = now + (CONFIG_LOCAL_TIMEZONE*60*60);
-		localtime_r(&now, &timeinfo);
-		strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-		ESP_LOGI(TAG, "The current date/time is: %s", strftime_buf);
+			time(&now);
+			now = now + (CONFIG_LOCAL_TIMEZONE*60*60);
+			localtime_r(&now, &timeinfo);
+			strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
+			ESP_LOGI(TAG, "The current date/time is: %s", strftime_buf);
 #if CONFIG_REMOTE_FRAMESIZE
-		// 20220927-110940_640x480.jpg
-		sprintf(requestBuf.remoteFileName, "%04d%02d%02d-%02d%02d%02d_%s.jpg",
-		(timeinfo.tm_year+1900),(timeinfo.tm_mon+1),timeinfo.tm_mday,
-		timeinfo.tm_hour,timeinfo.tm_min,timeinfo.tm_sec, FRAMESIZE_STRING);
+			// 20220927-110940_640x480.jpg
+			sprintf(requestBuf.remoteFileName, "%04d%02d%02d-%02d%02d%02d_%s.jpg",
+			(timeinfo.tm_year+1900),(timeinfo.tm_mon+1),timeinfo.tm_mday,
+			timeinfo.tm_hour,timeinfo.tm_min,timeinfo.tm_sec, FRAMESIZE_STRING);
 #else
-		// 20220927-110742.jpg
-		sprintf(requestBuf.remoteFileName, "%04d%02d%02d-%02d%02d%02d.jpg",
-		(timeinfo.tm_year+1900),(timeinfo.tm_mon+1),timeinfo.tm_mday,
-		timeinfo.tm_hour,timeinfo.tm_min,timeinfo.tm_sec);
+			// 20220927-110742.jpg
+			sprintf(requestBuf.remoteFileName, "%04d%02d%02d-%02d%02d%02d.jpg",
+			(timeinfo.tm_year+1900),(timeinfo.tm_mon+1),timeinfo.tm_mday,
+			timeinfo.tm_hour,timeinfo.tm_min,timeinfo.tm_sec);
 #endif
-		ESP_LOGI(TAG, "remoteFileName: %s", requestBuf.remoteFileName);
+			ESP_LOGI(TAG, "remoteFileName: %s", requestBuf.remoteFileName);
+#else
+			strcpy(requestBuf.remoteFileName, fixedFileName);
 #endif
+			if (frames > 1) burst_file_name(requestBuf.remoteFileName, frame + 1);
 
 #if CONFIG_ENABLE_FLASH
-		// Flash Light ON
-		gpio_set_level(CONFIG_GPIO_FLASH, 1);
-#endif
-
-		// // Save Picture to Local file
-		// int retryCounter = 0;
-		// while(1) {
-		// 	// if (cmdBuf.command != CMD_TAKE) break;
-
-		// 	// ret = camera_capture(requestBuf.localFileName, &pictureSize);
-		// 	ret = camera_capture_RAM();
-			
-		// 	size_t pictureSize = fb->len;
-
-		// 	ESP_LOGI(TAG, "camera_capture=%d",ret);
-		// 	ESP_LOGI(TAG, "pictureSize=%d",fb->len);
-		// 	if (ret != ESP_OK) continue;
-		// 	else break;
-		// 	// struct stat statBuf;
-		// 	// if (stat(requestBuf.localFileName, &statBuf) == 0) {
-		// 	// 	ESP_LOGI(TAG, "st_size=%d", (int)statBuf.st_size);
-		// 	// 	if (statBuf.st_size == pictureSize) break;
-		// 	// 	retryCounter++;
-		// 	// 	ESP_LOGI(TAG, "Retry capture %d",retryCounter);
-		// 	// 	if (retryCounter > 10) {
-		// 	// 		ESP_LOGE(TAG, "Retry over for capture");
-		// 	// 		break;
-		// 	// 	}
-		// 	// 	vTaskDelay(1000);
-		// 	// }
-		// } // end while
+			// Flash Light ON
+			gpio_set_level(CONFIG_GPIO_FLASH, 1);
+#endif
 
-#if CONFIG_ENABLE_FLASH
-		// Flash Light OFF
-		gpio_set_level(CONFIG_GPIO_FLASH, 0);
+#if CONFIG_UPLOAD_FROM_RAM
+			// Keep the frame until http_post_task has sent it
+			requestBuf.frame = frame_broker_get(0);
+			if (requestBuf.frame == NULL) {
+				ESP_LOGE(TAG, "Camera Capture Failed");
+				ret = ESP_FAIL;
+			} else {
+				ESP_LOGI(TAG, "pictureSize=%zu", requestBuf.frame->len);
+				frame_trace_mark(&requestBuf.trace, TRACE_FB_GET);
+				ret = frame_broker_check(requestBuf.frame);
+				if (ret == ESP_OK) {
+					frame_trace_mark(&requestBuf.trace, TRACE_VALIDATED);
+				} else {
+					ESP_LOGE(TAG, "Frame without SOI/EOI");
+					frame_trace_count(TRACE_INVALID);
+					frame_broker_release(requestBuf.frame);
+				}
+#if CONFIG_CHANGE_DETECT
+				if (ret == ESP_OK && !change_detect_check(requestBuf.frame)) {
+					// Nothing moved since the last frames
+					frame_trace_count(TRACE_UNCHANGED);
+					frame_broker_release(requestBuf.frame);
+					ret = ESP_ERR_NOT_FINISHED;
+				}
+#endif
+			}
+#else
+			// Save Picture to Local file
+			size_t pictureSize;
+			requestBuf.frame = NULL;
+			ret = camera_capture(requestBuf.localFileName, &pictureSize);
+			ESP_LOGI(TAG, "camera_capture=%d pictureSize=%zu", ret, pictureSize);
+			frame_trace_mark(&requestBuf.trace, TRACE_FB_GET);
 #endif
 
-		// Send HTTP Request
-		if (xQueueSend(xQueueRequest, &requestBuf, 10) != pdPASS) {
-			ESP_LOGE(TAG, "xQueueSend fail");
-		} else {
-			uint32_t value = ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
-			ESP_LOGI(TAG, "ulTaskNotifyTake value=%"PRIx32, value);
+#if CONFIG_ENABLE_FLASH
+			// Flash Light OFF
+			gpio_set_level(CONFIG_GPIO_FLASH, 0);
+#endif
+			if (ret != ESP_OK) continue;
+
+			// Send HTTP Request
+#if CONFIG_PIPELINE_UPLOAD
+			pipeline_push(&requestBuf);
+			pipeline_stats_t stats;
+			pipeline_get_stats(&stats);
+			ESP_LOGI(TAG, "queued=%"PRIu32" dropped=%"PRIu32" uploaded=%"PRIu32" failed=%"PRIu32" stored=%"PRIu32" pending=%d",
+				stats.queued, stats.dropped, stats.uploaded, stats.failed, stats.stored, (int)pipeline_depth());
+#elif CONFIG_UPLOAD_FROM_RAM
+			// Hold the pictures in the frame buffers reserved for bursts, then upload them
+			heldRequests[held++] = requestBuf;
+			if (held == BURST_HELD_FRAMES || frame == frames - 1) {
+				for (int i = 0; i < held; i++) post_request(&heldRequests[i]);
+				held = 0;
+			}
+#else
+			// All pictures go through the same local file
+			post_request(&requestBuf);
+#endif
 		}
+#if CONFIG_UPLOAD_FROM_RAM && !CONFIG_PIPELINE_UPLOAD
+		// The last picture of the burst may have failed
+		for (int i = 0; i < held; i++) post_request(&heldRequests[i]);
+#endif
+		if (cmdBuf.command == CMD_BURST) burst_end(&saved);
+
+#if CONFIG_SHUTTER_AUTO
+		// Let the scheduler adapt its interval to what this loop can sustain
+		acquisition_report_latency(esp_timer_get_time() - startTime);
+#endif
 
 		// send local file name to http task
 		if (xQueueSend(xQueueHttp, &httpBuf, 10) != pdPASS) {
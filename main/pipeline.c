@@ -0,0 +1,106 @@
+/*
+   Ring of pending frames between the shutter loop and http_post_task.
+
+   The shutter loop puts each captured frame into the ring and goes on
+   with the next capture, while http_post_task uploads the frames in order.
+   What happens when the ring is full is selected in menuconfig.
+*/
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+#include "pipeline.h"
+#if CONFIG_FRAME_STORE
+#include "frame_store.h"
+#endif
+
+static const char *TAG = "PIPELINE";
+
+static QueueHandle_t ringQueue;
+static pipeline_stats_t stats;
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+
+void pipeline_init(QueueHandle_t queue)
+{
+	ringQueue = queue;
+	ESP_LOGI(TAG, "ring depth=%d", (int)(uxQueueMessagesWaiting(ringQueue) + uxQueueSpacesAvailable(ringQueue)));
+}
+
+// Release the frame of a dropped request
+static void pipeline_drop(REQUEST_t *request)
+{
+	if (request->frame != NULL) {
+		frame_broker_release(request->frame);
+		request->frame = NULL;
+	}
+#if CONFIG_FRAME_STORE
+	// The record stays in the store, the drain task sends it again
+	if (request->storeSeq != 0) frame_store_done(request->storeSeq, ESP_FAIL);
+#endif
+	portENTER_CRITICAL(&statsLock);
+	stats.dropped++;
+	portEXIT_CRITICAL(&statsLock);
+}
+
+// Put a request into the ring, applying the policy for a full ring.
+// Return ESP_FAIL when the request was dropped.
+esp_err_t pipeline_push(REQUEST_t *request)
+{
+#if CONFIG_PIPELINE_BLOCK
+	xQueueSend(ringQueue, request, portMAX_DELAY);
+#elif CONFIG_PIPELINE_DROP_NEWEST
+	if (xQueueSend(ringQueue, request, 0) != pdPASS) {
+		ESP_LOGW(TAG, "ring is full, drop newest frame");
+		pipeline_drop(request);
+		return ESP_FAIL;
+	}
+#else // CONFIG_PIPELINE_DROP_OLDEST
+	while (xQueueSend(ringQueue, request, 0) != pdPASS) {
+		// http_post_task may take the oldest one at the same time
+		REQUEST_t oldest;
+		if (xQueueReceive(ringQueue, &oldest, 0) == pdTRUE) {
+			ESP_LOGW(TAG, "ring is full, drop oldest frame [%s]", oldest.remoteFileName);
+			pipeline_drop(&oldest);
+		}
+	}
+#endif
+	portENTER_CRITICAL(&statsLock);
+	stats.queued++;
+	portEXIT_CRITICAL(&statsLock);
+	return ESP_OK;
+}
+
+// Called by http_post_task when a frame has been sent
+void pipeline_uploaded(uint32_t result)
+{
+	portENTER_CRITICAL(&statsLock);
+	if (result == 0) {
+		stats.uploaded++;
+	} else {
+		stats.failed++;
+	}
+	portEXIT_CRITICAL(&statsLock);
+}
+
+// Called by http_post_task when a frame went to the frame store instead
+void pipeline_stored(void)
+{
+	portENTER_CRITICAL(&statsLock);
+	stats.stored++;
+	portEXIT_CRITICAL(&statsLock);
+}
+
+void pipeline_get_stats(pipeline_stats_t *out)
+{
+	portENTER_CRITICAL(&statsLock);
+	*out = stats;
+	portEXIT_CRITICAL(&statsLock);
+}
+
+// Number of frames waiting for upload
+UBaseType_t pipeline_depth(void)
+{
+	return uxQueueMessagesWaiting(ringQueue);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "cmd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Frame counters of the capture/upload pipeline
+typedef struct {
+    uint32_t queued;    // Frames put into the ring
+    uint32_t dropped;   // Frames dropped because the ring was full
+    uint32_t uploaded;  // Frames the server accepted
+    uint32_t failed;    // Frames the upload failed for
+    uint32_t stored;    // Frames queued in the frame store behind its backlog
+} pipeline_stats_t;
+
+// Function prototypes
+void pipeline_init(QueueHandle_t queue);
+esp_err_t pipeline_push(REQUEST_t *request);
+void pipeline_uploaded(uint32_t result);
+void pipeline_stored(void);
+void pipeline_get_stats(pipeline_stats_t *stats);
+UBaseType_t pipeline_depth(void);
+
+#ifdef __cplusplus
+}
+#endif
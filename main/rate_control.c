@@ -0,0 +1,179 @@
+/*
+   Bandwidth-adaptive JPEG quality and frame size.
+
+   http_post_task reports the bytes and the time of every upload. Once a
+   second the controller compares the upload throughput with what the
+   target frame rate needs at the current frame size, and looks at the
+   frames waiting for upload. When the uploads can't keep up, the JPEG
+   quality number goes up in large steps; when there is bandwidth to spare,
+   it comes back down one at a time. At the worst quality the frame size
+   goes down a step, with hysteresis, and it never goes above the frame
+   size the camera was started with.
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_camera.h"
+
+#include "rate_control.h"
+#include "pipeline.h"
+
+#if CONFIG_RATE_CONTROL
+static const char *TAG = "RATE";
+
+#define RATE_PERIOD_MS 1000
+#define RATE_QUALITY_UP 4        // Quality steps when congested
+#define RATE_QUALITY_DOWN 1      // Quality steps with bandwidth to spare
+#define RATE_HOLD_DOWN 3         // Congested periods at the worst quality before a smaller frame size
+#define RATE_HOLD_UP 10          // Spare periods at the best quality before a larger frame size
+#define RATE_HEADROOM 1.5        // Throughput over demand that counts as spare
+
+// Frame sizes to step through, from small to large
+static const framesize_t framesizes[] = {
+	FRAMESIZE_QVGA, FRAMESIZE_VGA, FRAMESIZE_SVGA, FRAMESIZE_XGA, FRAMESIZE_HD, FRAMESIZE_SXGA, FRAMESIZE_UXGA
+};
+#define FRAMESIZE_STEPS (sizeof(framesizes) / sizeof(framesizes[0]))
+
+static uint32_t periodBytes;
+static uint32_t periodFrames;
+static int64_t periodBusy;
+static portMUX_TYPE rateLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Called by http_post_task for every successful request
+void rate_control_report(size_t bytes, int frames, int64_t upload_us)
+{
+	taskENTER_CRITICAL(&rateLock);
+	periodBytes += bytes;
+	periodFrames += frames;
+	periodBusy += upload_us;
+	taskEXIT_CRITICAL(&rateLock);
+}
+
+// Index of the largest step not above the frame size
+static int framesize_step(framesize_t framesize)
+{
+	int step = 0;
+	for (int i = 0; i < FRAMESIZE_STEPS; i++) {
+		if (framesizes[i] <= framesize) step = i;
+	}
+	return step;
+}
+
+void rate_control_task(void *pvParameters)
+{
+	sensor_t *sensor = esp_camera_sensor_get();
+	if (sensor == NULL) {
+		ESP_LOGE(TAG, "No camera sensor");
+		vTaskDelete(NULL);
+	}
+
+	int best = CONFIG_RATE_QUALITY_BEST;
+	int worst = CONFIG_RATE_QUALITY_WORST;
+	if (worst < best) {
+		best = CONFIG_RATE_QUALITY_WORST;
+		worst = CONFIG_RATE_QUALITY_BEST;
+	}
+	int quality = sensor->status.quality;
+	if (quality < best) quality = best;
+	if (quality > worst) quality = worst;
+	sensor->set_quality(sensor, quality);
+	int maxStep = framesize_step(sensor->status.framesize);
+	int step = maxStep;
+	ESP_LOGI(TAG, "quality=%d framesize=%d target=%dfps", quality, framesizes[step], CONFIG_RATE_TARGET_FPS);
+
+	double capacity = 0;    // Bytes per second while uploading
+	double frameBytes = 0;  // Average frame size
+	double latency = 0;     // Average upload time of a frame in microseconds
+	int congestedPeriods = 0;
+	int sparePeriods = 0;
+	pipeline_stats_t last;
+	pipeline_get_stats(&last);
+
+	while(1) {
+		vTaskDelay(pdMS_TO_TICKS(RATE_PERIOD_MS));
+		taskENTER_CRITICAL(&rateLock);
+		uint32_t bytes = periodBytes;
+		uint32_t frames = periodFrames;
+		int64_t busy = periodBusy;
+		periodBytes = 0;
+		periodFrames = 0;
+		periodBusy = 0;
+		taskEXIT_CRITICAL(&rateLock);
+
+		pipeline_stats_t stats;
+		pipeline_get_stats(&stats);
+		uint32_t dropped = stats.dropped - last.dropped;
+		last = stats;
+		UBaseType_t depth = pipeline_depth();
+
+		if (frames > 0 && busy > 0) {
+			// Moving averages over a few periods
+			double alpha = (frameBytes == 0) ? 1.0 : 0.3;
+			capacity = capacity + alpha * (bytes * 1000000.0 / busy - capacity);
+			frameBytes = frameBytes + alpha * ((double)bytes / frames - frameBytes);
+			latency = latency + alpha * ((double)busy / frames - latency);
+		} else if (depth == 0 && dropped == 0) {
+			// Nothing was taken, nothing to learn
+			continue;
+		}
+
+		double demand = CONFIG_RATE_TARGET_FPS * frameBytes;
+		bool congested = (dropped > 0 || depth > 1 || (frames == 0 && depth > 0) || capacity < demand);
+#if CONFIG_RATE_LATENCY_MS
+		if (latency > CONFIG_RATE_LATENCY_MS * 1000.0) congested = true;
+#endif
+		bool spare = (!congested && depth == 0 && capacity > demand * RATE_HEADROOM);
+#if CONFIG_RATE_LATENCY_MS
+		if (latency > CONFIG_RATE_LATENCY_MS * 500.0) spare = false;
+#endif
+		ESP_LOGD(TAG, "capacity=%.0fB/s frame=%.0fB latency=%.0fms depth=%d dropped=%"PRIu32" congested=%d spare=%d",
+			capacity, frameBytes, latency / 1000, (int)depth, dropped, congested, spare);
+
+		int newQuality = quality;
+		int newStep = step;
+		if (congested) {
+			sparePeriods = 0;
+			if (quality < worst) {
+				newQuality = quality + RATE_QUALITY_UP;
+				if (newQuality > worst) newQuality = worst;
+#if CONFIG_RATE_FRAMESIZE
+			} else if (step > 0 && ++congestedPeriods >= RATE_HOLD_DOWN) {
+				newStep = step - 1;
+#endif
+			}
+		} else if (spare) {
+			congestedPeriods = 0;
+			if (quality > best) {
+				newQuality = quality - RATE_QUALITY_DOWN;
+#if CONFIG_RATE_FRAMESIZE
+			} else if (step < maxStep && ++sparePeriods >= RATE_HOLD_UP) {
+				newStep = step + 1;
+#endif
+			}
+		} else {
+			congestedPeriods = 0;
+			sparePeriods = 0;
+		}
+
+		if (newStep != step) {
+			// Start the new frame size halfway, so it can go either way
+			ESP_LOGI(TAG, "framesize %d -> %d", framesizes[step], framesizes[newStep]);
+			sensor->set_framesize(sensor, framesizes[newStep]);
+			step = newStep;
+			newQuality = (best + worst) / 2;
+			frameBytes = 0;
+			congestedPeriods = 0;
+			sparePeriods = 0;
+		}
+		if (newQuality != quality) {
+			ESP_LOGI(TAG, "quality %d -> %d capacity=%.0fB/s demand=%.0fB/s depth=%d",
+				quality, newQuality, capacity, demand, (int)depth);
+			sensor->set_quality(sensor, newQuality);
+			quality = newQuality;
+		}
+	}
+}
+#endif
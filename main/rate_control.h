@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Function prototypes
+void rate_control_report(size_t bytes, int frames, int64_t upload_us);
+void rate_control_task(void *pvParameters);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,230 @@
+/*
+   RTP payload format for JPEG, RFC 2435.
+
+   The JPEG headers are not sent. The receiver rebuilds them from the
+   type, the size and the quantization tables carried in the first packet
+   of each frame (Q = 255), and uses the standard Huffman tables, which
+   are also the ones the sensors and jpge use. The scan data is split
+   so that every packet, headers included, is at most payload_size bytes
+   of UDP payload, and the marker bit is set on the last packet of a frame.
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_random.h"
+
+#include "rtp_jpeg.h"
+
+#define RTP_VERSION			2
+#define RTP_PT_JPEG			26
+#define RTP_HEADER_SIZE		12
+#define JPEG_HEADER_SIZE	8
+#define RESTART_HEADER_SIZE	4
+#define QTABLE_HEADER_SIZE	4
+#define QTABLE_SIZE			128
+
+// Dynamic quantization tables, sent in-band
+#define RTP_JPEG_Q			255
+// Types of RFC 2435 3.1.3, +64 when restart markers are used
+#define RTP_JPEG_TYPE_422	0
+#define RTP_JPEG_TYPE_420	1
+#define RTP_JPEG_TYPE_RESTART	64
+
+// UDP payload of a 1500 byte Ethernet/WiFi MTU: 1500 - 20 (IPv4) - 8 (UDP)
+#define MAX_PAYLOAD_SIZE	1472
+
+typedef struct {
+	uint8_t type;
+	uint16_t width;
+	uint16_t height;
+	uint16_t restartInterval;
+	const uint8_t *qtables[2];
+	const uint8_t *scan;
+	size_t scanLen;
+} jpeg_info_t;
+
+static const char *TAG = "RTP";
+
+static uint8_t packet[MAX_PAYLOAD_SIZE];
+static size_t payloadSize = 1400;
+static uint16_t sequence;
+static uint32_t ssrc;
+
+void rtp_jpeg_init(size_t payload_size)
+{
+	if (payload_size > MAX_PAYLOAD_SIZE) payload_size = MAX_PAYLOAD_SIZE;
+	if (payload_size < 256) payload_size = 256;  // Room for the headers of the first packet
+	payloadSize = payload_size;
+	sequence = esp_random();
+	ssrc = esp_random();
+}
+
+// Find what RFC 2435 needs in a baseline JPEG
+static bool jpeg_parse(const uint8_t *jpeg, size_t len, jpeg_info_t *info)
+{
+	memset(info, 0, sizeof(jpeg_info_t));
+	if (len < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) return false;
+	bool sof = false;
+	size_t i = 2;
+	while (i + 4 <= len) {
+		if (jpeg[i] != 0xFF) return false;
+		uint8_t marker = jpeg[i + 1];
+		if (marker == 0xFF) {
+			// Fill byte
+			i++;
+			continue;
+		}
+		size_t segmentLen = (jpeg[i + 2] << 8) | jpeg[i + 3];
+		const uint8_t *segment = jpeg + i + 4;
+		if (i + 2 + segmentLen > len) return false;
+
+		switch (marker) {
+		case 0xDB: // DQT, one or more tables
+			for (size_t j = 0; j + 65 <= segmentLen - 2; j += 65) {
+				uint8_t precision = segment[j] >> 4;
+				uint8_t id = segment[j] & 0x0F;
+				if (precision != 0 || id > 1) {
+					ESP_LOGW(TAG, "unsupported DQT precision=%d id=%d", precision, id);
+					return false;
+				}
+				info->qtables[id] = segment + j + 1;
+			}
+			break;
+		case 0xC0: // SOF0, baseline
+		case 0xC1:
+			info->height = (segment[1] << 8) | segment[2];
+			info->width = (segment[3] << 8) | segment[4];
+			if (segment[5] != 3 || segment[10] != 0x11 || segment[13] != 0x11) {
+				ESP_LOGW(TAG, "unsupported components=%d", segment[5]);
+				return false;
+			}
+			if (segment[7] == 0x21) {
+				info->type = RTP_JPEG_TYPE_422;
+			} else if (segment[7] == 0x22) {
+				info->type = RTP_JPEG_TYPE_420;
+			} else {
+				ESP_LOGW(TAG, "unsupported sampling=0x%02x", segment[7]);
+				return false;
+			}
+			sof = true;
+			break;
+		case 0xC2: // Progressive and the others
+		case 0xC3:
+			ESP_LOGW(TAG, "not a baseline JPEG");
+			return false;
+		case 0xDD: // DRI
+			info->restartInterval = (segment[0] << 8) | segment[1];
+			break;
+		case 0xDA: // SOS, the scan runs up to EOI
+			if (sof == false || info->qtables[0] == NULL) return false;
+			info->scan = jpeg + i + 2 + segmentLen;
+			info->scanLen = len - (i + 2 + segmentLen);
+			// There may be padding after EOI
+			while (info->scanLen >= 2) {
+				if (info->scan[info->scanLen - 2] == 0xFF && info->scan[info->scanLen - 1] == 0xD9) {
+					info->scanLen -= 2;
+					break;
+				}
+				info->scanLen--;
+			}
+			if (info->restartInterval) info->type += RTP_JPEG_TYPE_RESTART;
+			return true;
+		}
+		i += 2 + segmentLen;
+	}
+	return false;
+}
+
+// Send one JPEG frame to every destination
+esp_err_t rtp_jpeg_send(int fd, const struct sockaddr_in *dests, int count, const uint8_t *jpeg, size_t len, int64_t timestamp_us)
+{
+	jpeg_info_t info;
+	if (jpeg_parse(jpeg, len, &info) == false) {
+		ESP_LOGW(TAG, "can't packetize JPEG len=%zu", len);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+	// Sizes are sent in units of 8 pixels in one byte
+	if (info.width > 2040 || info.height > 2040) {
+		ESP_LOGW(TAG, "frame too large %dx%d", info.width, info.height);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+
+	uint32_t timestamp = (uint32_t)(timestamp_us * 90 / 1000);
+	size_t offset = 0;
+	while (offset < info.scanLen) {
+		uint8_t *p = packet;
+		// The headers count in the packet size, the first packet also carries the tables
+		size_t headers = RTP_HEADER_SIZE + JPEG_HEADER_SIZE;
+		if (info.restartInterval) headers += RESTART_HEADER_SIZE;
+		if (offset == 0) headers += QTABLE_HEADER_SIZE + QTABLE_SIZE;
+		size_t fragment = info.scanLen - offset;
+		if (fragment > payloadSize - headers) fragment = payloadSize - headers;
+		bool last = (offset + fragment == info.scanLen);
+
+		// RTP header
+		*p++ = RTP_VERSION << 6;
+		*p++ = (last ? 0x80 : 0) | RTP_PT_JPEG;
+		*p++ = sequence >> 8;
+		*p++ = sequence;
+		*p++ = timestamp >> 24;
+		*p++ = timestamp >> 16;
+		*p++ = timestamp >> 8;
+		*p++ = timestamp;
+		*p++ = ssrc >> 24;
+		*p++ = ssrc >> 16;
+		*p++ = ssrc >> 8;
+		*p++ = ssrc;
+
+		// Main JPEG header
+		*p++ = 0;
+		*p++ = offset >> 16;
+		*p++ = offset >> 8;
+		*p++ = offset;
+		*p++ = info.type;
+		*p++ = RTP_JPEG_Q;
+		*p++ = info.width / 8;
+		*p++ = info.height / 8;
+
+		if (info.restartInterval) {
+			// Whole frame, first and last restart interval
+			*p++ = info.restartInterval >> 8;
+			*p++ = info.restartInterval;
+			*p++ = 0xFF;
+			*p++ = 0xFF;
+		}
+
+		if (offset == 0) {
+			// Quantization tables in the first packet only
+			*p++ = 0;
+			*p++ = 0;
+			*p++ = 0;
+			*p++ = QTABLE_SIZE;
+			for (int i = 0; i < 2; i++) {
+				// Luma and chroma. When there is one table, both use it
+				const uint8_t *table = info.qtables[i] ? info.qtables[i] : info.qtables[0];
+				memcpy(p, table, 64);
+				p += 64;
+			}
+		}
+
+		memcpy(p, info.scan + offset, fragment);
+		p += fragment;
+		for (int i = 0; i < count; i++) {
+			int ret = sendto(fd, packet, p - packet, 0, (const struct sockaddr *)&dests[i], sizeof(dests[i]));
+			if (ret < 0 && errno == ENOMEM) {
+				// lwip is out of buffers, give the driver a moment to send
+				vTaskDelay(1);
+				ret = sendto(fd, packet, p - packet, 0, (const struct sockaddr *)&dests[i], sizeof(dests[i]));
+			}
+			if (ret < 0) ESP_LOGD(TAG, "sendto fail errno=%d", errno);
+		}
+		sequence++;
+		offset += fragment;
+	}
+	return ESP_OK;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "lwip/sockets.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Function prototypes
+void rtp_jpeg_init(size_t payload_size);
+esp_err_t rtp_jpeg_send(int fd, const struct sockaddr_in *dests, int count, const uint8_t *jpeg, size_t len, int64_t timestamp_us);
+
+#ifdef __cplusplus
+}
+#endif
@@ -9,34 +9,361 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
-#include "mdns.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include "lwip/netdb.h"
 
+#include "esp_camera.h"
+#include "img_converters.h"
 #include "cmd.h"
+#include "camera_helpers.h"
+#include "burst.h"
+#include "pipeline.h"
+#include "frame_broker.h"
 
 #if CONFIG_SHUTTER_TCP
 
+/*
+   Framed binary protocol.
+
+   Request:  command(1) id(1) payload length(2, big endian) payload
+   Response: command(1) id(1) status(1) reserved(1) payload length(4, big endian) payload
+
+   The id of a request is copied to its responses, so a client can keep
+   several cameras' answers apart on one connection. A client that sends
+   anything else is treated as a plain shutter, like before: every
+   message takes a picture for upload and is answered with "OK" or "FAIL".
+*/
+#define TCP_CMD_TAKE		0x01	// Response payload is a JPEG
+#define TCP_CMD_BURST		0x02	// Payload: count(1). One TAKE response per picture
+#define TCP_CMD_QUALITY		0x03	// Payload: JPEG quality(1), 0-63
+#define TCP_CMD_STATS		0x04	// Response payload is text, one "name=value" per line
+
+#define TCP_STATUS_OK		0x00
+#define TCP_STATUS_FAIL		0x01
+#define TCP_STATUS_BAD_REQUEST	0x02
+#define TCP_STATUS_UNKNOWN	0x03
+
+#define REQUEST_HEADER_SIZE	4
+#define RESPONSE_HEADER_SIZE	8
+
+typedef struct {
+	int sock;
+	char addr_str[64];
+	uint8_t rx[128];
+	size_t rxLen;
+	uint8_t tx[256];			// Response header and small payloads
+	size_t txLen;
+	size_t txSent;
+	frame_handle_t *frame;		// JPEG going out after tx
+	size_t frameSent;
+	uint8_t burstId;
+	int burstRemain;			// Pictures of a burst not taken yet
+} client_t;
+
 extern QueueHandle_t xQueueCmd;
 
 static const char *TAG = "TCP";
 
-void tcp_server(void *pvParameters)
+static client_t clients[CONFIG_TCP_MAX_CLIENTS];
+
+static uint32_t picturesSent = 0;
+static uint32_t bytesSent = 0;
+static uint32_t captureFailed = 0;
+
+static bool client_busy(client_t *client)
 {
-	ESP_LOGI(TAG, "Start TCP PORT=%d", CONFIG_TCP_PORT);
+	return client->txLen > 0 || client->frame != NULL || client->burstRemain > 0;
+}
+
+static void client_close(client_t *client)
+{
+	ESP_LOGI(TAG, "Close socket %d", client->sock);
+	close(client->sock);
+	if (client->frame != NULL) frame_broker_release(client->frame);
+	memset(client, 0, sizeof(client_t));
+	client->sock = -1;
+}
+
+// Put a response into the transmit buffer
+static void client_respond(client_t *client, uint8_t command, uint8_t id, uint8_t status, const void *payload, size_t len, size_t frameLen)
+{
+	size_t total = len + frameLen;
+	uint8_t *p = client->tx;
+	p[0] = command;
+	p[1] = id;
+	p[2] = status;
+	p[3] = 0;
+	p[4] = total >> 24;
+	p[5] = total >> 16;
+	p[6] = total >> 8;
+	p[7] = total;
+	if (len > sizeof(client->tx) - RESPONSE_HEADER_SIZE) len = sizeof(client->tx) - RESPONSE_HEADER_SIZE;
+	if (len > 0) memcpy(p + RESPONSE_HEADER_SIZE, payload, len);
+	client->txLen = RESPONSE_HEADER_SIZE + len;
+	client->txSent = 0;
+}
+
+// Take a picture and queue a copy of it as the response.
+// A slow client holds the copy, not a camera frame buffer, so the next capture never waits for it.
+static void client_take(client_t *client, uint8_t command, uint8_t id)
+{
+	frame_handle_t *frame = frame_broker_get(0);
+	if (frame != NULL) {
+		uint8_t *jpg_buf = NULL;
+		size_t jpg_len = 0;
+		size_t width = frame->width;
+		size_t height = frame->height;
+		int64_t timestamp = frame->timestamp;
+		bool copied = false;
+		if (frame->format == PIXFORMAT_JPEG) {
+			jpg_buf = heap_caps_malloc(frame->len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+			if (jpg_buf != NULL) {
+				memcpy(jpg_buf, frame->buf, frame->len);
+				jpg_len = frame->len;
+				copied = true;
+			} else {
+				ESP_LOGE(TAG, "heap_caps_malloc fail. len=%zu", frame->len);
+			}
+		} else {
+			copied = fmt2jpg(frame->buf, frame->len, width, height, frame->format, camera_jpeg_quality(), &jpg_buf, &jpg_len);
+			timestamp = esp_timer_get_time();
+		}
+		frame_broker_release(frame);
+		frame = NULL;
+		if (copied) {
+			frame = frame_broker_wrap(jpg_buf, jpg_len, width, height, PIXFORMAT_JPEG, timestamp);
+			if (frame == NULL) free(jpg_buf);
+		}
+	}
+	if (frame == NULL) {
+		ESP_LOGE(TAG, "Camera Capture Failed");
+		captureFailed++;
+		client_respond(client, command, id, TCP_STATUS_FAIL, NULL, 0, 0);
+		return;
+	}
+	client->frame = frame;
+	client->frameSent = 0;
+	client_respond(client, command, id, TCP_STATUS_OK, NULL, 0, frame->len);
+}
+
+static void client_stats(client_t *client, uint8_t id)
+{
+	int clientCount = 0;
+	for (int i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+		if (clients[i].sock >= 0) clientCount++;
+	}
+	pipeline_stats_t stats;
+	pipeline_get_stats(&stats);
+	char text[RESPONSE_HEADER_SIZE + 200];
+	int len = snprintf(text, sizeof(text),
+		"uptime_ms=%"PRId64"\nclients=%d\npictures=%"PRIu32"\nbytes=%"PRIu32"\ncapture_failed=%"PRIu32"\n"
+		"uploaded=%"PRIu32"\nupload_failed=%"PRIu32"\ndropped=%"PRIu32"\n",
+		esp_timer_get_time() / 1000, clientCount, picturesSent, bytesSent, captureFailed,
+		stats.uploaded, stats.failed, stats.dropped);
+	client_respond(client, TCP_CMD_STATS, id, TCP_STATUS_OK, text, len, 0);
+}
+
+static void client_quality(client_t *client, uint8_t id, const uint8_t *payload, size_t len)
+{
+	sensor_t *sensor = esp_camera_sensor_get();
+	if (len != 1 || payload[0] > 63 || sensor == NULL) {
+		client_respond(client, TCP_CMD_QUALITY, id, TCP_STATUS_BAD_REQUEST, NULL, 0, 0);
+		return;
+	}
+	int ret = sensor->set_quality(sensor, payload[0]);
+	ESP_LOGI(TAG, "set_quality %d ret=%d", payload[0], ret);
+	client_respond(client, TCP_CMD_QUALITY, id, (ret == 0) ? TCP_STATUS_OK : TCP_STATUS_FAIL, NULL, 0, 0);
+}
+
+// Old clients send text and expect "OK" or "FAIL"
+static void client_legacy(client_t *client)
+{
+	client->rx[(client->rxLen < sizeof(client->rx)) ? client->rxLen : sizeof(client->rx) - 1] = 0;
+	ESP_LOGI(TAG, "Received %zu bytes from %s:", client->rxLen, client->addr_str);
+	ESP_LOGI(TAG, "%s", (char *)client->rx);
+	client->rxLen = 0;
+
 	CMD_t cmdBuf;
 	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	cmdBuf.command = CMD_TAKE;
+	if (burst_parse((char *)client->rx, &cmdBuf) == false) burst_default(&cmdBuf);
+	if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
+		ESP_LOGE(TAG, "xQueueSend fail");
+		strcpy((char *)client->tx, "FAIL");
+	} else {
+		strcpy((char *)client->tx, "OK");
+	}
+	client->txLen = strlen((char *)client->tx);
+	client->txSent = 0;
+}
+
+// Handle the next complete request, unless the client is still busy with the previous one.
+// Return false when the client must be dropped
+static bool client_parse(client_t *client)
+{
+	if (client_busy(client) || client->rxLen == 0) return true;
+	uint8_t command = client->rx[0];
+	if (command < TCP_CMD_TAKE || command > TCP_CMD_STATS) {
+		client_legacy(client);
+		return true;
+	}
+	if (client->rxLen < REQUEST_HEADER_SIZE) return true;
+
+	uint8_t id = client->rx[1];
+	size_t len = (client->rx[2] << 8) | client->rx[3];
+	if (REQUEST_HEADER_SIZE + len > sizeof(client->rx)) {
+		ESP_LOGE(TAG, "request too large. len=%zu", len);
+		return false;
+	}
+	if (client->rxLen < REQUEST_HEADER_SIZE + len) return true;
+	uint8_t *payload = client->rx + REQUEST_HEADER_SIZE;
+	ESP_LOGI(TAG, "command=0x%02x id=%d len=%zu from %s", command, id, len, client->addr_str);
+
+	switch (command) {
+	case TCP_CMD_TAKE:
+		client_take(client, TCP_CMD_TAKE, id);
+		break;
+	case TCP_CMD_BURST:
+		if (len != 1 || payload[0] == 0) {
+			client_respond(client, TCP_CMD_BURST, id, TCP_STATUS_BAD_REQUEST, NULL, 0, 0);
+		} else {
+			client->burstId = id;
+			client->burstRemain = payload[0];
+		}
+		break;
+	case TCP_CMD_QUALITY:
+		client_quality(client, id, payload, len);
+		break;
+	case TCP_CMD_STATS:
+		client_stats(client, id);
+		break;
+	}
+
+	// Keep what follows for the next request
+	client->rxLen -= REQUEST_HEADER_SIZE + len;
+	memmove(client->rx, client->rx + REQUEST_HEADER_SIZE + len, client->rxLen);
+	return true;
+}
+
+// Send as much as the socket takes without blocking.
+// Return false when the client must be dropped
+static bool client_send(client_t *client)
+{
+	while (client->txSent < client->txLen) {
+		int sent = send(client->sock, client->tx + client->txSent, client->txLen - client->txSent, MSG_DONTWAIT);
+		if (sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK);
+		client->txSent += sent;
+		bytesSent += sent;
+	}
+	client->txLen = 0;
+	client->txSent = 0;
+
+	if (client->frame != NULL) {
+		frame_handle_t *frame = client->frame;
+		while (client->frameSent < frame->len) {
+			int sent = send(client->sock, frame->buf + client->frameSent, frame->len - client->frameSent, MSG_DONTWAIT);
+			if (sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK);
+			client->frameSent += sent;
+			bytesSent += sent;
+		}
+		ESP_LOGI(TAG, "sent picture len=%zu to %s", frame->len, client->addr_str);
+		picturesSent++;
+		frame_broker_release(frame);
+		client->frame = NULL;
+	}
+	return true;
+}
+
+// Move the client on as far as it goes: next picture of a burst, next request, send
+static bool client_pump(client_t *client)
+{
+	while (1) {
+		if (client_send(client) == false) return false;
+		if (client->txLen > 0 || client->frame != NULL) return true;
+		if (client->burstRemain > 0) {
+			client->burstRemain--;
+			client_take(client, TCP_CMD_BURST, client->burstId);
+			continue;
+		}
+		if (client->rxLen == 0) return true;
+		size_t rxLen = client->rxLen;
+		if (client_parse(client) == false) return false;
+		// Wait for the rest of an incomplete request
+		if (client->rxLen == rxLen && client_busy(client) == false) return true;
+	}
+}
+
+static void client_accept(int listen_sock)
+{
+	struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
+	socklen_t addr_len = sizeof(source_addr);
+	int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+	if (sock < 0) {
+		ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+		return;
+	}
+
+	client_t *client = NULL;
+	for (int i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+		if (clients[i].sock < 0) {
+			client = &clients[i];
+			break;
+		}
+	}
+	if (client == NULL) {
+		ESP_LOGW(TAG, "Too many clients");
+		close(sock);
+		return;
+	}
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	memset(client, 0, sizeof(client_t));
+	client->sock = sock;
+	// Get the sender's ip address as string
+	if (source_addr.sin6_family == PF_INET) {
+		inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, client->addr_str, sizeof(client->addr_str) - 1);
+	} else if (source_addr.sin6_family == PF_INET6) {
+		inet6_ntoa_r(source_addr.sin6_addr, client->addr_str, sizeof(client->addr_str) - 1);
+	}
+	ESP_LOGI(TAG, "Socket accepted from %s", client->addr_str);
+}
+
+// Read what has arrived.
+// Return false when the client must be dropped
+static bool client_receive(client_t *client)
+{
+	int len = recv(client->sock, client->rx + client->rxLen, sizeof(client->rx) - client->rxLen, MSG_DONTWAIT);
+	// Error occurred during receiving
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+		ESP_LOGE(TAG, "recv failed: errno %d", errno);
+		return false;
+	}
+	// Connection closed by client
+	else if (len == 0) {
+		ESP_LOGI(TAG, "Connection closed");
+		return false;
+	}
+	client->rxLen += len;
+	return true;
+}
+
+void tcp_server(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start TCP PORT=%d", CONFIG_TCP_PORT);
 
-	char rx_buffer[128];
-	char tx_buffer[128];
 	char addr_str[128];
 	int addr_family;
 	int ip_protocol;
@@ -74,69 +401,54 @@ void tcp_server(void *pvParameters)
 	}
 	ESP_LOGI(TAG, "Socket bound, port %d", CONFIG_TCP_PORT);
 
-	err = listen(listen_sock, 1);
+	err = listen(listen_sock, CONFIG_TCP_MAX_CLIENTS);
 	if (err != 0) {
 		ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
 		return;
 	}
 	ESP_LOGI(TAG, "Socket listening");
 
-	while (1) {
-		struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
-		//uint addr_len = sizeof(source_addr);
-		socklen_t addr_len = sizeof(source_addr);
-		int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-		if (sock < 0) {
-			ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
-			break;
-		}
-		ESP_LOGI(TAG, "Socket accepted");
-
-		while (1) {
-			int len = recv(sock, rx_buffer, sizeof(rx_buffer) - 1, 0);
-			// Error occurred during receiving
-			if (len < 0) {
-				ESP_LOGE(TAG, "recv failed: errno %d", errno);
-				break;
-			}
-			// Connection closed by client
-			else if (len == 0) {
-				ESP_LOGI(TAG, "Connection closed");
-				break;
-			}
+	for (int i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+		clients[i].sock = -1;
+	}
 
-			// Data received
-			// Get the sender's ip address as string
-			if (source_addr.sin6_family == PF_INET) {
-				inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-			} else if (source_addr.sin6_family == PF_INET6) {
-				inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
+	while (1) {
+		// Read from idle clients only, busy ones are waiting to send
+		fd_set readfds;
+		fd_set writefds;
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		FD_SET(listen_sock, &readfds);
+		int maxfd = listen_sock;
+		for (int i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+			client_t *client = &clients[i];
+			if (client->sock < 0) continue;
+			if (client_busy(client)) {
+				FD_SET(client->sock, &writefds);
+			} else {
+				FD_SET(client->sock, &readfds);
 			}
+			if (client->sock > maxfd) maxfd = client->sock;
+		}
 
-			rx_buffer[len] = 0; // Null-terminate whatever we received and treat like a string
-			ESP_LOGI(TAG, "Received %d bytes from %s:", len, addr_str);
-			ESP_LOGI(TAG, "%s", rx_buffer);
-			if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
-				ESP_LOGE(TAG, "xQueueSend fail");
-				strcpy(tx_buffer, "FAIL");
-				int err = send(sock, tx_buffer, strlen(tx_buffer), 0);
-				if (err < 0) {
-					ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-					break;
-				}
+		int ready = select(maxfd + 1, &readfds, &writefds, NULL, NULL);
+		if (ready < 0) {
+			ESP_LOGE(TAG, "select failed: errno %d", errno);
+			break;
+		}
 
-			} else {
-				strcpy(tx_buffer, "OK");
-				int err = send(sock, tx_buffer, strlen(tx_buffer), 0);
-				if (err < 0) {
-					ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-					break;
-				}
+		for (int i = 0; i < CONFIG_TCP_MAX_CLIENTS; i++) {
+			client_t *client = &clients[i];
+			if (client->sock < 0) continue;
+			bool alive = true;
+			if (FD_ISSET(client->sock, &readfds)) alive = client_receive(client);
+			if (alive && (FD_ISSET(client->sock, &readfds) || FD_ISSET(client->sock, &writefds))) {
+				alive = client_pump(client);
 			}
+			if (alive == false) client_close(client);
 		}
 
-		ESP_LOGI(TAG, "Close socket");
-		close(sock);
+		if (FD_ISSET(listen_sock, &readfds)) client_accept(listen_sock);
 	}
 
 	/* Don't reach here. */
@@ -11,10 +11,12 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -22,6 +24,9 @@
 #include "lwip/netdb.h"
 
 #include "cmd.h"
+#include "burst.h"
+#include "frame_broker.h"
+#include "rtp_jpeg.h"
 
 #if CONFIG_SHUTTER_UDP
 
@@ -29,12 +34,123 @@ extern QueueHandle_t xQueueCmd;
 
 static const char *TAG = "UDP";
 
+#if CONFIG_RTP_STREAM
+// A subscriber that doesn't subscribe again within this time is dropped
+#define SUBSCRIBE_TIMEOUT_US	60000000LL
+
+typedef struct {
+	struct sockaddr_in addr;
+	int64_t expires;
+} subscriber_t;
+
+static subscriber_t subscribers[CONFIG_RTP_MAX_SUBSCRIBERS];
+static int subscriberCount = 0;
+static portMUX_TYPE subscriberLock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t rtpTask;
+
+// "subscribe [port]" starts the stream to the sender, to its source port by default.
+// "unsubscribe [port]" stops it.
+// Return false when the datagram is not a subscription
+static bool rtp_subscription(const char *buffer, const struct sockaddr_in *sender)
+{
+	bool subscribe;
+	const char *arg;
+	if (strncmp(buffer, "subscribe", 9) == 0) {
+		subscribe = true;
+		arg = buffer + 9;
+	} else if (strncmp(buffer, "unsubscribe", 11) == 0) {
+		subscribe = false;
+		arg = buffer + 11;
+	} else {
+		return false;
+	}
+
+	struct sockaddr_in addr = *sender;
+	int port = atoi(arg);
+	if (port > 0 && port < 65536) addr.sin_port = htons(port);
+
+	bool added = false;
+	portENTER_CRITICAL(&subscriberLock);
+	int i;
+	for (i = 0; i < subscriberCount; i++) {
+		if (subscribers[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr && subscribers[i].addr.sin_port == addr.sin_port) break;
+	}
+	if (subscribe) {
+		if (i == subscriberCount && subscriberCount < CONFIG_RTP_MAX_SUBSCRIBERS) {
+			subscribers[subscriberCount++].addr = addr;
+			added = true;
+		}
+		if (i < subscriberCount) subscribers[i].expires = esp_timer_get_time() + SUBSCRIBE_TIMEOUT_US;
+	} else if (i < subscriberCount) {
+		subscribers[i] = subscribers[--subscriberCount];
+	}
+	int count = subscriberCount;
+	portEXIT_CRITICAL(&subscriberLock);
+
+	ESP_LOGI(TAG, "%s port=%d subscribers=%d", subscribe ? "subscribe" : "unsubscribe", ntohs(addr.sin_port), count);
+	if (subscribe && i == count && added == false) ESP_LOGW(TAG, "too many subscribers");
+	if (added) xTaskNotifyGive(rtpTask);
+	return true;
+}
+
+// Copy the live subscribers, dropping the expired ones
+static int rtp_subscribers(struct sockaddr_in *dests)
+{
+	int64_t now = esp_timer_get_time();
+	portENTER_CRITICAL(&subscriberLock);
+	for (int i = 0; i < subscriberCount; ) {
+		if (subscribers[i].expires < now) {
+			subscribers[i] = subscribers[--subscriberCount];
+		} else {
+			dests[i] = subscribers[i].addr;
+			i++;
+		}
+	}
+	int count = subscriberCount;
+	portEXIT_CRITICAL(&subscriberLock);
+	return count;
+}
+
+// Send frames to the subscribers from the UDP socket
+static void rtp_stream(void *pvParameters)
+{
+	int fd = (int)(intptr_t)pvParameters;
+	ESP_LOGI(TAG, "Start RTP stream. fps=%d payload=%d", CONFIG_RTP_MAX_FPS, CONFIG_RTP_PAYLOAD_SIZE);
+	rtp_jpeg_init(CONFIG_RTP_PAYLOAD_SIZE);
+	struct sockaddr_in dests[CONFIG_RTP_MAX_SUBSCRIBERS];
+	const TickType_t period = pdMS_TO_TICKS(1000 / CONFIG_RTP_MAX_FPS);
+	uint32_t lastSeq = 0;
+	TickType_t lastWake = xTaskGetTickCount();
+
+	while(1) {
+		int count = rtp_subscribers(dests);
+		if (count == 0) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			lastWake = xTaskGetTickCount();
+			continue;
+		}
+
+		// Share a frame taken for somebody else when it's recent enough
+		frame_handle_t *frame = frame_broker_get(1000000LL / CONFIG_RTP_MAX_FPS);
+		if (frame == NULL) {
+			vTaskDelay(period);
+			continue;
+		}
+		if (frame->seq != lastSeq && frame->format == PIXFORMAT_JPEG) {
+			lastSeq = frame->seq;
+			rtp_jpeg_send(fd, dests, count, frame->buf, frame->len, frame->timestamp);
+		}
+		frame_broker_release(frame);
+		vTaskDelayUntil(&lastWake, period);
+	}
+}
+#endif
+
 void udp_server(void *pvParameters)
 {
 	ESP_LOGI(TAG, "Start UDP PORT=%d", CONFIG_UDP_PORT);
 	CMD_t cmdBuf;
 	cmdBuf.taskHandle = xTaskGetCurrentTaskHandle();
-	cmdBuf.command = CMD_TAKE;
 
 	/* set up address to recvfrom */
 	struct sockaddr_in addr;
@@ -61,6 +177,10 @@ void udp_server(void *pvParameters)
 	ret = lwip_bind(fd, (struct sockaddr *)&addr, sizeof(addr));
 	LWIP_ASSERT("ret >= 0", ret >= 0);
 
+#if CONFIG_RTP_STREAM
+	xTaskCreate(rtp_stream, "RTP", 1024*4, (void *)(intptr_t)fd, 2, &rtpTask);
+#endif
+
 	/* senderInfo data */
 	char buffer[64];
 	struct sockaddr_in senderInfo;
@@ -77,6 +197,11 @@ void udp_server(void *pvParameters)
 			ESP_LOGI(TAG, "lwip_recv buffer=%s",buffer);
 			inet_ntop(AF_INET, &senderInfo.sin_addr, senderstr, sizeof(senderstr));
 			ESP_LOGI(TAG, "recvfrom : %s, port=%d", senderstr, ntohs(senderInfo.sin_port));
+#if CONFIG_RTP_STREAM
+			if (rtp_subscription(buffer, &senderInfo)) continue;
+#endif
+			// "burst ..." asks for a burst, anything else is a shutter press
+			if (burst_parse(buffer, &cmdBuf) == false) burst_default(&cmdBuf);
 			if (xQueueSend(xQueueCmd, &cmdBuf, 10) != pdPASS) {
 				ESP_LOGE(TAG, "xQueueSend fail");
 			}
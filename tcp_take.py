@@ -0,0 +1,46 @@
+#!/usr/bin/python
+#-*- encoding: utf-8 -*-
+import socket
+import struct
+
+host = "esp32-camera.local" # esp32 hostname
+port = 49876
+
+TAKE = 0x01
+BURST = 0x02
+QUALITY = 0x03
+STATS = 0x04
+
+def request(client, command, id, payload=b''):
+	client.sendall(struct.pack('>BBH', command, id, len(payload)) + payload)
+
+def recv_all(client, length):
+	data = b''
+	while len(data) < length:
+		chunk = client.recv(length - len(data))
+		if not chunk: raise ConnectionError("connection closed")
+		data += chunk
+	return data
+
+def response(client):
+	command, id, status, _, length = struct.unpack('>BBBBI', recv_all(client, 8))
+	return command, id, status, recv_all(client, length)
+
+client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+
+client.connect((host, port))
+
+# Take 3 pictures in a row
+request(client, BURST, 1, bytes([3]))
+for i in range(3):
+	command, id, status, picture = response(client)
+	print("command={} id={} status={} length={}".format(command, id, status, len(picture)))
+	if status == 0:
+		with open("picture{}.jpg".format(i), "wb") as f:
+			f.write(picture)
+
+request(client, STATS, 2)
+command, id, status, stats = response(client)
+print(stats.decode())
+
+client.close()
@@ -0,0 +1,25 @@
+#!/usr/bin/python
+#-*- encoding: utf-8 -*-
+#
+# Keep the RTP/JPEG stream coming to this host.
+# Watch it with:
+# ffplay -protocol_whitelist file,udp,rtp -i rtp_jpeg.sdp
+
+from socket import *
+import time
+
+host = "esp32-camera.local" # esp32 hostname
+port = 49876
+rtp_port = 5004
+
+s = socket(AF_INET, SOCK_DGRAM)
+
+try:
+	while True:
+		# Subscriptions expire after 60 seconds
+		s.sendto("subscribe {}".format(rtp_port).encode(), (host, port))
+		time.sleep(30)
+except KeyboardInterrupt:
+	s.sendto("unsubscribe {}".format(rtp_port).encode(), (host, port))
+
+s.close()